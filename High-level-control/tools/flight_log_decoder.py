@@ -0,0 +1,120 @@
+"""Fetch and decode the ESP32 flight recorder.
+
+The firmware keeps binary log records in RTC memory (see the LOGGING section of
+Low-level-control/Project-lib.h). Sending "dump log" makes it print them raw as
+    LOG_BEGIN|<boot count>|<record count>
+    LOG|<seq>|<us>|<level>|<core>|<event>|<arg0>|<arg1>
+    LOG_END
+This script does the formatting on the PC side.
+
+Usage:
+    python tools/flight_log_decoder.py COM5              # ask the ESP32 for a dump
+    python tools/flight_log_decoder.py --file dump.txt   # decode a captured dump
+"""
+import argparse
+import sys
+import time
+
+LEVELS = {1: "ERROR", 2: "WARN", 3: "INFO", 4: "DEBUG"}
+
+FRUIT_STATES = ["NOT_ENGAGED", "INPUT_ENTERED", "INPUT_PASSED", "MEASURE_ENTERED",
+                "MEASURE_PROCESSING", "MEASURE_PASSED", "SORTING_PASSED"]
+
+COMMAND_TYPES = ["POINT_ACK", "SORT_DECISION"]
+
+BELT_STATIONS = ["input", "measure", "sorting"]
+RESYNC_ACTIONS = ["skip", "reassociate", "insert", "ignore"]
+RESYNC_CAUSES = ["overdue", "overtaken", "untracked", "bounce", "already_passed"]
+
+RESET_REASONS = ["UNKNOWN", "POWERON", "EXT", "SW", "PANIC", "INT_WDT", "TASK_WDT", "WDT",
+                 "DEEPSLEEP", "BROWNOUT", "SDIO"]
+
+
+def _name(table, index):
+    return table[index] if 0 <= index < len(table) else str(index)
+
+
+# Keep in sync with enum Log_event in Project-lib.h
+EVENTS = {
+    0: ("BOOT", lambda a, b: f"reset reason {_name(RESET_REASONS, a)}, boot #{b}"),
+    1: ("SYSTEM_STARTED", lambda a, b: f"measure times {a}, conveyor speed {b}%"),
+    2: ("TASKS_STOPPED", lambda a, b: ""),
+    3: ("STATE_RESET", lambda a, b: ""),
+    4: ("STOP_COMMAND", lambda a, b: ""),
+    5: ("HOMING_START", lambda a, b: f"direction {a}"),
+    6: ("HOMING_DONE", lambda a, b: f"{a} steps"),
+    7: ("STEPPER_RUN_BY_ANGLE", lambda a, b: f"{a / 1000:.3f} deg{' relative' if b else ''}"),
+    8: ("FRUIT_STATE", lambda a, b: f"fruit {a} -> {_name(FRUIT_STATES, b)}"),
+    9: ("SEND_QUEUE_FULL", lambda a, b: f"dropped fruit {a} {_name(FRUIT_STATES, b)}"),
+    10: ("COMMAND_DROPPED", lambda a, b: f"fruit {a} {_name(COMMAND_TYPES, b)}"),
+    11: ("LINE_OVERFLOW", lambda a, b: ""),
+    12: ("POINT_ACK", lambda a, b: f"fruit {a} point {b}"),
+    13: ("SEND_BLOCKED", lambda a, b: f"fruit {a} {_name(FRUIT_STATES, b)} waiting for critical lane"),
+    14: ("INFO_COLLAPSED", lambda a, b: f"discarded fruit {a} {_name(FRUIT_STATES, b)}"),
+    15: ("CHECKPOINT_WRITTEN", lambda a, b: f"sequence {a}, {b} us"),
+    16: ("RESUMED", lambda a, b: f"next fruit {a}{', gripper re-homed' if b else ''}"),
+    17: ("CHECKPOINT_FAILED", lambda a, b: f"{a} bytes written"),
+    18: ("VALVE_RESPONSE", lambda a, b: f"{('probe', 'gripper')[a // 2]} {(('extend', 'retract'), ('grip', 'release'))[a // 2][a % 2]} {b} ms"),
+    19: ("HEAP_ALLOCATED", lambda a, b: f"{a} bytes since boot, {b} free"),
+    20: ("STACK_LOW", lambda a, b: f"{('input', 'measure', 'sorting', 'executive', 'uart', 'loop')[a]} task {b} bytes free"),
+    21: ("CLOCK_SYNC", lambda a, b: f"offset moved {a} us, round trip {b} us"),
+    22: ("FRUIT_MISSING", lambda a, b: f"fruit {a} never reached the {_name(BELT_STATIONS, b)} sensor"),
+    23: ("FRUIT_EXTRA", lambda a, b: f"unexpected fruit at the {_name(BELT_STATIONS, a)} sensor" + (f", {b} mm from the expected one" if b else "")),
+    24: ("SIZE_REJECTED", lambda a, b: f"fruit {a} is {b} mm, outside the size limits"),
+    25: ("RESYNC", lambda a, b: f"{_name(BELT_STATIONS, b // 100)} {_name(RESYNC_ACTIONS, b // 10 % 10)} fruit {a}: {_name(RESYNC_CAUSES, b % 10)}"),
+    26: ("POINT_ANGLE_CUT", lambda a, b: f"point angle {a} deg does not fit the point layout, cut to {b} deg"),
+}
+
+
+def decode_line(line):
+    parts = line.strip().split("|")
+    if parts[0] == "LOG_BEGIN" and len(parts) >= 3:
+        return f"--- flight log: boot #{parts[1]}, {parts[2]} records ---"
+    if parts[0] != "LOG" or len(parts) < 8:
+        return None
+
+    seq, us, level, core, event, a0, a1 = (int(p) for p in parts[1:8])
+    name, describe = EVENTS.get(event, (f"EVENT_{event}", lambda a, b: f"{a} {b}"))
+    return f"{seq:>8} {us / 1e6:12.6f}s {LEVELS.get(level, level):<5} core{core} {name:<22} {describe(a0, a1)}"
+
+
+def read_dump_from_serial(port, timeout_s=5.0):
+    import serial
+
+    lines = []
+    with serial.Serial(port, 115200, timeout=0.5) as esp:
+        esp.write(b"dump log\n")
+        deadline = time.time() + timeout_s
+        while time.time() < deadline:
+            line = esp.readline().decode("utf-8", errors="ignore").strip()
+            if not line:
+                continue
+            lines.append(line)
+            if line == "LOG_END":
+                break
+    return lines
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("port", nargs="?", help="serial port of the ESP32")
+    parser.add_argument("--file", help="decode a captured dump instead of reading the port")
+    args = parser.parse_args()
+
+    if args.file:
+        with open(args.file, encoding="utf-8", errors="ignore") as f:
+            lines = f.readlines()
+    elif args.port:
+        lines = read_dump_from_serial(args.port)
+    else:
+        parser.error("give a serial port or --file")
+
+    for line in lines:
+        decoded = decode_line(line)
+        if decoded is not None:
+            print(decoded)
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
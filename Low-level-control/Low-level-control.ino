@@ -3,11 +3,23 @@
 void setup() 
 {
   Serial.begin(115200);
+#if RS485_HALF_DUPLEX
+  // The UART raises DE while it transmits
+  Serial.setPins(-1, -1, -1, BOARD.rs485_de_pin);
+  Serial.setMode(UART_MODE_RS485_HALF_DUPLEX);
+#endif
+  flight_log_init();
   initialize_system();
+  memory_seal();
 }
 
 void loop() 
 {
   process_sending_queue();
+  clock_sync_service();
+  motion_report_service();
+  belt_track_service();
+  checkpoint_service();
+  memory_service();
   delay(10); 
 }
@@ -1,4 +1,5 @@
 #include "Project-lib.h"
+#include <stdarg.h>
 
 Fruit* search_fruit(long fruit_id) 
 {
@@ -15,76 +16,346 @@ Fruit* search_fruit(long fruit_id)
 void reset_fruit(Fruit* f)
 {
     if (f == nullptr) return;
-    *f = {f->id + (sizeof(fruit_list) / sizeof(fruit_list[0])), NOT_ENGAGED, 0, false, 0, false, false, 0};
+    *f = {f->id + (long)(sizeof(fruit_list) / sizeof(fruit_list[0])), NOT_ENGAGED, 0, false, 0, false, false, 0, NO_QUALITY, 0, {0}, 0, 0};
+}
+
+void print_fruit_message(const Fruit_data& msg)
+{
+    const char* state_str;
+
+    switch (msg.fruit_state)
+    {
+        case NOT_ENGAGED:        state_str = "NOT_ENGAGED"; break;
+        case INPUT_ENTERED:      state_str = "INPUT_ENTERED"; break;
+        case INPUT_PASSED:       state_str = "INPUT_PASSED"; break;
+        case MEASURE_ENTERED:    state_str = "MEASURE_ENTERED"; break;
+        case MEASURE_PROCESSING: state_str = "MEASURE_PROCESSING"; break;
+        case MEASURE_PASSED:     state_str = "MEASURE_PASSED"; break;
+        case SORTING_PASSED:     state_str = "SORTING_PASSED"; break;
+        default:                 state_str = "UNKNOWN"; break;
+    }
+
+    // The synchronized time only once there is a clock to put it on
+    if (clock_sync_stamping())
+        protocol_println("%ld|%s|%d|%lld", msg.fruit_id, state_str, msg.payload, (long long)clock_sync_time(clock_widen(msg.stamp_us)));
+    else protocol_println("%ld|%s|%d", msg.fruit_id, state_str, msg.payload);
+}
+
+void print_fruit_summary(const Fruit_summary& summary)
+{
+    char stages[SUMMARY_STAGE_COUNT * 12];
+    int n = 0;
+    for (int i = 0; i < SUMMARY_STAGE_COUNT; i++)
+        n += snprintf(stages + n, sizeof(stages) - n, "|%ld", (long)summary.stage_ms[i]);
+
+    if (clock_sync_stamping())
+        protocol_println("%ld|SUMMARY|%u|%d|%u|%u%s|%lld", summary.fruit_id, summary.sorting_type, summary.diameter_mm,
+                         summary.points, summary.faults, stages, (long long)clock_sync_time(clock_widen(summary.entered_us)));
+    else protocol_println("%ld|SUMMARY|%u|%d|%u|%u%s", summary.fruit_id, summary.sorting_type, summary.diameter_mm,
+                          summary.points, summary.faults, stages);
+}
+
+void sending_lanes_init()
+{
+    // Created in static storage on the first start and kept for the life of the program
+    if (critical_sending_queue == nullptr) critical_sending_queue = critical_lane_storage.create();
+    else xQueueReset(critical_sending_queue);
+
+    if (info_sending_queue == nullptr) info_sending_queue = info_lane_storage.create();
+    else xQueueReset(info_sending_queue);
+
+    if (summary_sending_queue == nullptr) summary_sending_queue = summary_lane_storage.create();
+    else xQueueReset(summary_sending_queue);
+
+    memset(lane_stats, 0, sizeof(lane_stats));
 }
 
 void process_sending_queue()
 {
-    if (messages_sending_queue == nullptr) return;
+    // On a half-duplex bus messages only go out when the host polls this node
+    if (RS485_HALF_DUPLEX) return;
+
+    send_queued_messages(-1);
+}
+
+int send_queued_messages(int budget)
+{
+    if (critical_sending_queue == nullptr || info_sending_queue == nullptr || summary_sending_queue == nullptr) return 0;
 
+    // Critical lane is always emptied before the next informational message or summary goes out
     Fruit_data msg;
-    while (xQueueReceive(messages_sending_queue, &msg, 0) == pdTRUE)
+    Fruit_summary summary;
+    int sent = 0;
+    while (budget < 0 || sent < budget)
     {
-        String state_str;
+        if (xQueueReceive(critical_sending_queue, &msg, 0) == pdTRUE) print_fruit_message(msg);
+        else if (xQueueReceive(info_sending_queue, &msg, 0) == pdTRUE) print_fruit_message(msg);
+        else if (xQueueReceive(summary_sending_queue, &summary, 0) == pdTRUE) print_fruit_summary(summary);
+        else break;
+        sent++;
+    }
+    return sent;
+}
+
+void answer_poll()
+{
+    // Bus token: send what is waiting, then hand the bus back with "eot"
+    send_queued_messages(POLL_MESSAGE_BUDGET);
+    clock_sync_request();
+    motion_report();
+    protocol_println("eot");
+}
+
+void protocol_println(const char* format, ...)
+{
+    // One write per line so lines from different tasks never interleave
+    char line[160];
+    int n = 0;
+
+    if (addressed_mode) n = snprintf(line, sizeof(line), "@%d:", node_id);
+
+    va_list args;
+    va_start(args, format);
+    n += vsnprintf(line + n, sizeof(line) - 2 - n, format, args);
+    va_end(args);
+
+    if (n > (int)sizeof(line) - 3) n = sizeof(line) - 3;
+    line[n++] = '\r';
+    line[n++] = '\n';
+    Serial.write((const uint8_t*)line, n);
+}
 
-        switch (msg.fruit_state)
+char* strip_address(char* line, bool* is_broadcast)
+{
+    // "@<node>:<payload>" on a multi-drop bus, plain "<payload>" on a point-to-point link
+    *is_broadcast = false;
+    if (line[0] != '@') return addressed_mode ? NULL : line;
+
+    char* end = NULL;
+    long address = strtol(line + 1, &end, 10);
+    if (end == line + 1 || *end != ':') return NULL;
+
+    if (address == BROADCAST_NODE_ID) *is_broadcast = true;
+    else if (address != node_id) return NULL;
+
+    return end + 1;
+}
+
+// Fixed point with one decimal: printf's float conversion takes a buffer from the heap on first use
+static unsigned long tenths(float value)
+{
+    return value > 0.0f ? (unsigned long)(value * 10.0f + 0.5f) : 0;
+}
+
+void print_valve_stats()
+{
+    // "VALVE|<valve>|<direction>|mean=..|deviation=..|bound=..|last=..|samples=.." times in ms,
+    // followed by the dwells currently derived from them
+    Valve_response* valves[2] = {&probe_valve, &gripper_valve};
+    const char* valve_names[2] = {"probe", "gripper"};
+    const char* direction_names[2][2] = {{"extend", "retract"}, {"grip", "release"}};
+
+    for (int v = 0; v < 2; v++)
+    {
+        for (int d = VALVE_A; d <= VALVE_B; d++)
         {
-            case NOT_ENGAGED:        state_str = "NOT_ENGAGED"; break;
-            case INPUT_ENTERED:      state_str = "INPUT_ENTERED"; break;
-            case INPUT_PASSED:       state_str = "INPUT_PASSED"; break;
-            case MEASURE_ENTERED:    state_str = "MEASURE_ENTERED"; break;
-            case MEASURE_PROCESSING: state_str = "MEASURE_PROCESSING"; break;
-            case MEASURE_PASSED:     state_str = "MEASURE_PASSED"; break;
-            case SORTING_PASSED:     state_str = "SORTING_PASSED"; break;
-            default:                 state_str = "UNKNOWN"; break;
+            const Valve_timing& t = valves[v]->timing[d];
+            unsigned long mean = tenths(t.mean_ms), deviation = tenths(t.deviation_ms), bound = tenths(valves[v]->response_bound_ms(d));
+            protocol_println("VALVE|%s|%s|mean=%lu.%lu|deviation=%lu.%lu|bound=%lu.%lu|last=%lu|samples=%lu", valve_names[v], direction_names[v][d],
+                             mean / 10, mean % 10, deviation / 10, deviation % 10, bound / 10, bound % 10,
+                             (unsigned long)t.last_ms, (unsigned long)t.samples);
         }
+    }
+
+    protocol_println("DWELL|probe_clear=%lu|probe_last_retract=%lu|probe_startup_retract=%lu|probe_startup_extend=%lu",
+                     probe_valve.dwell_ms(VALVE_B, 1.0f, PROBE_CLEAR_MS),
+                     probe_valve.dwell_ms(VALVE_B, 2.0f, PROBE_LAST_RETRACT_MS),
+                     probe_valve.dwell_ms(VALVE_B, PROBE_FULL_STROKE_RATIO, PROBE_STARTUP_RETRACT_MS),
+                     probe_valve.dwell_ms(VALVE_A, 1.0f, PROBE_STARTUP_EXTEND_MS));
+}
+
+void print_executive_stats()
+{
+    // "EXEC|rate=..|ticks=..|overruns=..|mean_us=..|wcet_us=..|input_wcet_us=..|measure_wcet_us=..|sorting_wcet_us=.."
+    Executive_stats st = executive_stats;
+    unsigned long mean = st.ticks ? tenths((float)st.total_us / st.ticks) : 0;
+    protocol_println("EXEC|rate=%d|ticks=%lu|overruns=%lu|mean_us=%lu.%lu|wcet_us=%lu|input_wcet_us=%lu|measure_wcet_us=%lu|sorting_wcet_us=%lu",
+                     EXECUTIVE_RATE_HZ, (unsigned long)st.ticks, (unsigned long)st.overruns,
+                     mean / 10, mean % 10, (unsigned long)st.wcet_us,
+                     (unsigned long)st.station_wcet_us[STATION_INPUT], (unsigned long)st.station_wcet_us[STATION_MEASURE],
+                     (unsigned long)st.station_wcet_us[STATION_SORTING]);
+}
+
+void print_point_stats()
+{
+    // "POINTS|adaptive=..|min=..|max=..|threshold=..|fruits=..|mean=..|early=..|extended=.."
+    Point_stats st = point_stats;
+    unsigned long mean = st.fruits ? tenths((float)st.points / st.fruits) : 0;
+    protocol_println("POINTS|adaptive=%d|min=%d|max=%d|threshold=%d|fruits=%lu|mean=%lu.%lu|early=%lu|extended=%lu",
+                     adaptive_points(), adaptive_min_points, adaptive_max_points, adaptive_quality_threshold,
+                     (unsigned long)st.fruits, mean / 10, mean % 10, (unsigned long)st.early, (unsigned long)st.extended);
+}
+
+void print_lane_stats()
+{
+    static const char* lane_names[LANE_COUNT] = {"critical", "info", "summary"};
+
+    for (int lane = 0; lane < LANE_COUNT; lane++)
+    {
+        Lane_stats st = lane_stats[lane];
+        protocol_println("STATS|%s|sent=%lu|dropped=%lu|collapsed=%lu|blocked=%lu|high_water=%lu", lane_names[lane],
+                    (unsigned long)st.sent, (unsigned long)st.dropped, (unsigned long)st.collapsed,
+                    (unsigned long)st.blocked, (unsigned long)st.high_water);
+    }
+}
+
+// Bytes the UART task already read behind the line it is handling. A stop runs the handshake from
+// inside that line, so read_serial_line() takes these before it reads Serial again.
+static const char* serial_pending = nullptr;
+static size_t serial_pending_length = 0;
+
+void serial_pending_set(const char* data, size_t length)
+{
+    serial_pending = data;
+    serial_pending_length = length;
+}
+
+size_t serial_pending_clear()
+{
+    size_t left = serial_pending_length;
+    serial_pending = nullptr;
+    serial_pending_length = 0;
+    return left;
+}
+
+size_t read_serial_line(char* buffer, size_t length)
+{
+    size_t n = 0;
+    bool complete = false;
+    while (serial_pending_length > 0 && !complete && n < length - 1)
+    {
+        char c = *serial_pending++;
+        serial_pending_length--;
+        if (c == '\n') complete = true;
+        else buffer[n++] = c;
+    }
+
+    if (!complete && n < length - 1)
+    {
+        while (!Serial.available()) delay(10);
+        n += Serial.readBytesUntil('\n', buffer + n, length - 1 - n);
+    }
+
+    // trim trailing CR / spaces
+    while (n > 0 && (buffer[n - 1] == '\r' || buffer[n - 1] == ' ')) n--;
+    buffer[n] = '\0';
+
+    return n;
+}
+
+char* read_handshake_line(char* buffer, size_t length)
+{
+    // Skips frames for other nodes and broadcasts, answers "dump log" at any point
+    // before the handshake so a crash can be inspected
+    for (;;)
+    {
+        read_serial_line(buffer, length);
 
-        Serial.print(msg.fruit_id);
-        Serial.print("|");
-        Serial.print(state_str);
-        Serial.print("|");
-        Serial.println(msg.payload);
+        bool is_broadcast = false;
+        char* payload = strip_address(buffer, &is_broadcast);
+        if (payload == NULL || is_broadcast) continue;
+
+        // Late reply to a clock sync request from before the stop
+        if (strncmp(payload, "sync|", 5) == 0) continue;
+
+        if (strcasecmp(payload, "dump log") != 0) return payload;
+        flight_log_dump();
     }
 }
 
 void initialize_system() 
 {
+    char received_message[UART_LINE_BUFFER_LENGTH];
 
-    while (!Serial.available()) delay(10);
+    // After a brownout, watchdog or panic the line picks up where it was without waiting for the PC
+    static bool boot_checked = false;
+    if (!boot_checked)
+    {
+        boot_checked = true;
+        Checkpoint c;
+        if (AUTO_RESUME_ON_FAULT && reset_was_fault(esp_reset_reason()) && checkpoint_load(&c) && system_resume(c.addressed_mode)) return;
+    }
 
-    String received_message = Serial.readStringUntil('\n');
-    received_message.trim();
+    // Before the handshake both framings are accepted, the form of "wake?" decides which one is used
+    addressed_mode = false;
+    char* payload = read_handshake_line(received_message, sizeof(received_message));
     
-    if (received_message.startsWith("wake?")) 
+    if (strncmp(payload, "wake?", 5) == 0) 
     {
-        Serial.println("awake");
+        addressed_mode = (received_message[0] == '@');
+        protocol_println("awake");
+        payload = NULL;
     }
     
     while (true)
     {
         // Wait for confirmation message: "confirm|initial_fruit_id|preset_measurement_times|preset_conveyor_speed"
-        while (!Serial.available()) delay(10);
+        // on a multi-drop bus the node id comes first: "@2:confirm|2|initial_fruit_id|..."
+        if (payload == NULL) payload = read_handshake_line(received_message, sizeof(received_message));
 
-        received_message = Serial.readStringUntil('\n');
-        received_message.trim();
+        // "resume" restarts from the NVS checkpoint instead
+        if (strcasecmp(payload, "resume") == 0)
+        {
+            if (system_resume(received_message[0] == '@')) break;
+            protocol_println("Resume failed: no checkpoint");
+            payload = NULL;
+            continue;
+        }
 
         // Example expected message: "confirm|3|12|50"
-        if (received_message.startsWith("confirm|")) 
+        if (strncmp(payload, "confirm|", 8) == 0) 
         {
-            char message_buffer[64];
-            received_message.toCharArray(message_buffer, sizeof(message_buffer));
+            char* save_pointer = NULL;
 
             // Example message: "confirm|3|12|50"
-            char* token = strtok(message_buffer, "|");  // "confirm"
+            char* token = strtok_r(payload, "|", &save_pointer);        // "confirm"
+
+            // The host names the node it is configuring, a mismatch means a wiring or address mix-up
+            if (addressed_mode)
+            {
+                token = strtok_r(NULL, "|", &save_pointer);
+                if (token == NULL || atoi(token) != node_id)
+                {
+                    protocol_println("Initialization failed: confirm is for node %s, this is node %d", token ? token : "?", node_id);
+                    payload = NULL;
+                    continue;
+                }
+            }
 
             // Collect all data needed for initilization
-            token = strtok(NULL, "|");                  // first data: initial fruit id
+            token = strtok_r(NULL, "|", &save_pointer);                  // first data: initial fruit id
             if (token != NULL) initial_fruit = atol(token);
-            token = strtok(NULL, "|");                  // second data: preset measurement times
+            token = strtok_r(NULL, "|", &save_pointer);                  // second data: preset measurement times
             if (token != NULL) preset_measure_times = atoi(token);
-            token = strtok(NULL, "|");                  // second data: preset measurement times
+            token = strtok_r(NULL, "|", &save_pointer);                  // third data: preset conveyor speed
             if (token != NULL) preset_conveyor_speed = atoi(token);
 
+            // Optional "|min|max[|threshold]" turns on the adaptive point count for this session
+            adaptive_min_points = 0;
+            adaptive_max_points = 0;
+            adaptive_quality_threshold = ADAPTIVE_QUALITY_THRESHOLD;
+            token = strtok_r(NULL, "|", &save_pointer);
+            if (token != NULL) adaptive_min_points = atoi(token);
+            token = strtok_r(NULL, "|", &save_pointer);
+            if (token != NULL) adaptive_max_points = atoi(token);
+            token = strtok_r(NULL, "|", &save_pointer);
+            if (token != NULL) adaptive_quality_threshold = constrain(atoi(token), 0, 100);
+            if (adaptive_min_points < 1 || adaptive_max_points < adaptive_min_points || adaptive_max_points > MEASURE_POINTS_LIMIT)
+            {
+                adaptive_min_points = 0;
+                adaptive_max_points = 0;
+            }
+
             // Assign fruit IDs sequentially
             for (int i = 0; i < FRUIT_LIST_LENGTH; i++) fruit_list[i].id = initial_fruit + i;
 
@@ -99,13 +370,19 @@ void initialize_system()
             measure_fruit_pointer = search_fruit(initial_fruit);
             sorting_fruit_pointer = search_fruit(initial_fruit);
 
-            // Sending queue initialization
-            messages_sending_queue = xQueueCreate(15, sizeof(Fruit_data));
+            // Sending lanes initialization
+            sending_lanes_init();
+
+            // Command queues start empty
+            measure_command_queue.reset();
+            sorting_command_queue.reset();
 
-            Serial.println("initial fruit: " + String(initial_fruit) + 
-                        " | preset_measure_times: " + String(preset_measure_times) + 
-                        " | preset_conveyor_speed: " + String(preset_conveyor_speed));
-            Serial.println("System initialized successfully! Starting system....");
+            protocol_println("initial fruit: %ld | preset_measure_times: %d | preset_conveyor_speed: %d",
+                        initial_fruit, preset_measure_times, preset_conveyor_speed);
+            if (adaptive_points())
+                protocol_println("adaptive points: %d to %d | quality threshold: %d",
+                            adaptive_min_points, adaptive_max_points, adaptive_quality_threshold);
+            protocol_println("System initialized successfully! Starting system....");
 
             // Initialize hardware
             hardware_init();
@@ -115,250 +392,2160 @@ void initialize_system()
             system_start();
             delay(1000);
 
-            Serial.println("System started");
+            protocol_println("System started");
             break;
         } 
         else 
         {
-            Serial.println("Initialization failed: invalid confirmation message. (must be \"confirm|<fruit id>|<preset measure times>|<conveyor speed in %>\")");
+            if (addressed_mode) protocol_println("Initialization failed: invalid confirmation message. (must be \"confirm|<node id>|<fruit id>|<preset measure times>|<conveyor speed in %%>\")");
+            else protocol_println("Initialization failed: invalid confirmation message. (must be \"confirm|<fruit id>|<preset measure times>|<conveyor speed in %%>\")");
+            payload = NULL;
         }
     }
 }
 
-void send_fruit_message(Fruit *fruit, int payload)
+void handle_command_line(char* line, int64_t received_us)
 {
-    Fruit_data msg;
-    msg.fruit_id = fruit -> id;
-    msg.fruit_state = fruit -> current_fruit_state;
-    msg.payload = payload;
+    // Drop frames addressed to other nodes
+    bool is_broadcast = false;
+    line = strip_address(line, &is_broadcast);
+    if (line == NULL) return;
 
-    xQueueSend(messages_sending_queue, &msg, 0);
-}
+    // Check for "stop" command first, it is the only command honoured as a broadcast
+    if (strcasecmp(line, "stop") == 0)
+    {
+        if (!is_broadcast) protocol_println("Stop command received, stopping system...");
+        LOG_INFO(EV_STOP_COMMAND, 0, 0);
+        system_stop();
+        return;
+    }
 
-void hardware_init()
-{
-    pinMode(INPUT_SENSOR_PIN, INPUT);
-    pinMode(MEASURE_SENSOR_PIN, INPUT);
-    pinMode(SORTING_SENSOR_PIN, INPUT);
-    pinMode(GRIPPER_DETECT_CONTACT_SWITCH_PIN_1, INPUT_PULLUP);
-    pinMode(GRIPPER_DETECT_CONTACT_SWITCH_PIN_2, INPUT_PULLUP);
-    pinMode(PROBE_DETECT_CONTACT_SWITCH_PIN, INPUT_PULLUP);
-    pinMode(GRIPPER_HOMING_SWITCH_PIN, INPUT_PULLUP);
-}
+    if (is_broadcast) return;
 
-void system_start()
-{
-    // --- Create main tasks ---
-    xTaskCreatePinnedToCore(Input_Task, "Input_Task", 4096, NULL, 1, &input_task_handle, 1);
-    xTaskCreatePinnedToCore(Measure_Task, "Measure_Task", 8000, NULL, 1, &measure_task_handle, 1);
-    xTaskCreatePinnedToCore(Sorting_Task, "Sorting_Task", 4096, NULL, 1, &sorting_task_handle, 1);
+    if (strcasecmp(line, "poll") == 0)
+    {
+        answer_poll();
+        return;
+    }
 
-    // --- Ensure UART task is running ---
-    if (uart_receive_task_handle == NULL || eTaskGetState(uart_receive_task_handle) == eDeleted)
-    xTaskCreatePinnedToCore(UartReceiveTask, "UartReceiveTask", 4096, NULL, 1, &uart_receive_task_handle, 1);
+    if (strcasecmp(line, "dump log") == 0)
+    {
+        flight_log_dump();
+        return;
+    }
 
-    // --- Initialize system hardware ---
-    delay(200);
+    if (strcasecmp(line, "stats") == 0)
+    {
+        print_lane_stats();
+        if (CYCLIC_EXECUTIVE) print_executive_stats();
+        print_gate_stats();
+        print_point_stats();
+        print_size_stats();
+        print_belt_track_stats();
+        print_resync_stats();
+        print_clock_sync_stats();
+        print_valve_stats();
+        return;
+    }
 
-    gripper_release(true);
-    probe_valve.position_B();
-    vTaskDelay(2000 / portTICK_PERIOD_MS);
-    probe_valve.position_A();
-    vTaskDelay(200 / portTICK_PERIOD_MS);
-    probe_valve.mid_position();
-    gate_open();
-    sorting_bin_write((SORTING_ANGLE_TYPE_1 + SORTING_ANGLE_TYPE_2) / 2);
-    gripper_home();
-    conveyor_run();
+    if (strcasecmp(line, "valves") == 0)
+    {
+        print_valve_stats();
+        return;
+    }
 
-    printf("System started.\n");
-}
+    if (strcasecmp(line, "memory") == 0)
+    {
+        print_memory_stats();
+        return;
+    }
 
-void system_stop()
-{
-    // --- Stop all tasks except UART ---
-    if (input_task_handle != NULL)
+    if (strncmp(line, "sync|", 5) == 0)
     {
-        vTaskDelete(input_task_handle);
-        input_task_handle = NULL;
+        clock_sync_reply(line + 5, received_us);
+        return;
     }
 
-    if (measure_task_handle != NULL)
+    if (strncasecmp(line, "sync", 4) == 0 && (line[4] == '\0' || line[4] == ' '))
     {
-        vTaskDelete(measure_task_handle);
-        measure_task_handle = NULL;
+        clock_sync_command(line[4] == ' ' ? line + 5 : "");
+        return;
     }
 
-    if (sorting_task_handle != NULL)
+    if (strcasecmp(line, "trace") == 0)
     {
-        vTaskDelete(sorting_task_handle);
-        sorting_task_handle = NULL;
+        print_command_trace();
+        return;
     }
 
-    // Leave UART task alive because this function is called by it
-    printf("System tasks stopped (UART task still running).\n");
+    if (strcasecmp(line, "track") == 0)
+    {
+        print_belt_tracks();
+        return;
+    }
 
-    // --- Delete and reset queue ---
-    if (messages_sending_queue != nullptr)
+    if (strcasecmp(line, "resync") == 0)
     {
-        vQueueDelete(messages_sending_queue);
-        messages_sending_queue = nullptr;
+        print_resync_log();
+        return;
     }
 
-    // --- Reset global variables ---
-    preset_measure_times = 0;
-    initial_fruit = 0;
-    preset_conveyor_speed = 0;
+    if (strncasecmp(line, "report", 6) == 0 && (line[6] == '\0' || line[6] == ' '))
+    {
+        report_command(line[6] == ' ' ? line + 7 : "");
+        return;
+    }
 
-    input_fruit_id = 0;
-    input_fruit_pointer = nullptr;
+    if (strcasecmp(line, "motion") == 0)
+    {
+        protocol_println("motion|%d|%d", point_angle_deg, stepper_pulse_us);
+        return;
+    }
 
-    measure_fruit_id = 0;
-    measure_fruit_pointer = nullptr;
+    if (strncasecmp(line, "motion|", 7) == 0)
+    {
+        motion_command(line + 7);
+        return;
+    }
 
-    sorting_fruit_id = 0;
-    sorting_fruit_pointer = nullptr;
+    if (strcasecmp(line, "size") == 0)
+    {
+        print_size_stats();
+        return;
+    }
 
-    // --- Reset fruit list ---
-    memset(fruit_list, 0, sizeof(fruit_list));
-    fruit_list[0] = {0, NOT_ENGAGED, 0, false, 0, false, false, 0};
+    if (strncasecmp(line, "size|", 5) == 0)
+    {
+        size_command(line + 5);
+        return;
+    }
 
-    myMotor conveyor_motor(CONVEYOR_MOTOR_PIN);
-    myStepper gripper_stepper(GRIPPER_STEPPER_PUL_PIN, GRIPPER_STEPPER_DIR_PIN, GRIPPER_STEPPER_ENABLE_PIN, GRIPPER_HOMING_SWITCH_PIN);
-    myServo gate_servo(GATE_SERVO_PIN);
-    myServo sorting_servo(SORTING_SERVO_PIN);
-    myPneumaticValve probe_valve(PROBE_CYLINDER_EXTEND_VALVE_PIN, PROBE_CYLINDER_RETRACT_VALVE_PIN);
-    myPneumaticValve gripper_valve(GRIPPER_CYLINDER_GRIP_VALVE_PIN, GRIPPER_CYLINDER_RELEASE_VALVE_PIN);
+    // Parse message like "123|MEASURE_PROCESSING|5" in place
+    char* save_pointer = NULL;
 
-    printf("All global variables reset.\n");
+    char* token = strtok_r(line, "|", &save_pointer);
+    if (token == NULL) return;
+    long id = atol(token);
 
-    initialize_system();
-}
+    char* state_str = strtok_r(NULL, "|", &save_pointer);
+    if (state_str == NULL) return;
 
+    token = strtok_r(NULL, "|", &save_pointer);
+    if (token == NULL) return;
+    int value = atoi(token);
 
-bool check_trigger(int sensor_pin)
-{
-    return !digitalRead(sensor_pin);
-}
+    // A point acknowledgement may carry the scan quality: "123|MEASURE_PROCESSING|5|87"
+    token = strtok_r(NULL, "|", &save_pointer);
+    int quality = (token != NULL) ? constrain(atoi(token), 0, 100) : NO_QUALITY;
 
-void conveyor_run()
-{
-    conveyor_motor.run(preset_conveyor_speed);
-}
+    // Turn the message into a typed command and hand it to the task that owns the fruit field
+    Command cmd = {CMD_POINT_ACK, id, value, quality};
 
-void conveyor_stop()
-{
-    conveyor_motor.run(0);
+    if (strcasecmp(state_str, "MEASURE_PROCESSING") == 0)
+    {
+        cmd.type = CMD_POINT_ACK;
+        command_receipt(cmd, received_us);
+        LOG_DEBUG(EV_POINT_ACK, id, value);
+        if (!measure_command_queue.push(cmd)) LOG_WARN(EV_COMMAND_DROPPED, id, cmd.type);
+        else if (measure_task_handle != NULL) xTaskNotifyGive(measure_task_handle);
+    }
+    else if (strcasecmp(state_str, "MEASURE_PASSED") == 0)
+    {
+        cmd.type = CMD_SORT_DECISION;
+        command_receipt(cmd, received_us);
+        if (!sorting_command_queue.push(cmd)) LOG_WARN(EV_COMMAND_DROPPED, id, cmd.type);
+        else if (sorting_task_handle != NULL) xTaskNotifyGive(sorting_task_handle);
+    }
 }
 
-void gripper_position_fruit(int current_point)
+bool take_point_ack(Fruit* f, int point)
 {
-    if ((preset_measure_times % 4) == 0)
-    {
-        if (current_point == 1)
-        {
-            gripper_grip();
-        }
-        else if (preset_measure_times == 4 || 
-                (current_point > (preset_measure_times / 4) && 
-                current_point % (preset_measure_times / 4) == 1))
-        {
-            gripper_stepper.run_by_angle((float) (90 - PRESET_ANGLE_BETWEEN_TWO_MEASUREMENT * ((preset_measure_times/4) - 1)), true);
-            gripper_release(false);
-            gripper_stepper.home(-1);
-
-            gripper_grip();
-            gripper_valve.mid_position();
-        }
-        else 
-        {
-            gripper_stepper.run_by_angle((float)PRESET_ANGLE_BETWEEN_TWO_MEASUREMENT, true);
-        }
-    }
-    else
+    // Called by Measure_Task only, drains every pending acknowledgement
+    Command cmd;
+    while (measure_command_queue.pop(cmd))
     {
-        if (current_point == 1)
+        if (cmd.type == CMD_POINT_ACK && cmd.fruit_id == f->id && cmd.value == point)
         {
-            gripper_valve.position_A();
-            while (check_trigger(GRIPPER_DETECT_CONTACT_SWITCH_PIN_1) == false || 
-                check_trigger(GRIPPER_DETECT_CONTACT_SWITCH_PIN_2) == false) 
-                vTaskDelay(10 / portTICK_PERIOD_MS);
-            gripper_valve.mid_position();
-        }
-        else 
-        {
-            gripper_stepper.run_by_angle((float)PRESET_ANGLE_BETWEEN_TWO_MEASUREMENT, true);
+            f->point_measure_done = true;
+            f->point_quality = cmd.quality;
         }
     }
+    return f->point_measure_done;
 }
 
-void gripper_release(bool all_the_way)
+void apply_sort_decisions()
 {
-    if (all_the_way)
-    {
-        gripper_valve.position_B();
-        return;
-    }
-    else
+    // Called by Sorting_Task only, the decision may target any fruit still in the list
+    Command cmd;
+    while (sorting_command_queue.pop(cmd))
     {
-        gripper_valve.position_B();
-        while (check_trigger(GRIPPER_DETECT_CONTACT_SWITCH_PIN_1) == true || 
-            check_trigger(GRIPPER_DETECT_CONTACT_SWITCH_PIN_2) == true) 
-            vTaskDelay(10 / portTICK_PERIOD_MS);
-        gripper_valve.mid_position();
+        Fruit* f = search_fruit(cmd.fruit_id);
+        // A size reject keeps its bin whatever a late or duplicated reply says
+        if (cmd.type == CMD_SORT_DECISION && f != nullptr && !size_rejected(f)) f->sorting_type = cmd.value;
     }
 }
 
-void gripper_grip()
-{
-    gripper_valve.position_A();
-    while (check_trigger(GRIPPER_DETECT_CONTACT_SWITCH_PIN_1) == false || 
-        check_trigger(GRIPPER_DETECT_CONTACT_SWITCH_PIN_2) == false) 
-        vTaskDelay(10 / portTICK_PERIOD_MS);
-    gripper_valve.mid_position();
-}
+static portMUX_TYPE lane_stats_lock = portMUX_INITIALIZER_UNLOCKED;
+static portMUX_TYPE info_lane_lock = portMUX_INITIALIZER_UNLOCKED;
 
-void gripper_home()
+static void send_fruit_summary(const Fruit* fruit)
 {
-    gripper_stepper.home(-1);
-}
+    Fruit_summary summary;
+    summary.fruit_id = fruit->id;
+    summary.entered_us = fruit->state_us[INPUT_ENTERED];
+    for (int i = 0; i < SUMMARY_STAGE_COUNT; i++)
+    {
+        int state = INPUT_ENTERED + 1 + i;
+        bool sent = (fruit->states_sent & (1 << state)) && (fruit->states_sent & (1 << INPUT_ENTERED));
+        summary.stage_ms[i] = sent ? (int32_t)((fruit->state_us[state] - summary.entered_us) / 1000) : -1;
+    }
+    summary.diameter_mm = (int16_t)fruit->diameter_mm;
+    summary.points = (uint8_t)fruit->point_measured;
+    summary.sorting_type = (uint8_t)fruit->sorting_type;
+    summary.faults = fruit->faults;
 
-void probe_attach()
-{
-    probe_valve.position_A();
-    while (check_trigger(PROBE_DETECT_CONTACT_SWITCH_PIN) == false) vTaskDelay(10 / portTICK_PERIOD_MS);
-    probe_valve.mid_position();
+    // Sent from the sorting station, which must not wait: a full lane loses the summary
+    Lane_stats* st = &lane_stats[LANE_SUMMARY];
+    bool accepted = (xQueueSend(summary_sending_queue, &summary, 0) == pdTRUE);
+    if (!accepted) LOG_WARN(EV_SEND_QUEUE_FULL, summary.fruit_id, SORTING_PASSED);
+
+    uint32_t waiting = uxQueueMessagesWaiting(summary_sending_queue);
+
+    portENTER_CRITICAL(&lane_stats_lock);
+    if (accepted) st->sent++;
+    else st->dropped++;
+    if (waiting > st->high_water) st->high_water = waiting;
+    portEXIT_CRITICAL(&lane_stats_lock);
 }
 
-void probe_deattach(int measure_position)
+#if INFO_LANE_COLLAPSE
+// Makes room in the full info lane by taking out an earlier update of the same fruit, which the new
+// state supersedes. INPUT_PASSED carries the diameter and is never taken out. The lane is emptied
+// and refilled in order with the new message last; the caller holds info_lane_lock so no other
+// station sends in between, and loop() only takes messages out without waiting, so everything fits
+// back and no queue call here can block or switch tasks.
+static bool info_lane_collapse(const Fruit_data& msg, Fruit_data* superseded)
 {
-    if (measure_position == preset_measure_times)
-    {
-        probe_valve.position_B();
-        vTaskDelay(200 / portTICK_PERIOD_MS);
-        probe_valve.mid_position();
+    Fruit_data waiting[INFO_LANE_LENGTH];
+    int count = 0;
+    while (count < INFO_LANE_LENGTH && xQueueReceive(info_sending_queue, &waiting[count], 0) == pdTRUE) count++;
 
+    int found = -1;
+    for (int i = 0; i < count && found < 0; i++)
+    {
+        if (waiting[i].fruit_id == msg.fruit_id && waiting[i].fruit_state < msg.fruit_state && waiting[i].fruit_state != INPUT_PASSED)
+            found = i;
     }
-    else
+
+    for (int i = 0; i < count; i++)
     {
-        probe_valve.position_B();
-        while (check_trigger(PROBE_DETECT_CONTACT_SWITCH_PIN) == true) vTaskDelay(10 / portTICK_PERIOD_MS);
-        vTaskDelay(100 / portTICK_PERIOD_MS);
-        probe_valve.mid_position();
+        if (i != found) xQueueSend(info_sending_queue, &waiting[i], 0);
     }
-}
+    if (found < 0) return false;
 
-void sorting_bin_write(int angle)
-{
-    sorting_servo.set_angle(angle);
+    *superseded = waiting[found];
+    return xQueueSend(info_sending_queue, &msg, 0) == pdTRUE;
 }
+#endif
 
-void gate_open()
+void send_fruit_message(Fruit *fruit, int payload)
 {
-    gate_servo.set_angle(GATE_OPEN_ANGLE);
-}
+    Fruit_data msg;
+    msg.fruit_id = fruit -> id;
+    msg.fruit_state = fruit -> current_fruit_state;
+    msg.payload = payload;
+    msg.stamp_us = (uint32_t)clock_local_us();
 
-void gate_close()
+    LOG_DEBUG(EV_FRUIT_STATE, msg.fruit_id, msg.fruit_state);
+
+    // Stage times for the summary, the first MEASURE_PROCESSING is the fruit stopped and centered
+    if (!(fruit->states_sent & (1 << msg.fruit_state)))
+    {
+        fruit->states_sent |= 1 << msg.fruit_state;
+        fruit->state_us[msg.fruit_state] = msg.stamp_us;
+    }
+
+    Message_lane lane = message_lane(msg.fruit_state, payload);
+
+    // In summary mode only what the PC has to answer goes out on its own
+    if (report_summary && lane == LANE_INFO)
+    {
+        if (msg.fruit_state == SORTING_PASSED) send_fruit_summary(fruit);
+        return;
+    }
+
+    Lane_stats* st = &lane_stats[lane];
+    QueueHandle_t queue = (lane == LANE_CRITICAL) ? critical_sending_queue : info_sending_queue;
+    bool accepted = false;
+
+    if (lane == LANE_CRITICAL)
+    {
+#if CYCLIC_EXECUTIVE
+        // The measuring station checked critical_lane_ready() first, the executive never waits here
+        accepted = (xQueueSend(queue, &msg, 0) == pdTRUE);
+        if (!accepted) LOG_WARN(EV_SEND_QUEUE_FULL, msg.fruit_id, msg.fruit_state);
+#else
+        // Losing one of these deadlocks the line, so wait for room instead
+        if (xQueueSend(queue, &msg, 0) != pdTRUE)
+        {
+            portENTER_CRITICAL(&lane_stats_lock);
+            st->blocked++;
+            portEXIT_CRITICAL(&lane_stats_lock);
+            LOG_WARN(EV_SEND_BLOCKED, msg.fruit_id, msg.fruit_state);
+
+            xQueueSend(queue, &msg, portMAX_DELAY);
+        }
+        accepted = true;
+#endif
+    }
+    else
+    {
+        // A critical section, not a mutex: system_stop() deletes the stations wherever they are, and a
+        // task cannot be deleted inside one, so the lock is never left held for the next run
+        portENTER_CRITICAL(&info_lane_lock);
+        accepted = (xQueueSend(queue, &msg, 0) == pdTRUE);
+
+#if INFO_LANE_COLLAPSE
+        Fruit_data superseded;
+        bool collapsed = !accepted && info_lane_collapse(msg, &superseded);
+        accepted = accepted || collapsed;
+#endif
+        portEXIT_CRITICAL(&info_lane_lock);
+
+#if INFO_LANE_COLLAPSE
+        if (collapsed)
+        {
+            portENTER_CRITICAL(&lane_stats_lock);
+            st->collapsed++;
+            portEXIT_CRITICAL(&lane_stats_lock);
+            LOG_DEBUG(EV_INFO_COLLAPSED, superseded.fruit_id, superseded.fruit_state);
+        }
+#endif
+
+        if (!accepted) LOG_WARN(EV_SEND_QUEUE_FULL, msg.fruit_id, msg.fruit_state);
+    }
+
+    uint32_t waiting = uxQueueMessagesWaiting(queue);
+
+    portENTER_CRITICAL(&lane_stats_lock);
+    if (accepted) st->sent++;
+    else st->dropped++;
+    if (waiting > st->high_water) st->high_water = waiting;
+    portEXIT_CRITICAL(&lane_stats_lock);
+}
+
+bool critical_lane_ready(long fruit_id, Fruit_state state)
+{
+    // In executive mode a blocking send would stop all three stations, and on a polled bus the lane
+    // only drains when the host polls. The measuring station keeps its phase until there is room;
+    // the executive is the only task sending on this lane, so the room is still there for the send.
+    (void)fruit_id;
+    (void)state;
+#if CYCLIC_EXECUTIVE
+    static bool holding = false;
+    bool room = uxQueueSpacesAvailable(critical_sending_queue) > 0;
+    if (!room && !holding)
+    {
+        portENTER_CRITICAL(&lane_stats_lock);
+        lane_stats[LANE_CRITICAL].blocked++;
+        portEXIT_CRITICAL(&lane_stats_lock);
+        LOG_WARN(EV_SEND_BLOCKED, fruit_id, state);
+    }
+    holding = !room;
+    return room;
+#else
+    return true;
+#endif
+}
+
+void report_command(const char* argument)
+{
+    // "report summary", "report states"; plain "report" only tells the mode
+    if (strcasecmp(argument, "summary") == 0) report_summary = true;
+    else if (strcasecmp(argument, "states") == 0) report_summary = false;
+    else if (argument[0] != '\0')
+    {
+        protocol_println("report failed: must be \"report summary\" or \"report states\"");
+        return;
+    }
+    protocol_println("report|%s", report_summary ? "summary" : "states");
+}
+
+Message_lane message_lane(Fruit_state state, int payload)
+{
+    // The PC answers a MEASURE_PROCESSING that carries a point number and every MEASURE_PASSED
+    if (state == MEASURE_PROCESSING && payload > 0) return LANE_CRITICAL;
+    if (state == MEASURE_PASSED) return LANE_CRITICAL;
+    return LANE_INFO;
+}
+
+//============================================================== CLOCK SYNC ==============================================================//
+// Request and stamps are sent from loop(), replies and commands arrive on the UART task, which is
+// the only one touching the window; the lock covers the request in flight and the fitted model.
+static portMUX_TYPE clock_sync_lock = portMUX_INITIALIZER_UNLOCKED;
+static Clock_sync clock_sync = {};
+
+int64_t clock_local_us()
+{
+    return esp_timer_get_time();
+}
+
+int64_t clock_widen(uint32_t stamp_us)
+{
+    // Stamps are used moments after they are taken, well inside the 71 minutes 32 bits cover
+    int64_t now = clock_local_us();
+    return now - (int64_t)(uint32_t)((uint32_t)now - stamp_us);
+}
+
+int64_t clock_sync_time(int64_t local_us)
+{
+    // Controller time on the PC clock, the controller clock itself until the first exchange
+    portENTER_CRITICAL(&clock_sync_lock);
+    bool synced = clock_sync.synced;
+    int64_t base_local = clock_sync.base_local_us;
+    int64_t base_offset = clock_sync.base_offset_us;
+    double drift = clock_sync.drift;
+    portEXIT_CRITICAL(&clock_sync_lock);
+
+    if (!synced) return local_us;
+    return local_us + base_offset + (int64_t)(drift * (double)(local_us - base_local));
+}
+
+bool clock_sync_stamping()
+{
+    return clock_sync.stamp && clock_sync.synced;
+}
+
+void clock_sync_request()
+{
+    if (!clock_sync.enabled) return;
+
+    // Fill the window quickly after "sync on", then keep it fresh
+    int64_t now = clock_local_us();
+    int64_t interval_us = 1000LL * ((clock_sync.sample_count < CLOCK_SYNC_WINDOW) ? CLOCK_SYNC_FAST_INTERVAL_MS : CLOCK_SYNC_INTERVAL_MS);
+    if (clock_sync.last_request_us != 0 && now - clock_sync.last_request_us < interval_us) return;
+
+    portENTER_CRITICAL(&clock_sync_lock);
+    uint32_t sequence = ++clock_sync.sequence;
+    clock_sync.last_request_us = now;
+    clock_sync.request_us = now;
+    portEXIT_CRITICAL(&clock_sync_lock);
+
+    protocol_println("sync?|%lu|%lld", (unsigned long)sequence, (long long)now);
+}
+
+void clock_sync_service()
+{
+    // On a half-duplex bus the request goes out with the answer to a poll
+    if (RS485_HALF_DUPLEX) return;
+
+    clock_sync_request();
+}
+
+static void clock_sync_fit()
+{
+    // The fastest exchange in the window sets how much queueing the others may have had
+    int32_t best = INT32_MAX;
+    for (int i = 0; i < clock_sync.sample_count; i++)
+        if (clock_sync.samples[i].round_trip_us < best) best = clock_sync.samples[i].round_trip_us;
+    int32_t limit = best + CLOCK_SYNC_ROUND_TRIP_SLACK_US;
+
+    // Least squares line through the usable exchanges, relative to the newest one so the sums stay small
+    const Sync_sample& newest = clock_sync.samples[(clock_sync.next_sample + CLOCK_SYNC_WINDOW - 1) % CLOCK_SYNC_WINDOW];
+    int used = 0;
+    double sum_x = 0.0, sum_y = 0.0;
+    int64_t first_us = newest.local_us;
+    for (int i = 0; i < clock_sync.sample_count; i++)
+    {
+        const Sync_sample& s = clock_sync.samples[i];
+        if (s.round_trip_us > limit) continue;
+        used++;
+        sum_x += (double)(s.local_us - newest.local_us);
+        sum_y += (double)(s.offset_us - newest.offset_us);
+        if (s.local_us < first_us) first_us = s.local_us;
+    }
+
+    double mean_x = sum_x / used, mean_y = sum_y / used;
+    double sxx = 0.0, sxy = 0.0;
+    for (int i = 0; i < clock_sync.sample_count; i++)
+    {
+        const Sync_sample& s = clock_sync.samples[i];
+        if (s.round_trip_us > limit) continue;
+        double x = (double)(s.local_us - newest.local_us) - mean_x;
+        sxx += x * x;
+        sxy += x * ((double)(s.offset_us - newest.offset_us) - mean_y);
+    }
+
+    // Too short a span and the slope is mostly the round trip noise, keep the last drift then
+    double drift = clock_sync.drift;
+    if (newest.local_us - first_us >= CLOCK_SYNC_MIN_SPAN_MS * 1000LL && sxx > 0.0) drift = sxy / sxx;
+
+    int64_t base_local = newest.local_us + (int64_t)mean_x;
+    int64_t base_offset = newest.offset_us + (int64_t)mean_y;
+    LOG_DEBUG(EV_CLOCK_SYNC, clock_sync.synced ? clock_sync_time(base_local) - base_local - base_offset : 0, best);
+
+    portENTER_CRITICAL(&clock_sync_lock);
+    clock_sync.base_local_us = base_local;
+    clock_sync.base_offset_us = base_offset;
+    clock_sync.drift = drift;
+    clock_sync.best_round_trip_us = best;
+    clock_sync.synced = true;
+    portEXIT_CRITICAL(&clock_sync_lock);
+}
+
+void clock_sync_reply(char* fields, int64_t received_us)
+{
+    // "<seq>|<t2>|<t3>" after "sync|"
+    char* save_pointer = NULL;
+    char* token = strtok_r(fields, "|", &save_pointer);
+    if (token == NULL) return;
+    uint32_t sequence = strtoul(token, NULL, 10);
+    token = strtok_r(NULL, "|", &save_pointer);
+    if (token == NULL) return;
+    int64_t t2 = strtoll(token, NULL, 10);
+    token = strtok_r(NULL, "|", &save_pointer);
+    if (token == NULL) return;
+    int64_t t3 = strtoll(token, NULL, 10);
+
+    portENTER_CRITICAL(&clock_sync_lock);
+    int64_t t1 = (sequence == clock_sync.sequence) ? clock_sync.request_us : 0;
+    if (t1 != 0) clock_sync.request_us = 0;
+    clock_sync.exchanges++;
+    portEXIT_CRITICAL(&clock_sync_lock);
+
+    int64_t t4 = received_us;
+    if (t1 == 0 || t4 - t1 > CLOCK_SYNC_TIMEOUT_MS * 1000LL)
+    {
+        clock_sync.late++;
+        return;
+    }
+
+    Sync_sample& s = clock_sync.samples[clock_sync.next_sample];
+    s.local_us = t1 + (t4 - t1) / 2;
+    s.offset_us = ((t2 - t1) + (t3 - t4)) / 2;
+    int64_t round_trip = (t4 - t1) - (t3 - t2);
+    s.round_trip_us = (int32_t)(round_trip > 0 ? round_trip : 0);   // a coarse PC clock can make it negative
+
+    clock_sync.next_sample = (clock_sync.next_sample + 1) % CLOCK_SYNC_WINDOW;
+    if (clock_sync.sample_count < CLOCK_SYNC_WINDOW) clock_sync.sample_count++;
+    clock_sync_fit();
+}
+
+void clock_sync_command(const char* argument)
+{
+    // "sync on", "sync stamp", "sync off"; plain "sync" only reports
+    bool on = strcasecmp(argument, "on") == 0;
+    bool stamp = strcasecmp(argument, "stamp") == 0;
+    bool off = strcasecmp(argument, "off") == 0;
+
+    if (on || stamp || off)
+    {
+        // A new session may come with a PC clock that was reset, start the window over
+        portENTER_CRITICAL(&clock_sync_lock);
+        clock_sync.enabled = on || stamp;
+        clock_sync.stamp = stamp;
+        clock_sync.request_us = 0;
+        clock_sync.last_request_us = 0;
+        clock_sync.synced = false;
+        clock_sync.drift = 0.0;
+        clock_sync.sample_count = 0;
+        clock_sync.next_sample = 0;
+        portEXIT_CRITICAL(&clock_sync_lock);
+    }
+    print_clock_sync_stats();
+}
+
+void clock_sync_stop()
+{
+    // The samples stay valid, the PC turns the exchange back on after the next handshake
+    portENTER_CRITICAL(&clock_sync_lock);
+    clock_sync.enabled = false;
+    clock_sync.stamp = false;
+    clock_sync.request_us = 0;
+    portEXIT_CRITICAL(&clock_sync_lock);
+}
+
+void command_receipt(const Command& cmd, int64_t received_us)
+{
+    // Called by the UART task only, like print_command_trace()
+    Command_receipt& r = clock_sync.receipts[clock_sync.receipts_written % COMMAND_TRACE_LENGTH];
+    r.fruit_id = cmd.fruit_id;
+    r.type = cmd.type;
+    r.value = cmd.value;
+    r.received_us = received_us;
+    clock_sync.receipts_written++;
+}
+
+void print_command_trace()
+{
+    // "RX|<id>|<state>|<value>|<PC us>" for every command since the last "trace", oldest first, then
+    // "RX_END|<count>|lost=<n>"; the receive times go through the model as it is now, the latest fit
+    uint32_t lost = 0;
+    if (clock_sync.receipts_written - clock_sync.receipts_sent > COMMAND_TRACE_LENGTH)
+    {
+        lost = clock_sync.receipts_written - clock_sync.receipts_sent - COMMAND_TRACE_LENGTH;
+        clock_sync.receipts_sent += lost;
+    }
+
+    uint32_t count = 0;
+    for (; clock_sync.receipts_sent != clock_sync.receipts_written; clock_sync.receipts_sent++, count++)
+    {
+        const Command_receipt& r = clock_sync.receipts[clock_sync.receipts_sent % COMMAND_TRACE_LENGTH];
+        protocol_println("RX|%ld|%s|%d|%lld", r.fruit_id, r.type == CMD_POINT_ACK ? "MEASURE_PROCESSING" : "MEASURE_PASSED",
+                         r.value, (long long)clock_sync_time(r.received_us));
+    }
+    protocol_println("RX_END|%lu|lost=%lu", (unsigned long)count, (unsigned long)lost);
+}
+
+void print_clock_sync_stats()
+{
+    // "SYNC|enabled=..|stamp=..|synced=..|local_us=..|offset_us=..|drift_ppb=..|round_trip_us=..|window=..|exchanges=..|late=.."
+    // offset_us is PC minus controller clock at controller time local_us
+    portENTER_CRITICAL(&clock_sync_lock);
+    bool synced = clock_sync.synced;
+    int64_t base_local = clock_sync.base_local_us;
+    int64_t base_offset = clock_sync.base_offset_us;
+    double drift = clock_sync.drift;
+    portEXIT_CRITICAL(&clock_sync_lock);
+
+    protocol_println("SYNC|enabled=%d|stamp=%d|synced=%d|local_us=%lld|offset_us=%lld|drift_ppb=%ld|round_trip_us=%ld|window=%d|exchanges=%lu|late=%lu",
+                     clock_sync.enabled, clock_sync.stamp, synced, (long long)base_local, (long long)base_offset, (long)(drift * 1e9),
+                     (long)clock_sync.best_round_trip_us, clock_sync.sample_count, (unsigned long)clock_sync.exchanges,
+                     (unsigned long)clock_sync.late);
+}
+
+//============================================================== FLIGHT RECORDER ==============================================================//
+static portMUX_TYPE flight_log_lock = portMUX_INITIALIZER_UNLOCKED;
+
+void flight_log_init()
+{
+    // RTC memory holds garbage after power-on, keep the records only after a soft reset
+    if (flight_log.magic != FLIGHT_LOG_MAGIC)
+    {
+        memset(&flight_log, 0, sizeof(flight_log));
+        flight_log.magic = FLIGHT_LOG_MAGIC;
+    }
+
+    flight_log.boot_count++;
+    LOG_INFO(EV_BOOT, esp_reset_reason(), flight_log.boot_count);
+}
+
+void log_record(uint8_t level, Log_event event, int32_t arg0, int32_t arg1)
+{
+    uint32_t now = micros();
+
+    portENTER_CRITICAL(&flight_log_lock);
+    Log_record* r = &flight_log.records[flight_log.next_sequence % FLIGHT_LOG_LENGTH];
+    r->timestamp_us = now;
+    r->event = event;
+    r->level = level;
+    r->core = xPortGetCoreID();
+    r->arg0 = arg0;
+    r->arg1 = arg1;
+    flight_log.next_sequence++;
+    portEXIT_CRITICAL(&flight_log_lock);
+}
+
+void flight_log_dump()
+{
+    // Raw dump, one record per line: "LOG|<seq>|<us>|<level>|<core>|<event>|<arg0>|<arg1>"
+    uint32_t last = flight_log.next_sequence;
+    uint32_t first = (last > FLIGHT_LOG_LENGTH) ? last - FLIGHT_LOG_LENGTH : 0;
+
+    protocol_println("LOG_BEGIN|%lu|%lu", (unsigned long)flight_log.boot_count, (unsigned long)(last - first));
+
+    for (uint32_t seq = first; seq < last; seq++)
+    {
+        Log_record r;
+        portENTER_CRITICAL(&flight_log_lock);
+        r = flight_log.records[seq % FLIGHT_LOG_LENGTH];
+        portEXIT_CRITICAL(&flight_log_lock);
+
+        protocol_println("LOG|%lu|%lu|%u|%u|%u|%ld|%ld", (unsigned long)seq, (unsigned long)r.timestamp_us,
+                    r.level, r.core, r.event, (long)r.arg0, (long)r.arg1);
+    }
+
+    protocol_println("LOG_END");
+}
+
+//============================================================== CHECKPOINT ==============================================================//
+static Preferences checkpoint_store;
+static bool checkpoint_store_open = false;
+static Checkpoint last_checkpoint;              // what NVS holds now
+static std::atomic<bool> checkpoint_due{false};
+static volatile bool checkpoint_enabled = false; // only while the line runs, never snapshot the reset state
+static unsigned long last_checkpoint_ms = 0;
+static volatile bool gripper_at_home = false;
+
+static bool checkpoint_open()
+{
+    if (!checkpoint_store_open) checkpoint_store_open = checkpoint_store.begin(CHECKPOINT_NAMESPACE, false);
+    return checkpoint_store_open;
+}
+
+static void checkpoint_snapshot(Checkpoint* c)
+{
+    // Tasks keep running while this is copied, resume puts a fruit caught between two states back
+    memset(c, 0, sizeof(*c));
+    c->magic = CHECKPOINT_MAGIC;
+    c->version = CHECKPOINT_VERSION;
+    c->length = sizeof(Checkpoint);
+    c->sequence = last_checkpoint.sequence;
+
+    c->initial_fruit = initial_fruit;
+    c->preset_measure_times = preset_measure_times;
+    c->preset_conveyor_speed = preset_conveyor_speed;
+    c->adaptive_min_points = adaptive_min_points;
+    c->adaptive_max_points = adaptive_max_points;
+    c->adaptive_quality_threshold = adaptive_quality_threshold;
+    c->size_min_mm = size_min_mm;
+    c->size_max_mm = size_max_mm;
+    c->point_angle_deg = point_angle_deg;
+    c->stepper_pulse_us = stepper_pulse_us;
+
+    c->input_fruit_id = input_fruit_id;
+    c->measure_fruit_id = measure_fruit_id;
+    c->sorting_fruit_id = sorting_fruit_id;
+    memcpy(c->slots, fruit_list, sizeof(c->slots));
+
+    c->addressed_mode = addressed_mode;
+    c->gripper_homed = gripper_at_home;
+}
+
+void checkpoint_request()
+{
+    // Called at fruit boundaries, the write itself happens in loop()
+    checkpoint_due = true;
+}
+
+static void checkpoint_write()
+{
+    Checkpoint c;
+    checkpoint_snapshot(&c);
+
+    // Nothing changed since the last write, spare the flash
+    if (memcmp(&c, &last_checkpoint, sizeof(c)) == 0) return;
+    if (!checkpoint_open()) return;
+
+    c.sequence++;
+    unsigned long started = micros();
+    size_t written = checkpoint_store.putBytes(CHECKPOINT_KEY, &c, sizeof(c));
+    last_checkpoint_ms = millis();
+
+    if (written != sizeof(c))
+    {
+        LOG_ERROR(EV_CHECKPOINT_FAILED, written, 0);
+        return;
+    }
+    last_checkpoint = c;
+    LOG_INFO(EV_CHECKPOINT_WRITTEN, c.sequence, micros() - started);
+}
+
+void checkpoint_service()
+{
+    if (!checkpoint_due || !checkpoint_enabled) return;
+    if (last_checkpoint_ms != 0 && millis() - last_checkpoint_ms < CHECKPOINT_MIN_INTERVAL_MS) return;
+    checkpoint_due = false;
+    checkpoint_write();
+}
+
+void checkpoint_flush()
+{
+    // On stop, with the stations halted: a checkpoint held back by CHECKPOINT_MIN_INTERVAL_MS would
+    // resume with fruits that were already sorted and shift every later decision by one
+    checkpoint_due = false;
+    checkpoint_write();
+}
+
+bool checkpoint_load(Checkpoint* c)
+{
+    if (!checkpoint_open()) return false;
+    if (checkpoint_store.getBytesLength(CHECKPOINT_KEY) != sizeof(Checkpoint)) return false;
+    if (checkpoint_store.getBytes(CHECKPOINT_KEY, c, sizeof(Checkpoint)) != sizeof(Checkpoint)) return false;
+
+    return c->magic == CHECKPOINT_MAGIC && c->version == CHECKPOINT_VERSION && c->length == sizeof(Checkpoint) &&
+           c->preset_measure_times > 0;
+}
+
+bool reset_was_fault(esp_reset_reason_t reason)
+{
+    return reason == ESP_RST_BROWNOUT || reason == ESP_RST_PANIC || reason == ESP_RST_INT_WDT ||
+           reason == ESP_RST_TASK_WDT || reason == ESP_RST_WDT;
+}
+
+static void start_tasks()
+{
+    // --- Create main tasks ---
+#if CYCLIC_EXECUTIVE
+    executive_start();
+#else
+    // Stacks and control blocks are reused on every start, system_stop() deleted the previous tasks
+    input_task_handle = input_task_storage.create(Input_Task, "Input_Task", 1, 1);
+    measure_task_handle = measure_task_storage.create(Measure_Task, "Measure_Task", 1, 1);
+    sorting_task_handle = sorting_task_storage.create(Sorting_Task, "Sorting_Task", 1, 1);
+#endif
+
+    // --- Ensure UART task is running ---
+    if (uart_receive_task_handle == NULL || eTaskGetState(uart_receive_task_handle) == eDeleted)
+        uart_receive_task_handle = uart_task_storage.create(UartReceiveTask, "UartReceiveTask", 1, 1);
+}
+
+bool system_resume(bool addressed)
+{
+    Checkpoint c;
+    if (!checkpoint_load(&c)) return false;
+
+    unsigned long started = millis();
+    last_checkpoint = c;
+    addressed_mode = addressed;
+
+    initial_fruit = c.initial_fruit;
+    preset_measure_times = c.preset_measure_times;
+    preset_conveyor_speed = c.preset_conveyor_speed;
+    adaptive_min_points = c.adaptive_min_points;
+    adaptive_max_points = c.adaptive_max_points;
+    adaptive_quality_threshold = c.adaptive_quality_threshold;
+    size_min_mm = c.size_min_mm;
+    size_max_mm = c.size_max_mm;
+    point_angle_deg = c.point_angle_deg;
+    stepper_pulse_us = c.stepper_pulse_us;
+
+    input_fruit_id = c.input_fruit_id;
+    measure_fruit_id = c.measure_fruit_id;
+    sorting_fruit_id = c.sorting_fruit_id;
+    memcpy(fruit_list, c.slots, sizeof(fruit_list));
+
+    // A fruit caught half way through a station goes back to the last state it completed
+    long at_measure = BELT_NO_FRUIT;
+    for (int i = 0; i < FRUIT_LIST_LENGTH; i++)
+    {
+        Fruit* f = &fruit_list[i];
+        if (f->current_fruit_state != NOT_ENGAGED) f->faults |= FRUIT_FAULT_RESUMED;
+        if (f->current_fruit_state == INPUT_ENTERED)
+        {
+            f->current_fruit_state = NOT_ENGAGED;
+            f->dia_measure = 0;
+            f->states_sent = 0;
+        }
+        else if (f->current_fruit_state == MEASURE_ENTERED || f->current_fruit_state == MEASURE_PROCESSING)
+        {
+            at_measure = f->id;
+            f->current_fruit_state = INPUT_PASSED;
+            f->is_centered = false;
+            f->point_measure_done = false;
+            f->point_measured = 0;
+            f->states_sent &= (1 << MEASURE_ENTERED) - 1;
+        }
+    }
+
+    input_fruit_pointer = search_fruit(input_fruit_id);
+    measure_fruit_pointer = search_fruit(measure_fruit_id);
+    sorting_fruit_pointer = search_fruit(sorting_fruit_id);
+
+    // Sending lanes and command queues as after confirm|
+    sending_lanes_init();
+    measure_command_queue.reset();
+    sorting_command_queue.reset();
+
+    hardware_init();
+    gate_meter_reset();
+    belt_track_start(true);
+    if (at_measure != BELT_NO_FRUIT) belt_track_at_station(at_measure, BELT_MEASURE);
+
+    // Short start-up: no probe test stroke, and the gripper is homed only when it was not parked
+    gripper_release(true);
+    probe_valve.position_B();
+    // With metering the input station opens the gate once the fruits already on the belt allow it
+    if (GATE_METERING) gate_close();
+    else gate_open();
+    int angle = sorting_fruit_pointer != nullptr ? sorting_angle(sorting_fruit_pointer->sorting_type) : -1;
+    sorting_bin_write(angle >= 0 ? angle : SORTING_ANGLE_REST);
+
+    bool rehome = !(c.gripper_homed && check_trigger(GRIPPER_HOMING_SWITCH_PIN));
+    if (rehome) gripper_home();
+    else gripper_at_home = true;
+    conveyor_run();
+
+    // Only now: a fruit put back at the measuring sensor could otherwise be centered and gripped
+    // while the gripper is still homing and the belt is about to restart
+    motion_settings_latch();
+    start_tasks();
+
+    checkpoint_enabled = true;
+    checkpoint_request();
+
+    LOG_INFO(EV_RESUMED, input_fruit_id, rehome);
+    protocol_println("resumed|%ld|%ld|%ld|%d|%d|%lu", input_fruit_id, measure_fruit_id, sorting_fruit_id,
+                     preset_measure_times, preset_conveyor_speed, millis() - started);
+    return true;
+}
+
+void hardware_init()
+{
+    pinMode(INPUT_SENSOR_PIN, INPUT);
+    pinMode(MEASURE_SENSOR_PIN, INPUT);
+    pinMode(SORTING_SENSOR_PIN, INPUT);
+    pinMode(GRIPPER_DETECT_CONTACT_SWITCH_PIN_1, INPUT_PULLUP);
+    pinMode(GRIPPER_DETECT_CONTACT_SWITCH_PIN_2, INPUT_PULLUP);
+    pinMode(PROBE_DETECT_CONTACT_SWITCH_PIN, INPUT_PULLUP);
+    pinMode(GRIPPER_HOMING_SWITCH_PIN, INPUT_PULLUP);
+}
+
+void system_start()
+{
+    gate_meter_reset();
+    belt_track_start(false);
+    memset(&point_stats, 0, sizeof(point_stats));
+    memset(&size_stats, 0, sizeof(size_stats));
+    resync_reset();
+    motion_settings_latch();
+    start_tasks();
+
+    // --- Initialize system hardware ---
+    delay(200);
+
+    // Probe all the way back from wherever it stopped, then a short stroke forward to its rest
+    // position; both follow the measured valve response once it is known (after a stop)
+    gripper_release(true);
+    probe_valve.position_B();
+    vTaskDelay(probe_valve.dwell_ms(VALVE_B, PROBE_FULL_STROKE_RATIO, PROBE_STARTUP_RETRACT_MS) / portTICK_PERIOD_MS);
+    probe_valve.position_A();
+    vTaskDelay(probe_valve.dwell_ms(VALVE_A, 1.0f, PROBE_STARTUP_EXTEND_MS) / portTICK_PERIOD_MS);
+    probe_valve.mid_position();
+    gate_open();
+    sorting_bin_write(SORTING_ANGLE_REST);
+    gripper_home();
+    conveyor_run();
+
+    // A new session replaces whatever checkpoint NVS held
+    last_checkpoint.sequence = 0;
+    last_checkpoint_ms = 0;
+    checkpoint_open();          // the NVS handle is taken before memory_seal()
+    checkpoint_enabled = true;
+    checkpoint_request();
+
+    LOG_INFO(EV_SYSTEM_STARTED, preset_measure_times, preset_conveyor_speed);
+}
+
+void system_stop()
+{
+    // The checkpoint keeps the last running state for "resume"
+    bool was_running = checkpoint_enabled;
+    checkpoint_enabled = false;
+    clock_sync_stop();
+    belt_track_stop();
+
+    // --- Stop all tasks except UART ---
+    executive_stop();
+
+    if (input_task_handle != NULL)
+    {
+        vTaskDelete(input_task_handle);
+        input_task_handle = NULL;
+    }
+
+    if (measure_task_handle != NULL)
+    {
+        vTaskDelete(measure_task_handle);
+        measure_task_handle = NULL;
+    }
+
+    if (sorting_task_handle != NULL)
+    {
+        vTaskDelete(sorting_task_handle);
+        sorting_task_handle = NULL;
+    }
+
+    // Leave UART task alive because this function is called by it
+    LOG_INFO(EV_TASKS_STOPPED, 0, 0);
+
+    // No station can restart the belt now; stopping the belt model freezes belt time and the
+    // odometer until the next conveyor_run()
+    conveyor_stop();
+    if (was_running) checkpoint_flush();
+
+    // --- Empty queues ---
+    // loop() may be draining the lanes right now, so they are emptied rather than deleted
+    if (critical_sending_queue != nullptr) xQueueReset(critical_sending_queue);
+    if (info_sending_queue != nullptr) xQueueReset(info_sending_queue);
+    if (summary_sending_queue != nullptr) xQueueReset(summary_sending_queue);
+
+    measure_command_queue.reset();
+    sorting_command_queue.reset();
+
+    // --- Reset global variables ---
+    preset_measure_times = 0;
+    adaptive_min_points = 0;
+    adaptive_max_points = 0;
+    initial_fruit = 0;
+    preset_conveyor_speed = 0;
+
+    input_fruit_id = 0;
+    input_fruit_pointer = nullptr;
+
+    measure_fruit_id = 0;
+    measure_fruit_pointer = nullptr;
+
+    sorting_fruit_id = 0;
+    sorting_fruit_pointer = nullptr;
+
+    // --- Reset fruit list ---
+    memset(fruit_list, 0, sizeof(fruit_list));
+    fruit_list[0] = {0, NOT_ENGAGED, 0, false, 0, false, false, 0, NO_QUALITY, 0, {0}, 0, 0};
+
+    // --- Safe state ---
+    // The drivers set up at boot are reused, attaching them again would take heap after memory_seal()
+    gate_close();
+    probe_valve.mid_position();
+    gripper_valve.mid_position();
+
+    LOG_INFO(EV_STATE_RESET, 0, 0);
+
+    initialize_system();
+}
+
+
+// Belt time: milliseconds the conveyor has run, proportional to the distance a fruit travelled at a
+// fixed speed. The odometer integrates the commanded speed: mm/s times ms is um.
+static portMUX_TYPE belt_lock = portMUX_INITIALIZER_UNLOCKED;
+static unsigned long belt_total_ms = 0;
+static unsigned long belt_started_ms = 0;
+static bool belt_running = false;
+static int64_t belt_travel_um = 0;
+static unsigned long belt_travel_ms = 0;        // when belt_travel_um was last brought up to date
+static int belt_speed_mm_s = 0;
+
+static void belt_set_speed(int percent)
+{
+    // Called with belt_lock held
+    unsigned long now = millis();
+    belt_travel_um += (int64_t)belt_speed_mm_s * (long)(now - belt_travel_ms);
+    belt_travel_ms = now;
+    belt_speed_mm_s = BELT_MM_PER_S_AT_FULL_SPEED * constrain(percent, 0, 100) / 100;
+}
+
+void conveyor_run()
+{
+    conveyor_motor.run(preset_conveyor_speed);
+
+    portENTER_CRITICAL(&belt_lock);
+    if (!belt_running) belt_started_ms = millis();
+    belt_running = true;
+    belt_set_speed(preset_conveyor_speed);
+    portEXIT_CRITICAL(&belt_lock);
+}
+
+void conveyor_stop()
+{
+    conveyor_motor.run(0);
+
+    portENTER_CRITICAL(&belt_lock);
+    if (belt_running) belt_total_ms += millis() - belt_started_ms;
+    belt_running = false;
+    belt_set_speed(0);
+    portEXIT_CRITICAL(&belt_lock);
+}
+
+int64_t belt_odometer_um()
+{
+    portENTER_CRITICAL(&belt_lock);
+    int64_t travel = belt_travel_um + (int64_t)belt_speed_mm_s * (long)(millis() - belt_travel_ms);
+    portEXIT_CRITICAL(&belt_lock);
+    return travel;
+}
+
+unsigned long belt_ms()
+{
+    portENTER_CRITICAL(&belt_lock);
+    unsigned long total = belt_total_ms + (belt_running ? millis() - belt_started_ms : 0);
+    portEXIT_CRITICAL(&belt_lock);
+    return total;
+}
+
+//============================================================== MOTION ==============================================================//
+static bool gripper_closed()
+{
+    return check_trigger(GRIPPER_DETECT_CONTACT_SWITCH_PIN_1) && check_trigger(GRIPPER_DETECT_CONTACT_SWITCH_PIN_2);
+}
+
+static bool gripper_open()
+{
+    return !check_trigger(GRIPPER_DETECT_CONTACT_SWITCH_PIN_1) && !check_trigger(GRIPPER_DETECT_CONTACT_SWITCH_PIN_2);
+}
+
+bool adaptive_points()
+{
+    return adaptive_max_points > 0;
+}
+
+int measure_points_layout()
+{
+    // Points are laid out for the most a fruit can get, an adaptive fruit may stop anywhere in it
+    return adaptive_points() ? adaptive_max_points : preset_measure_times;
+}
+
+bool point_angle_fits(int angle_deg, int layout)
+{
+    // Points in quarters turn (layout / 4 - 1) times within a quarter turn, see plan_gripper_position();
+    // a larger angle would plan a negative turn to the next quarter and run the stepper backwards
+    if (layout % 4 != 0 || layout <= 4) return true;
+    return angle_deg * (layout / 4 - 1) <= 90;
+}
+
+// The measuring station takes the "motion|" settings when a fruit arrives, so a fruit is never
+// measured with two layouts and the stepper is not changed in the middle of a move
+static int planned_angle_deg = PRESET_ANGLE_BETWEEN_TWO_MEASUREMENT;
+
+// The latch runs on the measuring station or the executive, which must not write to the port
+static volatile bool motion_report_pending = false;
+
+void motion_settings_latch()
+{
+    // A confirm| after "motion|" may have changed the layout: the angle is cut to the largest that
+    // fits and the PC is told the setting now in use by motion_report()
+    int layout = measure_points_layout();
+    if (!point_angle_fits(point_angle_deg, layout))
+    {
+        int fitted = 90 / (layout / 4 - 1);
+        LOG_WARN(EV_POINT_ANGLE_CUT, point_angle_deg, fitted);
+        point_angle_deg = fitted;
+        checkpoint_request();
+        motion_report_pending = true;
+    }
+
+    // A checkpoint from a build without the executive may hold a pulse it cannot keep
+    if (stepper_pulse_us < STEPPER_PULSE_SHORTEST_uS)
+    {
+        stepper_pulse_us = STEPPER_PULSE_SHORTEST_uS;
+        checkpoint_request();
+        motion_report_pending = true;
+    }
+
+    planned_angle_deg = point_angle_deg;
+    gripper_stepper.set_pulse_delay(stepper_pulse_us);
+}
+
+void motion_report()
+{
+    if (!motion_report_pending) return;
+    motion_report_pending = false;
+    protocol_println("motion|%d|%d", point_angle_deg, stepper_pulse_us);
+}
+
+void motion_report_service()
+{
+    // On a half-duplex bus the report goes out with the answer to a poll
+    if (RS485_HALF_DUPLEX) return;
+
+    motion_report();
+}
+
+void motion_command(char* fields)
+{
+    // "<degrees between points>|<stepper pulse us>" after "motion|"
+    char* save_pointer = NULL;
+    char* token = strtok_r(fields, "|", &save_pointer);
+    int angle = token != NULL ? atoi(token) : -1;
+    token = strtok_r(NULL, "|", &save_pointer);
+    int pulse_us = token != NULL ? atoi(token) : -1;
+
+    if (angle < 1 || angle > 90 || pulse_us < STEPPER_PULSE_SHORTEST_uS || pulse_us > STEPPER_PULSE_MAX_uS)
+    {
+        protocol_println("motion failed: must be \"motion|<1..90 degrees>|<%d..%d us>\"", STEPPER_PULSE_SHORTEST_uS, STEPPER_PULSE_MAX_uS);
+        return;
+    }
+    if (!point_angle_fits(angle, measure_points_layout()))
+    {
+        protocol_println("motion failed: %d points need at most %d degrees", measure_points_layout(), 90 / (measure_points_layout() / 4 - 1));
+        return;
+    }
+
+    point_angle_deg = angle;
+    stepper_pulse_us = pulse_us;
+    checkpoint_request();
+    protocol_println("motion|%d|%d", point_angle_deg, stepper_pulse_us);
+}
+
+int plan_gripper_position(int current_point, Motion* plan)
+{
+    // Gripper moves that bring the fruit to the current point, the probe stroke is added by the caller
+    int n = 0;
+    int layout = measure_points_layout();
+
+    if ((layout % 4) == 0)
+    {
+        if (current_point == 1)
+        {
+            plan[n++] = {MOTION_GRIP};
+        }
+        else if (layout == 4 || 
+                (current_point > (layout / 4) && 
+                current_point % (layout / 4) == 1))
+        {
+            // Next quarter: turn the rest of the way, let go, turn back empty and grip again
+            plan[n++] = {MOTION_ROTATE, (float) (90 - planned_angle_deg * ((layout/4) - 1))};
+            plan[n++] = {MOTION_RELEASE};
+            plan[n++] = {MOTION_HOME};
+            plan[n++] = {MOTION_GRIP};
+        }
+        else 
+        {
+            plan[n++] = {MOTION_ROTATE, (float)planned_angle_deg};
+        }
+    }
+    else
+    {
+        if (current_point == 1)
+        {
+            plan[n++] = {MOTION_GRIP};
+        }
+        else 
+        {
+            plan[n++] = {MOTION_ROTATE, (float)planned_angle_deg};
+        }
+    }
+    return n;
+}
+
+bool motion_step(Motion& m, bool blocking)
+{
+    // Advances one move, returns true when it is complete. Valve moves end on their contact
+    // switches; stepper moves run to the end in one call when blocking, one pulse edge otherwise.
+    bool first = !m.started;
+    m.started = true;
+
+    switch (m.type)
+    {
+        case MOTION_GRIP:
+            if (first) gripper_valve.position_A();
+            if (gripper_closed() == false) return false;
+            gripper_valve.record_response(VALVE_A);
+            LOG_DEBUG(EV_VALVE_RESPONSE, 2 + VALVE_A, gripper_valve.timing[VALVE_A].last_ms);
+            gripper_valve.mid_position();
+            return true;
+
+        case MOTION_RELEASE:
+            if (first) gripper_valve.position_B();
+            if (gripper_open() == false) return false;
+            gripper_valve.record_response(VALVE_B);
+            LOG_DEBUG(EV_VALVE_RESPONSE, 2 + VALVE_B, gripper_valve.timing[VALVE_B].last_ms);
+            gripper_valve.mid_position();
+            return true;
+
+        case MOTION_RELEASE_ALL:
+            gripper_valve.position_B();
+            return true;
+
+        case MOTION_ROTATE:
+            gripper_at_home = false;
+            if (blocking)
+            {
+                gripper_stepper.run_by_angle(m.angle_deg, true);
+                return true;
+            }
+            if (first) gripper_stepper.begin_run_by_angle(m.angle_deg, true);
+            return gripper_stepper.step();
+
+        case MOTION_HOME:
+            if (blocking) gripper_stepper.home(-1);
+            else
+            {
+                if (first) gripper_stepper.begin_home(-1);
+                if (gripper_stepper.step() == false) return false;
+            }
+            gripper_at_home = true;
+            return true;
+
+        case MOTION_PROBE_EXTEND:
+            if (first) probe_valve.position_A();
+            if (check_trigger(PROBE_DETECT_CONTACT_SWITCH_PIN) == false) return false;
+            probe_valve.record_response(VALVE_A);
+            LOG_DEBUG(EV_VALVE_RESPONSE, VALVE_A, probe_valve.timing[VALVE_A].last_ms);
+            probe_valve.mid_position();
+            return true;
+
+        case MOTION_PROBE_RETRACT:
+        case MOTION_PROBE_RETRACT_LAST:
+        {
+            bool last = (m.type == MOTION_PROBE_RETRACT_LAST);
+            if (first) probe_valve.position_B();
+
+            if (m.phase == 0)
+            {
+                // The switch opens as the probe leaves the fruit, bounded so a stuck switch cannot hold the last point
+                if (check_trigger(PROBE_DETECT_CONTACT_SWITCH_PIN) == true &&
+                    (!last || probe_valve.since_command_ms() < probe_valve.dwell_ms(VALVE_B, 1.0f, PROBE_LAST_RETRACT_MS))) return false;
+
+                if (check_trigger(PROBE_DETECT_CONTACT_SWITCH_PIN) == false)
+                {
+                    probe_valve.record_response(VALVE_B);
+                    LOG_DEBUG(EV_VALVE_RESPONSE, VALVE_B, probe_valve.timing[VALVE_B].last_ms);
+                }
+
+                // Pull clear of the fruit: the stroke past the switch takes about as long as the stroke to it,
+                // after the last point the probe goes back twice as far so the fruit can leave
+                if (last) m.deadline_ms = millis() - probe_valve.since_command_ms() + probe_valve.dwell_ms(VALVE_B, 2.0f, PROBE_LAST_RETRACT_MS);
+                else m.deadline_ms = millis() + probe_valve.dwell_ms(VALVE_B, 1.0f, PROBE_CLEAR_MS);
+                m.phase = 1;
+            }
+
+            if ((long)(millis() - m.deadline_ms) < 0) return false;
+            probe_valve.mid_position();
+            return true;
+        }
+    }
+    return true;
+}
+
+void run_motion(Motion_type type, float angle_deg)
+{
+    Motion m = {type, angle_deg};
+    while (motion_step(m, true) == false) vTaskDelay(VALVE_POLL_MS / portTICK_PERIOD_MS);
+}
+
+void gripper_position_fruit(int current_point)
+{
+    Motion plan[MOTION_PLAN_LENGTH];
+    int n = plan_gripper_position(current_point, plan);
+    for (int i = 0; i < n; i++) run_motion(plan[i].type, plan[i].angle_deg);
+}
+
+void gripper_release(bool all_the_way)
+{
+    run_motion(all_the_way ? MOTION_RELEASE_ALL : MOTION_RELEASE);
+}
+
+void gripper_grip()
+{
+    run_motion(MOTION_GRIP);
+}
+
+void gripper_home()
+{
+    run_motion(MOTION_HOME);
+}
+
+void probe_attach()
+{
+    run_motion(MOTION_PROBE_EXTEND);
+}
+
+void sorting_bin_write(int angle)
+{
+    sorting_servo.set_angle(angle);
+}
+
+static bool gate_is_open = false;
+
+void gate_open()
+{
+    gate_servo.set_angle(GATE_OPEN_ANGLE);
+    gate_is_open = true;
+}
+
+void gate_close()
 {
     gate_servo.set_angle(GATE_CLOSE_ANGLE);
-}
\ No newline at end of file
+    gate_is_open = false;
+}
+
+
+//============================================================== GATE METERING ==============================================================//
+// The belt stops while a fruit is measured and every fruit on it stops too, so all timing here is
+// belt time: a fruit released now reaches the measuring sensor after gate_to_input + input_to_measure,
+// and the station is free for it once the fruit ahead has arrived and moved its own diameter plus
+// GATE_CLEARANCE_MS. The gate opens when the first is no earlier than the second.
+static portMUX_TYPE gate_meter_lock = portMUX_INITIALIZER_UNLOCKED;
+static float gate_to_input_ms = 0;              // gate open to the fruit at the input sensor
+static float input_to_measure_ms = 0;           // input sensor to measuring sensor
+static float diameter_ms = 0;                   // running mean of the occlusion time at the input sensor
+static uint32_t gate_samples = 0;
+static uint32_t travel_samples = 0;
+static uint32_t diameter_samples = 0;
+static unsigned long gate_opened_belt_ms = 0;
+static bool gate_opened_by_meter = false;
+static unsigned long input_entry_belt_ms[FRUIT_LIST_LENGTH];   // by fruit id, for the travel samples
+static long input_entry_id[FRUIT_LIST_LENGTH];
+
+static long ahead_id = -1;                      // last fruit let through the gate
+static unsigned long ahead_dia_ms = 0;          // 0 while it is still in the input sensor
+static unsigned long ahead_arrival_belt_ms = 0;
+static bool ahead_arrived = false;
+static bool ahead_held = false;                 // current decision already counted as held
+
+static uint32_t gate_released = 0;
+static uint32_t gate_held_for_spacing = 0;
+static uint32_t station_idle_total_ms = 0;      // measuring station waiting for the next fruit
+static uint32_t station_idle_count = 0;
+static unsigned long station_free_ms = 0;       // 0 while the station is busy
+
+static float running_mean(float mean, float sample, uint32_t samples)
+{
+    return samples == 0 ? sample : mean + GATE_SAMPLE_WEIGHT * (sample - mean);
+}
+
+void gate_meter_reset()
+{
+    portENTER_CRITICAL(&gate_meter_lock);
+    gate_samples = 0;
+    travel_samples = 0;
+    diameter_samples = 0;
+    gate_opened_by_meter = false;
+    ahead_id = -1;
+    ahead_held = false;
+    gate_released = 0;
+    gate_held_for_spacing = 0;
+    station_idle_total_ms = 0;
+    station_idle_count = 0;
+    station_free_ms = 0;
+    for (int i = 0; i < FRUIT_LIST_LENGTH; i++) input_entry_id[i] = -1;
+    portEXIT_CRITICAL(&gate_meter_lock);
+}
+
+static int fruits_before_station()
+{
+    int count = 0;
+    for (int i = 0; i < FRUIT_LIST_LENGTH; i++)
+        if (fruit_list[i].current_fruit_state == INPUT_ENTERED || fruit_list[i].current_fruit_state == INPUT_PASSED) count++;
+    return count;
+}
+
+bool gate_release_due()
+{
+    // Called by the input station on every step, also while the fruit ahead is still in its sensor
+    if (gate_is_open) return false;
+
+    int buffered = fruits_before_station();
+    if (buffered >= GATE_BUFFER_FRUITS) return false;
+
+    // The fruit let through next needs a free slot in the fruit list
+    long next_id = ahead_id >= 0 ? ahead_id + 1 : input_fruit_id;
+    Fruit* next = search_fruit(next_id);
+    if (next == nullptr || next->current_fruit_state != NOT_ENGAGED) return false;
+
+    unsigned long now = belt_ms();
+    portENTER_CRITICAL(&gate_meter_lock);
+    bool due;
+    if (ahead_id < 0) due = true;
+    else if (gate_samples < GATE_MIN_SAMPLES || travel_samples < GATE_MIN_SAMPLES)
+    {
+        // No travel times yet: the next fruit follows once the one ahead has left the input sensor,
+        // which keeps them at least the gate to sensor distance apart
+        due = ahead_dia_ms > 0;
+    }
+    else
+    {
+        unsigned long ahead_arrival = ahead_arrived ? ahead_arrival_belt_ms
+                                                    : input_entry_belt_ms[ahead_id % FRUIT_LIST_LENGTH] + (unsigned long)input_to_measure_ms;
+        unsigned long ahead_dia = ahead_dia_ms > 0 ? ahead_dia_ms : (unsigned long)diameter_ms;
+        unsigned long free_at = ahead_arrival + ahead_dia + GATE_CLEARANCE_MS;
+        unsigned long arrival = now + (unsigned long)(gate_to_input_ms + input_to_measure_ms);
+        due = (long)(arrival - free_at) >= 0;
+
+        if (!due && !ahead_held) gate_held_for_spacing++;
+        ahead_held = !due;
+    }
+
+    if (due)
+    {
+        gate_opened_belt_ms = now;
+        gate_opened_by_meter = true;
+        ahead_held = false;
+        gate_released++;
+    }
+    portEXIT_CRITICAL(&gate_meter_lock);
+    return due;
+}
+
+void gate_meter_input_entered(long fruit_id)
+{
+    unsigned long now = belt_ms();
+
+    portENTER_CRITICAL(&gate_meter_lock);
+    // A feeder that ran empty makes the gate wait look long, such samples are left out
+    float sample = now - gate_opened_belt_ms;
+    if (gate_opened_by_meter && (gate_samples < GATE_MIN_SAMPLES || sample < 2.0f * gate_to_input_ms))
+        gate_to_input_ms = running_mean(gate_to_input_ms, sample, gate_samples++);
+    gate_opened_by_meter = false;
+
+    input_entry_belt_ms[fruit_id % FRUIT_LIST_LENGTH] = now;
+    input_entry_id[fruit_id % FRUIT_LIST_LENGTH] = fruit_id;
+    ahead_id = fruit_id;
+    ahead_dia_ms = 0;
+    ahead_arrived = false;
+    portEXIT_CRITICAL(&gate_meter_lock);
+}
+
+void gate_meter_input_passed(long fruit_id, unsigned long dia_ms)
+{
+    portENTER_CRITICAL(&gate_meter_lock);
+    diameter_ms = running_mean(diameter_ms, dia_ms, diameter_samples++);
+    if (fruit_id == ahead_id) ahead_dia_ms = dia_ms;
+    portEXIT_CRITICAL(&gate_meter_lock);
+}
+
+void gate_meter_measure_entered(long fruit_id)
+{
+    unsigned long now = belt_ms();
+
+    portENTER_CRITICAL(&gate_meter_lock);
+    // Fruits that entered before a start or resume have no entry time
+    if (input_entry_id[fruit_id % FRUIT_LIST_LENGTH] == fruit_id)
+    {
+        input_to_measure_ms = running_mean(input_to_measure_ms, now - input_entry_belt_ms[fruit_id % FRUIT_LIST_LENGTH], travel_samples++);
+    }
+
+    if (fruit_id == ahead_id)
+    {
+        ahead_arrived = true;
+        ahead_arrival_belt_ms = now;
+    }
+
+    if (station_free_ms != 0)
+    {
+        station_idle_total_ms += millis() - station_free_ms;
+        station_idle_count++;
+        station_free_ms = 0;
+    }
+    portEXIT_CRITICAL(&gate_meter_lock);
+}
+
+void gate_meter_station_free()
+{
+    portENTER_CRITICAL(&gate_meter_lock);
+    station_free_ms = millis();
+    portEXIT_CRITICAL(&gate_meter_lock);
+}
+
+void print_gate_stats()
+{
+    // "GATE|metering=..|buffer=..|released=..|held=..|gate_to_input=..|input_to_measure=..|samples=..|station_idle_mean=.." belt/wall ms
+    portENTER_CRITICAL(&gate_meter_lock);
+    uint32_t released = gate_released, held = gate_held_for_spacing, samples = gate_samples < travel_samples ? gate_samples : travel_samples;
+    unsigned long to_input = tenths(gate_to_input_ms), to_measure = tenths(input_to_measure_ms);
+    unsigned long idle = station_idle_count ? station_idle_total_ms / station_idle_count : 0;
+    portEXIT_CRITICAL(&gate_meter_lock);
+
+    protocol_println("GATE|metering=%d|buffer=%d|released=%lu|held=%lu|gate_to_input=%lu.%lu|input_to_measure=%lu.%lu|samples=%lu|station_idle_mean=%lu",
+                     GATE_METERING, GATE_BUFFER_FRUITS, (unsigned long)released, (unsigned long)held,
+                     to_input / 10, to_input % 10, to_measure / 10, to_measure % 10, (unsigned long)samples, idle);
+}
+
+
+//============================================================== BELT TRACKING ==============================================================//
+// Every fruit between the input sensor and the sorting sensor has a track: its position is the belt
+// odometer since its front passed the input sensor, so it stands still whenever the belt does. The
+// measuring and sorting sensors are watched here, the stations take their arrivals from the tracker.
+// A leading edge belongs to the fruit expected nearest to it; once the station distance is learned
+// that fruit must be within BELT_TRACK_WINDOW_MM, otherwise the edge is extra. The fruit is then put
+// on the station, the station distance learned, and the next station becomes its target. A fruit
+// that runs more than the window past a station without an edge is missing there and is still
+// followed to the next station. An extra edge at the measuring sensor is a fruit the input sensor
+// did not see: it gets an inserted track so the sorting sensor expects it too.
+static portMUX_TYPE belt_track_lock = portMUX_INITIALIZER_UNLOCKED;
+static Belt_track belt_tracks[FRUIT_LIST_LENGTH];
+static Belt_track inserted_tracks[BELT_INSERTED_TRACKS];
+static Belt_arrival station_arrival[BELT_STATION_COUNT];
+static int64_t station_um[BELT_STATION_COUNT] = {0, BELT_INPUT_TO_MEASURE_MM * 1000LL, BELT_INPUT_TO_SORTING_MM * 1000LL};
+static uint32_t station_samples[BELT_STATION_COUNT] = {};
+static Belt_station_stats station_stats[BELT_STATION_COUNT];
+static bool station_sensor_was_triggered[BELT_STATION_COUNT];
+static int64_t station_clear_um[BELT_STATION_COUNT];      // belt odometer when the sensor last went clear
+static long station_last_fruit[BELT_STATION_COUNT];       // fruit of the last edge, for bounces
+static bool entry_unplaced = false;                         // a fruit was in the input sensor at the start
+static volatile bool belt_tracking = false;
+static const int station_sensor_pins[BELT_STATION_COUNT] = {INPUT_SENSOR_PIN, MEASURE_SENSOR_PIN, SORTING_SENSOR_PIN};
+static const char* station_names[BELT_STATION_COUNT] = {"input", "measure", "sorting"};
+
+void belt_track_start(bool resumed)
+{
+    // The learned distances are kept, they belong to the machine and not to the session
+    int64_t odometer = belt_odometer_um();
+
+    portENTER_CRITICAL(&belt_track_lock);
+    memset(belt_tracks, 0, sizeof(belt_tracks));
+    memset(inserted_tracks, 0, sizeof(inserted_tracks));
+    memset(station_arrival, 0, sizeof(station_arrival));
+    memset(station_stats, 0, sizeof(station_stats));
+
+    // Fruits already on the belt after a resume are placed by their next edge
+    for (int i = 0; resumed && i < FRUIT_LIST_LENGTH; i++)
+    {
+        const Fruit& f = fruit_list[i];
+        if (f.current_fruit_state != INPUT_PASSED && f.current_fruit_state != MEASURE_PASSED) continue;
+        belt_tracks[f.id % FRUIT_LIST_LENGTH] = {f.id, 0, f.current_fruit_state == INPUT_PASSED ? BELT_MEASURE : BELT_SORTING, true, false};
+    }
+
+    // A fruit already in front of a sensor is not a new edge
+    for (int s = 0; s < BELT_STATION_COUNT; s++)
+    {
+        station_sensor_was_triggered[s] = check_trigger(station_sensor_pins[s]);
+        station_clear_um[s] = odometer - RESYNC_MIN_GAP_MM * 1000LL;
+        station_last_fruit[s] = BELT_NO_FRUIT;
+    }
+    entry_unplaced = station_sensor_was_triggered[BELT_INPUT];
+    portEXIT_CRITICAL(&belt_track_lock);
+    belt_tracking = true;
+}
+
+void belt_track_stop()
+{
+    // Fruits taken off the stopped line must not count as missing or extra
+    belt_tracking = false;
+}
+
+void belt_track_entered(long fruit_id)
+{
+    // Called by the input station when it gives the fruit in front of the input sensor its id. One
+    // that was already in the sensor at the start has its front somewhere past it, its next edge places it
+    int64_t odometer = belt_odometer_um();
+
+    portENTER_CRITICAL(&belt_track_lock);
+    belt_tracks[fruit_id % FRUIT_LIST_LENGTH] = {fruit_id, odometer, BELT_MEASURE, true, !entry_unplaced};
+    entry_unplaced = false;
+    portEXIT_CRITICAL(&belt_track_lock);
+}
+
+void belt_track_at_station(long fruit_id, Belt_station station)
+{
+    // After a resume: the fruit a station was working on when it stopped is still in front of its
+    // sensor, which is not an edge; it arrives there now
+    int64_t odometer = belt_odometer_um();
+
+    portENTER_CRITICAL(&belt_track_lock);
+    Belt_track* t = &belt_tracks[fruit_id % FRUIT_LIST_LENGTH];
+    if (station_sensor_was_triggered[station] && t->active && t->fruit_id == fruit_id && t->next == station)
+    {
+        *t = {fruit_id, odometer - station_um[station], (Belt_station)(station + 1), true, true};
+        Belt_arrival& a = station_arrival[station];
+        a = {fruit_id, odometer, a.sequence + 1};
+        station_last_fruit[station] = fruit_id;
+    }
+    portEXIT_CRITICAL(&belt_track_lock);
+}
+
+static Belt_track* belt_track_expected(Belt_station station, int64_t odometer)
+{
+    // Called with belt_track_lock held. Fruits taken over from a checkpoint come first, lowest id
+    // first; then, once the station distance is learned, the fruit expected nearest to the odometer,
+    // before that the lowest id
+    bool trusted = station_samples[station] >= BELT_TRACK_MIN_SAMPLES;
+    Belt_track* best = nullptr;
+    int64_t best_distance = 0;
+
+    for (int i = 0; i < FRUIT_LIST_LENGTH + BELT_INSERTED_TRACKS; i++)
+    {
+        Belt_track* c = i < FRUIT_LIST_LENGTH ? &belt_tracks[i] : &inserted_tracks[i - FRUIT_LIST_LENGTH];
+        if (!c->active || c->next != station) continue;
+
+        int64_t error = odometer - c->reference_um - station_um[station];
+        int64_t distance = error < 0 ? -error : error;
+        bool better;
+        if (best == nullptr) better = true;
+        else if (!c->located || !best->located) better = !c->located && (best->located || c->fruit_id < best->fruit_id);
+        else if (trusted) better = distance < best_distance;
+        else better = c->fruit_id != BELT_UNKNOWN_FRUIT && (best->fruit_id == BELT_UNKNOWN_FRUIT || c->fruit_id < best->fruit_id);
+
+        if (better)
+        {
+            best = c;
+            best_distance = distance;
+        }
+    }
+    return best;
+}
+
+static void belt_track_insert(int64_t odometer)
+{
+    // Called with belt_track_lock held, for an unexplained edge at the measuring sensor
+    for (int i = 0; i < BELT_INSERTED_TRACKS; i++)
+    {
+        Belt_track* t = &inserted_tracks[i];
+        if (t->active) continue;
+        *t = {BELT_UNKNOWN_FRUIT, odometer - station_um[BELT_MEASURE], BELT_SORTING, true, true};
+        resync_report(BELT_MEASURE, RESYNC_INSERT, BELT_UNKNOWN_FRUIT, RESYNC_UNTRACKED, odometer);
+        return;
+    }
+    resync_report(BELT_MEASURE, RESYNC_IGNORE, BELT_UNKNOWN_FRUIT, RESYNC_UNTRACKED, odometer);
+}
+
+static void belt_track_edge(Belt_station station, int64_t odometer)
+{
+    // Called with belt_track_lock held
+    Belt_station_stats& st = station_stats[station];
+
+    // The sensor saw the fruit that just left it once more
+    if (odometer - station_clear_um[station] < RESYNC_MIN_GAP_MM * 1000LL)
+    {
+        resync_report(station, RESYNC_IGNORE, station_last_fruit[station], RESYNC_BOUNCE, odometer);
+        return;
+    }
+
+    Belt_track* t = belt_track_expected(station, odometer);
+    int64_t error = t != nullptr ? odometer - t->reference_um - station_um[station] : 0;
+    bool trusted = t != nullptr && t->located && station_samples[station] >= BELT_TRACK_MIN_SAMPLES;
+    if (t == nullptr || (trusted && (error < -BELT_TRACK_WINDOW_MM * 1000LL || error > BELT_TRACK_WINDOW_MM * 1000LL)))
+    {
+        st.extra++;
+        LOG_WARN(EV_FRUIT_EXTRA, station, (error < 0 ? -error : error) / 1000);
+        station_last_fruit[station] = BELT_UNKNOWN_FRUIT;
+        if (station == BELT_MEASURE) belt_track_insert(odometer);
+        else resync_report(station, RESYNC_IGNORE, BELT_UNKNOWN_FRUIT, RESYNC_UNTRACKED, odometer);
+        return;
+    }
+
+    // Inserted tracks were placed from the learned distance, they teach nothing
+    if (t->located && t->fruit_id != BELT_UNKNOWN_FRUIT)
+    {
+        uint32_t magnitude = (uint32_t)(error < 0 ? -error : error);
+        if (trusted && magnitude > st.worst_error_um) st.worst_error_um = magnitude;
+
+        if (station_samples[station] == 0) station_um[station] = odometer - t->reference_um;
+        else station_um[station] += (int64_t)(BELT_TRACK_SAMPLE_WEIGHT * (float)error);
+        station_samples[station]++;
+    }
+
+    st.matched++;
+    t->reference_um = odometer - station_um[station];
+    t->located = true;
+    t->next = (Belt_station)(station + 1);
+    if (t->next == BELT_STATION_COUNT) t->active = false;
+
+    station_last_fruit[station] = t->fruit_id;
+    if (t->fruit_id != BELT_UNKNOWN_FRUIT)
+    {
+        Belt_arrival& a = station_arrival[station];
+        a = {t->fruit_id, odometer, a.sequence + 1};
+    }
+}
+
+static void belt_track_poll(Belt_station station, int64_t odometer)
+{
+    // Called with belt_track_lock held, from loop() and from the station that waits for the edge
+    bool triggered = check_trigger(station_sensor_pins[station]);
+    if (triggered && !station_sensor_was_triggered[station]) belt_track_edge(station, odometer);
+    if (!triggered && station_sensor_was_triggered[station]) station_clear_um[station] = odometer;
+    station_sensor_was_triggered[station] = triggered;
+}
+
+void belt_track_service()
+{
+    // From loop(): a fruit stays in front of a sensor for hundreds of ms, polling every loop is enough
+    if (!belt_tracking) return;
+
+    int64_t odometer = belt_odometer_um();
+
+    portENTER_CRITICAL(&belt_track_lock);
+    for (int s = BELT_MEASURE; s < BELT_STATION_COUNT; s++) belt_track_poll((Belt_station)s, odometer);
+
+    for (int i = 0; i < FRUIT_LIST_LENGTH + BELT_INSERTED_TRACKS; i++)
+    {
+        Belt_track* t = i < FRUIT_LIST_LENGTH ? &belt_tracks[i] : &inserted_tracks[i - FRUIT_LIST_LENGTH];
+        if (!t->active || !t->located || station_samples[t->next] < BELT_TRACK_MIN_SAMPLES) continue;
+        if (odometer - t->reference_um - station_um[t->next] <= BELT_TRACK_WINDOW_MM * 1000LL) continue;
+
+        // A fruit the sensor did not see may still be on the belt, the next station looks for it
+        station_stats[t->next].missing++;
+        LOG_WARN(EV_FRUIT_MISSING, t->fruit_id, t->next);
+        if (t->fruit_id == BELT_UNKNOWN_FRUIT) resync_report(t->next, RESYNC_SKIP, BELT_UNKNOWN_FRUIT, RESYNC_OVERDUE, odometer);
+        t->next = (Belt_station)(t->next + 1);
+        if (t->next == BELT_STATION_COUNT) t->active = false;
+    }
+    portEXIT_CRITICAL(&belt_track_lock);
+}
+
+bool belt_track_arrival(Belt_station station, uint32_t* seen_sequence, Belt_arrival* arrival)
+{
+    // Called by a station on every step: polls its sensor so the edge is seen without waiting for
+    // loop(), true with the arrival when there is one the station has not taken yet
+    if (!belt_tracking) return false;
+
+    int64_t odometer = belt_odometer_um();
+
+    portENTER_CRITICAL(&belt_track_lock);
+    belt_track_poll(station, odometer);
+    bool fresh = station_arrival[station].sequence != *seen_sequence;
+    *arrival = station_arrival[station];
+    portEXIT_CRITICAL(&belt_track_lock);
+
+    *seen_sequence = arrival->sequence;
+    return fresh;
+}
+
+bool belt_track_passed(long fruit_id, Belt_station station)
+{
+    // True once the fruit went past the station, seen or not
+    portENTER_CRITICAL(&belt_track_lock);
+    const Belt_track& t = belt_tracks[fruit_id % FRUIT_LIST_LENGTH];
+    bool passed = t.fruit_id == fruit_id && t.next > station;
+    portEXIT_CRITICAL(&belt_track_lock);
+    return passed;
+}
+
+long belt_track_next_fruit(Belt_station station)
+{
+    // Fruit that reaches the station next, BELT_UNKNOWN_FRUIT for an inserted track, BELT_NO_FRUIT if none.
+    // Fruits taken over from a checkpoint are ahead of every fruit that entered since.
+    int64_t odometer = belt_odometer_um();
+    long fruit_id = BELT_NO_FRUIT;
+    long unlocated_id = BELT_NO_FRUIT;
+    int64_t furthest = 0;
+
+    portENTER_CRITICAL(&belt_track_lock);
+    for (int i = 0; i < FRUIT_LIST_LENGTH + BELT_INSERTED_TRACKS; i++)
+    {
+        const Belt_track& t = i < FRUIT_LIST_LENGTH ? belt_tracks[i] : inserted_tracks[i - FRUIT_LIST_LENGTH];
+        if (!t.active || t.next != station) continue;
+        if (!t.located)
+        {
+            if (unlocated_id == BELT_NO_FRUIT || t.fruit_id < unlocated_id) unlocated_id = t.fruit_id;
+            continue;
+        }
+        int64_t position = odometer - t.reference_um;
+        if (fruit_id == BELT_NO_FRUIT || position > furthest)
+        {
+            fruit_id = t.fruit_id;
+            furthest = position;
+        }
+    }
+    portEXIT_CRITICAL(&belt_track_lock);
+    return unlocated_id != BELT_NO_FRUIT ? unlocated_id : fruit_id;
+}
+
+static bool belt_track_position(long fruit_id, int64_t odometer, int64_t* position_um, Belt_station* next)
+{
+    // Called with belt_track_lock held
+    const Belt_track& t = belt_tracks[fruit_id % FRUIT_LIST_LENGTH];
+    if (!t.active || t.fruit_id != fruit_id || !t.located) return false;
+    *position_um = odometer - t.reference_um;
+    *next = t.next;
+    return true;
+}
+
+long belt_eta_ms(long fruit_id, Belt_station station)
+{
+    // Belt running time until the fruit's front reaches the station, at the speed the belt runs at or
+    // will run at again after a measurement stop; BELT_ETA_UNKNOWN if the fruit is not tracked or past it
+    int64_t odometer = belt_odometer_um();
+    int speed = BELT_MM_PER_S_AT_FULL_SPEED * constrain(preset_conveyor_speed, 0, 100) / 100;
+
+    int64_t position = 0;
+    Belt_station next = BELT_INPUT;
+    portENTER_CRITICAL(&belt_track_lock);
+    bool known = belt_track_position(fruit_id, odometer, &position, &next);
+    int64_t remaining = station_um[station] - position;
+    portEXIT_CRITICAL(&belt_track_lock);
+
+    if (!known || station < next || speed <= 0) return BELT_ETA_UNKNOWN;
+    return remaining > 0 ? (long)(remaining / speed) : 0;
+}
+
+void print_belt_track_stats()
+{
+    // "BELT|odometer_mm=..|speed_mm_s=..|in_flight=.." then per watched station
+    // "BELT|<station>|distance_mm=..|samples=..|matched=..|missing=..|extra=..|worst_error_mm=.."
+    int64_t odometer = belt_odometer_um();
+
+    portENTER_CRITICAL(&belt_track_lock);
+    int in_flight = 0;
+    for (int i = 0; i < FRUIT_LIST_LENGTH; i++) if (belt_tracks[i].active) in_flight++;
+    for (int i = 0; i < BELT_INSERTED_TRACKS; i++) if (inserted_tracks[i].active) in_flight++;
+    Belt_station_stats stats[BELT_STATION_COUNT];
+    memcpy(stats, station_stats, sizeof(stats));
+    int64_t distance[BELT_STATION_COUNT];
+    memcpy(distance, station_um, sizeof(distance));
+    uint32_t samples[BELT_STATION_COUNT];
+    memcpy(samples, station_samples, sizeof(samples));
+    portEXIT_CRITICAL(&belt_track_lock);
+
+    protocol_println("BELT|odometer_mm=%lld|speed_mm_s=%d|in_flight=%d", (long long)(odometer / 1000), belt_speed_mm_s, in_flight);
+    for (int s = BELT_MEASURE; s < BELT_STATION_COUNT; s++)
+    {
+        protocol_println("BELT|%s|distance_mm=%lld|samples=%lu|matched=%lu|missing=%lu|extra=%lu|worst_error_mm=%lu.%lu", station_names[s],
+                         (long long)(distance[s] / 1000), (unsigned long)samples[s], (unsigned long)stats[s].matched,
+                         (unsigned long)stats[s].missing, (unsigned long)stats[s].extra,
+                         (unsigned long)(stats[s].worst_error_um / 1000), (unsigned long)(stats[s].worst_error_um % 1000 / 100));
+    }
+}
+
+void print_belt_tracks()
+{
+    // "TRACK|<id>|position_mm=..|next=<station>|eta_ms=.." per fruit in flight, position "?" until a
+    // resumed fruit has been placed by an edge, id BELT_UNKNOWN_FRUIT for inserted tracks, then "TRACK_END|<count>"
+    int64_t odometer = belt_odometer_um();
+    Belt_track tracks[FRUIT_LIST_LENGTH + BELT_INSERTED_TRACKS];
+
+    portENTER_CRITICAL(&belt_track_lock);
+    memcpy(tracks, belt_tracks, sizeof(belt_tracks));
+    memcpy(tracks + FRUIT_LIST_LENGTH, inserted_tracks, sizeof(inserted_tracks));
+    portEXIT_CRITICAL(&belt_track_lock);
+
+    int count = 0;
+    for (int i = 0; i < FRUIT_LIST_LENGTH + BELT_INSERTED_TRACKS; i++)
+    {
+        const Belt_track& t = tracks[i];
+        if (!t.active) continue;
+        count++;
+        long eta = t.fruit_id == BELT_UNKNOWN_FRUIT ? BELT_ETA_UNKNOWN : belt_eta_ms(t.fruit_id, t.next);
+        if (!t.located) protocol_println("TRACK|%ld|position_mm=?|next=%s|eta_ms=%d", t.fruit_id, station_names[t.next], BELT_ETA_UNKNOWN);
+        else protocol_println("TRACK|%ld|position_mm=%lld|next=%s|eta_ms=%ld", t.fruit_id, (long long)((odometer - t.reference_um) / 1000),
+                              station_names[t.next], eta);
+    }
+    protocol_println("TRACK_END|%d", count);
+}
+
+//============================================================== RESYNC ==============================================================//
+// Corrections the tracker and the stations make to stay in step with the fruits on the belt. The
+// tracker inserts tracks and ignores bounces and unexplained edges, the stations skip fruits and
+// re-associate. Every correction goes to the flight log and to a ring that "resync" prints.
+static portMUX_TYPE resync_lock = portMUX_INITIALIZER_UNLOCKED;
+static Resync_log resync_log;
+static const char* resync_action_names[RESYNC_ACTION_COUNT] = {"skip", "reassociate", "insert", "ignore"};
+static const char* resync_cause_names[] = {"overdue", "overtaken", "untracked", "bounce", "already_passed"};
+
+void resync_reset()
+{
+    // A new session starts with an empty log, a resume keeps it
+    portENTER_CRITICAL(&resync_lock);
+    memset(&resync_log, 0, sizeof(resync_log));
+    portEXIT_CRITICAL(&resync_lock);
+}
+
+void resync_report(Belt_station station, Resync_action action, long fruit_id, Resync_cause cause, int64_t odometer_um)
+{
+    // From the stations and from the tracker with belt_track_lock held
+    portENTER_CRITICAL(&resync_lock);
+    Resync_correction& c = resync_log.entries[resync_log.written % RESYNC_LOG_LENGTH];
+    c = {resync_log.written + 1, fruit_id, (int32_t)(odometer_um / 1000), (uint8_t)station, (uint8_t)action, (uint8_t)cause};
+    resync_log.written++;
+    resync_log.counts[action]++;
+    portEXIT_CRITICAL(&resync_lock);
+
+    LOG_WARN(EV_RESYNC, fruit_id, station * 100 + action * 10 + cause);
+}
+
+long resync_arrival(Belt_station station, long expected_id, const Belt_arrival& arrival)
+{
+    // The fruit a station takes the edge for: the one it waits for, a later one (the station skips
+    // the fruits before it), or BELT_NO_FRUIT when the edge is for a fruit it has finished with
+    if (arrival.fruit_id == expected_id) return expected_id;
+
+    if (arrival.fruit_id < expected_id)
+    {
+        resync_report(station, RESYNC_IGNORE, arrival.fruit_id, RESYNC_ALREADY_PASSED, arrival.odometer_um);
+        return BELT_NO_FRUIT;
+    }
+
+    resync_report(station, RESYNC_REASSOCIATE, arrival.fruit_id, RESYNC_OVERTAKEN, arrival.odometer_um);
+    return arrival.fruit_id;
+}
+
+void print_resync_log()
+{
+    // "CORRECTION|<seq>|<station>|<action>|<fruit id>|<cause>|<belt mm>" for every correction since the
+    // last "resync", oldest first, then "CORRECTION_END|<count>|lost=<n>"
+    Resync_correction entries[RESYNC_LOG_LENGTH];
+
+    portENTER_CRITICAL(&resync_lock);
+    uint32_t lost = 0;
+    if (resync_log.written - resync_log.sent > RESYNC_LOG_LENGTH)
+    {
+        lost = resync_log.written - resync_log.sent - RESYNC_LOG_LENGTH;
+        resync_log.sent += lost;
+    }
+    uint32_t first = resync_log.sent, count = resync_log.written - resync_log.sent;
+    for (uint32_t i = 0; i < count; i++) entries[i] = resync_log.entries[(first + i) % RESYNC_LOG_LENGTH];
+    resync_log.sent = resync_log.written;
+    portEXIT_CRITICAL(&resync_lock);
+
+    for (uint32_t i = 0; i < count; i++)
+    {
+        const Resync_correction& c = entries[i];
+        protocol_println("CORRECTION|%lu|%s|%s|%ld|%s|%ld", (unsigned long)c.sequence, station_names[c.station], resync_action_names[c.action],
+                         c.fruit_id, resync_cause_names[c.cause], (long)c.odometer_mm);
+    }
+    protocol_println("CORRECTION_END|%lu|lost=%lu", (unsigned long)count, (unsigned long)lost);
+}
+
+void print_resync_stats()
+{
+    // "RESYNC|skip=..|reassociate=..|insert=..|ignore=.." since confirm|
+    portENTER_CRITICAL(&resync_lock);
+    uint32_t counts[RESYNC_ACTION_COUNT];
+    memcpy(counts, resync_log.counts, sizeof(counts));
+    portEXIT_CRITICAL(&resync_lock);
+
+    protocol_println("RESYNC|skip=%lu|reassociate=%lu|insert=%lu|ignore=%lu", (unsigned long)counts[RESYNC_SKIP],
+                     (unsigned long)counts[RESYNC_REASSOCIATE], (unsigned long)counts[RESYNC_INSERT], (unsigned long)counts[RESYNC_IGNORE]);
+}
+
+//============================================================== SIZE GRADING ==============================================================//
+// The input station times the fruit through its sensor in belt distance, so a belt stop while the
+// sensor is blocked does not make the fruit look bigger. The grade is final: the PC never sees a
+// MEASURE_PASSED for a reject and cannot send it a type.
+void size_grade(Fruit* f, int64_t blocked_um)
+{
+    // Called by the input station once the fruit has left the sensor
+    float diameter = blocked_um / 1000.0f * SIZE_CALIBRATION_SCALE + SIZE_CALIBRATION_OFFSET_MM;
+    f->diameter_mm = diameter > 0.0f ? (int)(diameter + 0.5f) : 0;
+
+    size_stats.graded++;
+    size_stats.total_mm += f->diameter_mm;
+
+    bool undersize = size_min_mm > 0 && f->diameter_mm < size_min_mm;
+    bool oversize = size_max_mm > 0 && f->diameter_mm > size_max_mm;
+    if (!undersize && !oversize) return;
+
+    if (undersize) size_stats.undersize++;
+    else size_stats.oversize++;
+    f->sorting_type = SORTING_TYPE_REJECT;
+    LOG_INFO(EV_SIZE_REJECTED, f->id, f->diameter_mm);
+}
+
+bool size_rejected(const Fruit* f)
+{
+    return f->sorting_type == SORTING_TYPE_REJECT;
+}
+
+int sorting_angle(unsigned int sorting_type)
+{
+    // Flap position for a sorting type, -1 while the fruit has none yet
+    switch (sorting_type)
+    {
+        case 1:                   return SORTING_ANGLE_TYPE_1;
+        case 2:                   return SORTING_ANGLE_TYPE_2;
+        case SORTING_TYPE_REJECT: return SORTING_ANGLE_REJECT;
+        default:                  return -1;
+    }
+}
+
+void size_command(char* fields)
+{
+    // "<min mm>|<max mm>" after "size|", taken from the next fruit at the input sensor on
+    char* save_pointer = NULL;
+    char* token = strtok_r(fields, "|", &save_pointer);
+    int min_mm = token != NULL ? atoi(token) : -1;
+    token = strtok_r(NULL, "|", &save_pointer);
+    int max_mm = token != NULL ? atoi(token) : -1;
+
+    if (min_mm < 0 || max_mm < 0 || (max_mm > 0 && max_mm < min_mm))
+    {
+        protocol_println("size failed: must be \"size|<min mm>|<max mm>\", 0 for no limit");
+        return;
+    }
+    if (!SORTING_REJECT_BIN && (min_mm > 0 || max_mm > 0))
+    {
+        protocol_println("size failed: no reject bin, build with SORTING_ANGLE_REJECT");
+        return;
+    }
+
+    size_min_mm = min_mm;
+    size_max_mm = max_mm;
+    checkpoint_request();
+    protocol_println("size|%d|%d", size_min_mm, size_max_mm);
+}
+
+void print_size_stats()
+{
+    // "SIZE|min_mm=..|max_mm=..|graded=..|undersize=..|oversize=..|skipped=..|skip_rate=..|mean_mm=.." skip rate in % of graded
+    Size_stats st = size_stats;
+    unsigned long rate = st.graded ? tenths(100.0f * st.skipped / st.graded) : 0;
+    unsigned long mean = st.graded ? tenths((float)st.total_mm / st.graded) : 0;
+    protocol_println("SIZE|min_mm=%d|max_mm=%d|graded=%lu|undersize=%lu|oversize=%lu|skipped=%lu|skip_rate=%lu.%lu|mean_mm=%lu.%lu",
+                     size_min_mm, size_max_mm, (unsigned long)st.graded, (unsigned long)st.undersize,
+                     (unsigned long)st.oversize, (unsigned long)st.skipped, rate / 10, rate % 10, mean / 10, mean % 10);
+}
+
+//============================================================== MEMORY ==============================================================//
+static const char* memory_region_names[MEMORY_REGION_COUNT] = {"pipeline", "commands", "sending", "checkpoint", "station_tasks", "uart_task", "clock_sync", "resync"};
+static uint32_t boot_free_heap = 0;
+static TaskHandle_t loop_task_handle = NULL;
+static unsigned long last_memory_check_ms = 0;
+static bool heap_allocation_logged = false;
+#define MEMORY_TASK_COUNT 6
+static bool stack_low_logged[MEMORY_TASK_COUNT] = {};
+
+struct Task_memory
+{
+    const char* name;
+    TaskHandle_t handle;
+    size_t stack_bytes;
+};
+
+// Order matches the EV_STACK_LOW task index
+static void task_memory(Task_memory* tasks)
+{
+    int n = 0;
+    tasks[n++] = {"input", input_task_handle, INPUT_TASK_STACK_BYTES};
+    tasks[n++] = {"measure", measure_task_handle, MEASURE_TASK_STACK_BYTES};
+    tasks[n++] = {"sorting", sorting_task_handle, SORTING_TASK_STACK_BYTES};
+    tasks[n++] = {"executive", executive_task_handle, EXECUTIVE_TASK_STACK_BYTES};
+    tasks[n++] = {"uart", uart_receive_task_handle, UART_TASK_STACK_BYTES};
+    tasks[n++] = {"loop", loop_task_handle, getArduinoLoopTaskStackSize()};     // stack set by the Arduino core
+}
+
+void memory_seal()
+{
+    // Called at the end of setup(): the first session is running, so every driver has taken its memory
+    loop_task_handle = xTaskGetCurrentTaskHandle();
+    boot_free_heap = ESP.getFreeHeap();
+    last_memory_check_ms = millis();
+}
+
+void memory_service()
+{
+    if (boot_free_heap == 0 || millis() - last_memory_check_ms < MEMORY_CHECK_INTERVAL_MS) return;
+    last_memory_check_ms = millis();
+
+    // Each problem is logged once per boot so a leak does not flush the flight log
+    uint32_t free_heap = ESP.getFreeHeap();
+    if (free_heap < boot_free_heap && HEAP_SEAL_ENFORCE)
+    {
+        // The flight log in RTC memory survives the panic reset and shows what was taken
+        LOG_ERROR(EV_HEAP_ALLOCATED, boot_free_heap - free_heap, free_heap);
+        abort();
+    }
+    if (free_heap < boot_free_heap && !heap_allocation_logged)
+    {
+        LOG_WARN(EV_HEAP_ALLOCATED, boot_free_heap - free_heap, free_heap);
+        heap_allocation_logged = true;
+    }
+
+    Task_memory tasks[MEMORY_TASK_COUNT];
+    task_memory(tasks);
+    for (int i = 0; i < MEMORY_TASK_COUNT; i++)
+    {
+        if (tasks[i].handle == NULL || eTaskGetState(tasks[i].handle) == eDeleted || stack_low_logged[i]) continue;
+
+        UBaseType_t least_free = uxTaskGetStackHighWaterMark(tasks[i].handle);
+        if (least_free < STACK_MIN_FREE_BYTES)
+        {
+            LOG_WARN(EV_STACK_LOW, i, least_free);
+            stack_low_logged[i] = true;
+        }
+    }
+}
+
+void print_memory_stats()
+{
+    // "MEM|<region>|bytes=.." per subsystem, "STACK|<task>|size=..|least_free=.." per running task
+    // and "HEAP|free=..|least_free=..|boot_free=..|allocated_after_boot=.."
+    for (int r = 0; r < MEMORY_REGION_COUNT; r++)
+        protocol_println("MEM|%s|bytes=%lu", memory_region_names[r], (unsigned long)MEMORY_REGION_BYTES[r]);
+    protocol_println("MEM|total|bytes=%lu|budget=%lu|flight_log_rtc=%lu", (unsigned long)memory_total(),
+                     (unsigned long)STATIC_RAM_BUDGET_BYTES, (unsigned long)sizeof(Flight_log));
+
+    Task_memory tasks[MEMORY_TASK_COUNT];
+    task_memory(tasks);
+    for (int i = 0; i < MEMORY_TASK_COUNT; i++)
+    {
+        if (tasks[i].handle == NULL || eTaskGetState(tasks[i].handle) == eDeleted) continue;
+        protocol_println("STACK|%s|size=%lu|least_free=%lu", tasks[i].name, (unsigned long)tasks[i].stack_bytes,
+                         (unsigned long)uxTaskGetStackHighWaterMark(tasks[i].handle));
+    }
+
+    uint32_t free_heap = ESP.getFreeHeap();
+    protocol_println("HEAP|free=%lu|least_free=%lu|boot_free=%lu|allocated_after_boot=%lu", (unsigned long)free_heap,
+                     (unsigned long)ESP.getMinFreeHeap(), (unsigned long)boot_free_heap,
+                     (unsigned long)(free_heap < boot_free_heap ? boot_free_heap - free_heap : 0));
+}
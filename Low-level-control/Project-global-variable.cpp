@@ -1,6 +1,9 @@
 #include "Project-lib.h"
 
 int preset_measure_times = 0;
+int adaptive_min_points = 0;
+int adaptive_max_points = 0;
+int adaptive_quality_threshold = ADAPTIVE_QUALITY_THRESHOLD;
 long initial_fruit = 0;
 int preset_conveyor_speed = 0;
 
@@ -13,7 +16,20 @@ Fruit* measure_fruit_pointer = nullptr;
 long sorting_fruit_id = 0;
 Fruit* sorting_fruit_pointer = nullptr;
 
-QueueHandle_t messages_sending_queue = nullptr;
+QueueHandle_t critical_sending_queue = nullptr;
+QueueHandle_t info_sending_queue = nullptr;
+QueueHandle_t summary_sending_queue = nullptr;
+Lane_stats lane_stats[LANE_COUNT] = {};
+bool report_summary = REPORT_SUMMARY;
+
+mySpscQueue<Command, COMMAND_QUEUE_LENGTH> measure_command_queue;
+mySpscQueue<Command, COMMAND_QUEUE_LENGTH> sorting_command_queue;
+
+// Not initialized on boot so the records of the previous run are still there after a soft reset
+RTC_NOINIT_ATTR Flight_log flight_log;
+
+int node_id = NODE_ID;
+bool addressed_mode = false;
 
 Task_state input_task_state;
 Task_state measure_task_state;
@@ -23,14 +39,34 @@ TaskHandle_t input_task_handle = NULL;
 TaskHandle_t measure_task_handle = NULL;
 TaskHandle_t sorting_task_handle = NULL;
 TaskHandle_t uart_receive_task_handle = NULL;
+TaskHandle_t executive_task_handle = NULL;
+Executive_stats executive_stats = {};
+Point_stats point_stats = {};
+int size_min_mm = SIZE_MIN_MM;
+int size_max_mm = SIZE_MAX_MM;
+int point_angle_deg = PRESET_ANGLE_BETWEEN_TWO_MEASUREMENT;
+int stepper_pulse_us = STEPPER_PULSE_IN_uS;
+Size_stats size_stats = {};
+
+#if CYCLIC_EXECUTIVE
+Static_task<EXECUTIVE_TASK_STACK_BYTES> executive_task_storage;
+#else
+Static_task<INPUT_TASK_STACK_BYTES> input_task_storage;
+Static_task<MEASURE_TASK_STACK_BYTES> measure_task_storage;
+Static_task<SORTING_TASK_STACK_BYTES> sorting_task_storage;
+#endif
+Static_task<UART_TASK_STACK_BYTES> uart_task_storage;
+Static_queue<CRITICAL_LANE_LENGTH, Fruit_data> critical_lane_storage;
+Static_queue<INFO_LANE_LENGTH, Fruit_data> info_lane_storage;
+Static_queue<SUMMARY_LANE_LENGTH, Fruit_summary> summary_lane_storage;
 
 Fruit fruit_list[FRUIT_LIST_LENGTH] = {
-    {0, NOT_ENGAGED, 0, false, 0, false, false, 0}
+    {0, NOT_ENGAGED, 0, false, 0, false, false, 0, NO_QUALITY, 0, {0}, 0, 0}
 };
 
 myMotor conveyor_motor(CONVEYOR_MOTOR_PIN);
-myStepper gripper_stepper(GRIPPER_STEPPER_PUL_PIN, GRIPPER_STEPPER_DIR_PIN, GRIPPER_STEPPER_ENABLE_PIN, GRIPPER_HOMING_SWITCH_PIN);
+Gripper_stepper gripper_stepper;
 myServo gate_servo(GATE_SERVO_PIN);
 myServo sorting_servo(SORTING_SERVO_PIN);
-myPneumaticValve probe_valve(PROBE_CYLINDER_EXTEND_VALVE_PIN, PROBE_CYLINDER_RETRACT_VALVE_PIN);
-myPneumaticValve gripper_valve(GRIPPER_CYLINDER_GRIP_VALVE_PIN, GRIPPER_CYLINDER_RELEASE_VALVE_PIN);
\ No newline at end of file
+Probe_valve probe_valve;
+Gripper_valve gripper_valve;
\ No newline at end of file
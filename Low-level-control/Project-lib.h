@@ -6,45 +6,364 @@
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
 #include "freertos/queue.h"
+#include "esp_system.h"
+#include "esp_timer.h"
+#include "Preferences.h"
+#include "soc/gpio_struct.h"
+#include <atomic>
+
+//============================================================== BOARD ==============================================================//
+// Every role on the machine mapped to a GPIO. Each machine variant gets its own constexpr
+// description, the build picks one with MACHINE_VARIANT (e.g. -DMACHINE_VARIANT=2).
+struct Board_description
+{
+    int input_sensor_pin;
+    int measure_sensor_pin;
+    int sorting_sensor_pin;
 
-//============================================================== DEFINE ==============================================================//
+    int conveyor_motor_pin;
+    int gate_servo_pin;
+    int sorting_servo_pin;
 
-#define INPUT_SENSOR_PIN 36
-#define MEASURE_SENSOR_PIN 39
-#define SORTING_SENSOR_PIN 34
+    int gripper_homing_switch_pin;
+    int gripper_stepper_pul_pin;
+    int gripper_stepper_dir_pin;
+    int gripper_stepper_enable_pin;
 
-#define CONVEYOR_MOTOR_PIN 26
+    int gripper_cylinder_grip_valve_pin;
+    int gripper_cylinder_release_valve_pin;
+    int gripper_detect_contact_switch_pin_1;
+    int gripper_detect_contact_switch_pin_2;
 
-#define GATE_SERVO_PIN 27
-#define GATE_CLOSE_ANGLE 180
-#define GATE_OPEN_ANGLE 90
+    int probe_cylinder_extend_valve_pin;
+    int probe_cylinder_retract_valve_pin;
+    int probe_detect_contact_switch_pin;
 
-#define GRIPPER_HOMING_SWITCH_PIN 13
-#define GRIPPER_STEPPER_PUL_PIN 16
-#define GRIPPER_STEPPER_DIR_PIN 17
-#define GRIPPER_STEPPER_ENABLE_PIN 14
+    int rs485_de_pin = -1;                  // driver enable of the RS-485 transceiver, -1 when not fitted
+};
 
-#define GRIPPER_CYLINDER_GRIP_VALVE_PIN 21
-#define GRIPPER_CYLINDER_RELEASE_VALVE_PIN 19
-#define GRIPPER_DETECT_CONTACT_SWITCH_PIN_1 22
-#define GRIPPER_DETECT_CONTACT_SWITCH_PIN_2 18
+// Original sorting line
+constexpr Board_description BOARD_VARIANT_1 =
+{
+    .input_sensor_pin = 36,
+    .measure_sensor_pin = 39,
+    .sorting_sensor_pin = 34,
+
+    .conveyor_motor_pin = 26,
+    .gate_servo_pin = 27,
+    .sorting_servo_pin = 25,
+
+    .gripper_homing_switch_pin = 13,
+    .gripper_stepper_pul_pin = 16,
+    .gripper_stepper_dir_pin = 17,
+    .gripper_stepper_enable_pin = 14,
+
+    .gripper_cylinder_grip_valve_pin = 21,
+    .gripper_cylinder_release_valve_pin = 19,
+    .gripper_detect_contact_switch_pin_1 = 22,
+    .gripper_detect_contact_switch_pin_2 = 18,
+
+    .probe_cylinder_extend_valve_pin = 32,
+    .probe_cylinder_retract_valve_pin = 33,
+    .probe_detect_contact_switch_pin = 23,
+};
 
-#define PROBE_CYLINDER_EXTEND_VALVE_PIN 32
-#define PROBE_CYLINDER_RETRACT_VALVE_PIN 33
-#define PROBE_DETECT_CONTACT_SWITCH_PIN 23
+// Original sorting line on a shared RS-485 bus, transceiver DE on GPIO 4
+constexpr Board_description with_rs485_de_pin(Board_description b, int pin)
+{
+    b.rs485_de_pin = pin;
+    return b;
+}
 
-#define SORTING_SERVO_PIN 25
+constexpr Board_description BOARD_VARIANT_2 = with_rs485_de_pin(BOARD_VARIANT_1, 4);
 
+#ifndef MACHINE_VARIANT
+#define MACHINE_VARIANT 1
+#endif
+
+#if MACHINE_VARIANT == 1
+constexpr Board_description BOARD = BOARD_VARIANT_1;
+#elif MACHINE_VARIANT == 2
+constexpr Board_description BOARD = BOARD_VARIANT_2;
+#else
+#error "Unknown MACHINE_VARIANT, add its Board_description in Project-lib.h"
+#endif
+
+constexpr bool board_pins_are_unique(const Board_description& b)
+{
+    const int pins[] = {b.input_sensor_pin, b.measure_sensor_pin, b.sorting_sensor_pin,
+                        b.conveyor_motor_pin, b.gate_servo_pin, b.sorting_servo_pin,
+                        b.gripper_homing_switch_pin, b.gripper_stepper_pul_pin, b.gripper_stepper_dir_pin, b.gripper_stepper_enable_pin,
+                        b.gripper_cylinder_grip_valve_pin, b.gripper_cylinder_release_valve_pin,
+                        b.gripper_detect_contact_switch_pin_1, b.gripper_detect_contact_switch_pin_2,
+                        b.probe_cylinder_extend_valve_pin, b.probe_cylinder_retract_valve_pin, b.probe_detect_contact_switch_pin,
+                        b.rs485_de_pin};
+    const int count = sizeof(pins) / sizeof(pins[0]);
+    const int first_optional = count - 1;   // optional roles are listed last and may be -1
+
+    for (int i = 0; i < count; i++)
+    {
+        if (i >= first_optional && pins[i] == -1) continue;
+        if (pins[i] < 0 || pins[i] > 39) return false;
+        for (int j = i + 1; j < count; j++) if (pins[i] == pins[j]) return false;
+    }
+    return true;
+}
+
+constexpr bool board_outputs_are_valid(const Board_description& b)
+{
+    const int outputs[] = {b.conveyor_motor_pin, b.gate_servo_pin, b.sorting_servo_pin,
+                           b.gripper_stepper_pul_pin, b.gripper_stepper_dir_pin, b.gripper_stepper_enable_pin,
+                           b.gripper_cylinder_grip_valve_pin, b.gripper_cylinder_release_valve_pin,
+                           b.probe_cylinder_extend_valve_pin, b.probe_cylinder_retract_valve_pin, b.rs485_de_pin};
+
+    for (int pin : outputs)
+    {
+        if (pin == -1) continue;                    // optional role not fitted
+        if (pin >= 34) return false;                // GPIO34-39 are input only
+        if (pin >= 6 && pin <= 11) return false;    // GPIO6-11 belong to the SPI flash
+    }
+    return true;
+}
+
+static_assert(board_pins_are_unique(BOARD), "Board description maps two roles to the same pin (or to a pin that does not exist)");
+static_assert(board_outputs_are_valid(BOARD), "Board description maps an output to an input-only or flash pin");
+
+//============================================================== NODE ==============================================================//
+// Several controllers can share one bus. Frames are then "@<node>:<payload>" and node 0 is
+// the broadcast address. With RS485_HALF_DUPLEX the UART drives the transceiver's DE pin and
+// fruit messages only go out when the host sends "poll" to this node.
+#ifndef NODE_ID
+#define NODE_ID 1
+#endif
+
+#ifndef RS485_HALF_DUPLEX
+#define RS485_HALF_DUPLEX 0
+#endif
+
+#define BROADCAST_NODE_ID 0
+#define POLL_MESSAGE_BUDGET 8   // fruit messages sent per poll before "eot"
+
+static_assert(NODE_ID != BROADCAST_NODE_ID, "Node 0 is the broadcast address");
+static_assert(!RS485_HALF_DUPLEX || BOARD.rs485_de_pin >= 0, "RS485_HALF_DUPLEX needs rs485_de_pin in the board description");
+
+constexpr int INPUT_SENSOR_PIN = BOARD.input_sensor_pin;
+constexpr int MEASURE_SENSOR_PIN = BOARD.measure_sensor_pin;
+constexpr int SORTING_SENSOR_PIN = BOARD.sorting_sensor_pin;
+
+constexpr int CONVEYOR_MOTOR_PIN = BOARD.conveyor_motor_pin;
+constexpr int GATE_SERVO_PIN = BOARD.gate_servo_pin;
+constexpr int SORTING_SERVO_PIN = BOARD.sorting_servo_pin;
+
+constexpr int GRIPPER_HOMING_SWITCH_PIN = BOARD.gripper_homing_switch_pin;
+constexpr int GRIPPER_STEPPER_PUL_PIN = BOARD.gripper_stepper_pul_pin;
+constexpr int GRIPPER_STEPPER_DIR_PIN = BOARD.gripper_stepper_dir_pin;
+constexpr int GRIPPER_STEPPER_ENABLE_PIN = BOARD.gripper_stepper_enable_pin;
+
+constexpr int GRIPPER_CYLINDER_GRIP_VALVE_PIN = BOARD.gripper_cylinder_grip_valve_pin;
+constexpr int GRIPPER_CYLINDER_RELEASE_VALVE_PIN = BOARD.gripper_cylinder_release_valve_pin;
+constexpr int GRIPPER_DETECT_CONTACT_SWITCH_PIN_1 = BOARD.gripper_detect_contact_switch_pin_1;
+constexpr int GRIPPER_DETECT_CONTACT_SWITCH_PIN_2 = BOARD.gripper_detect_contact_switch_pin_2;
+
+constexpr int PROBE_CYLINDER_EXTEND_VALVE_PIN = BOARD.probe_cylinder_extend_valve_pin;
+constexpr int PROBE_CYLINDER_RETRACT_VALVE_PIN = BOARD.probe_cylinder_retract_valve_pin;
+constexpr int PROBE_DETECT_CONTACT_SWITCH_PIN = BOARD.probe_detect_contact_switch_pin;
+
+//============================================================== FAST GPIO ==============================================================//
+// Direct register access instead of digitalWrite()/digitalRead(). Gpio_pin<PIN> picks the bank and
+// the mask at compile time, each call is a single store to GPIO.out_w1ts/out_w1tc or a load of GPIO.in;
+// the stepper and the valves drive their pins through it. fast_gpio_write()/fast_gpio_read() take
+// the pin at run time for callers that index pins (station sensors) and test the bank on every call.
+template<int PIN>
+struct Gpio_pin
+{
+    static_assert(PIN >= 0 && PIN < 40, "not an ESP32 GPIO");
+
+    static inline __attribute__((always_inline)) void write(bool level)
+    {
+        if constexpr (PIN < 32)
+        {
+            if (level) GPIO.out_w1ts = (1UL << PIN);
+            else GPIO.out_w1tc = (1UL << PIN);
+        }
+        else
+        {
+            if (level) GPIO.out1_w1ts.val = (1UL << (PIN - 32));
+            else GPIO.out1_w1tc.val = (1UL << (PIN - 32));
+        }
+    }
+
+    static inline __attribute__((always_inline)) bool read()
+    {
+        if constexpr (PIN < 32) return (GPIO.in >> PIN) & 1UL;
+        else return (GPIO.in1.val >> (PIN - 32)) & 1UL;
+    }
+};
+
+inline __attribute__((always_inline)) void fast_gpio_write(int pin, bool level)
+{
+    if (pin < 32)
+    {
+        if (level) GPIO.out_w1ts = (1UL << pin);
+        else GPIO.out_w1tc = (1UL << pin);
+    }
+    else
+    {
+        if (level) GPIO.out1_w1ts.val = (1UL << (pin - 32));
+        else GPIO.out1_w1tc.val = (1UL << (pin - 32));
+    }
+}
+
+inline __attribute__((always_inline)) bool fast_gpio_read(int pin)
+{
+    if (pin < 32) return (GPIO.in >> pin) & 1UL;
+    return (GPIO.in1.val >> (pin - 32)) & 1UL;
+}
+
+// Sensors and switches pull low when triggered
+inline __attribute__((always_inline)) bool check_trigger(int sensor_pin)
+{
+    return !fast_gpio_read(sensor_pin);
+}
+
+//============================================================== DEFINE ==============================================================//
+
+#define GATE_CLOSE_ANGLE 180
+#define GATE_OPEN_ANGLE 90
+
+// Gate metering: the input station releases the next fruit so it reaches the measuring sensor
+// just after the fruit ahead has cleared it, see gate_release_due(). Times are belt time.
+#ifndef GATE_METERING
+#define GATE_METERING 1                 // 0: the gate reopens only once the measuring station is done
+#endif
+#ifndef GATE_BUFFER_FRUITS
+#define GATE_BUFFER_FRUITS 3            // fruits allowed between the gate and the measuring station
+#endif
+#define GATE_CLEARANCE_MS 200           // clear belt between two fruits at the measuring sensor
+#define GATE_MIN_SAMPLES 2              // travel samples before releases are timed
+#define GATE_SAMPLE_WEIGHT 0.25f
+
+// Belt tracking: every fruit's position along the belt from the input sensor, integrated from the
+// commanded conveyor speed and put back on the station at each sensor edge, see belt_track_service()
+#define BELT_MM_PER_S_AT_FULL_SPEED 250     // only scales the unit, station distances are learned in the same mm
+#define BELT_INPUT_TO_MEASURE_MM 300        // starting distances until the first arrivals
+#define BELT_INPUT_TO_SORTING_MM 650
+#define BELT_TRACK_WINDOW_MM 50             // an edge this close to where a fruit is expected is that fruit
+#define BELT_TRACK_MIN_SAMPLES 2            // arrivals at a station before its distance is trusted
+#define BELT_TRACK_SAMPLE_WEIGHT 0.25f
+#define BELT_ETA_UNKNOWN -1
+#define BELT_NO_FRUIT -1
+#define BELT_UNKNOWN_FRUIT -2               // track inserted for a fruit that never got an id at the input sensor
+#define BELT_INSERTED_TRACKS 4
+
+// Resync: the stations follow the tracker's arrivals instead of counting sensor edges themselves.
+// A fruit that ran past a station unseen is skipped, an edge for a later fruit re-associates the
+// station with it, an edge no fruit explains gets an inserted track and goes to the reject bin.
+// Each correction is logged with its cause, "resync" lists them.
+#define RESYNC_MIN_GAP_MM 10                // a sensor clear for less belt than this saw the same fruit again
+#define RESYNC_LOG_LENGTH 16
+
+// The line has two bins, under the flap at SORTING_ANGLE_TYPE_1 and SORTING_ANGLE_TYPE_2. Between
+// fruits the flap rests halfway, which is not a bin. Fruits the controller rejects itself need a bin
+// of their own: build with SORTING_ANGLE_REJECT set to the flap angle of a fitted reject bin. Without
+// one the controller refuses size limits, and the fruits resync skips pass the flap at its rest angle.
 #define SORTING_ANGLE_TYPE_1 0
 #define SORTING_ANGLE_TYPE_2 180
-
+#define SORTING_ANGLE_REST ((SORTING_ANGLE_TYPE_1 + SORTING_ANGLE_TYPE_2) / 2)
+#define SORTING_TYPE_REJECT 3               // set by the controller itself, see size pre-grading and resync
+#ifdef SORTING_ANGLE_REJECT
+#define SORTING_REJECT_BIN 1
+#else
+#define SORTING_REJECT_BIN 0
+#define SORTING_ANGLE_REJECT SORTING_ANGLE_REST
+#endif
+
+// Size pre-grading: the belt distance the input sensor stays blocked is the fruit's diameter.
+// "size|<min mm>|<max mm>" sets the accepted range, 0 leaves that side open. A fruit outside it
+// goes past the measuring station without being gripped or probed and into the reject bin, so
+// limits need SORTING_ANGLE_REJECT.
+#ifndef SIZE_MIN_MM
+#define SIZE_MIN_MM 0
+#endif
+#ifndef SIZE_MAX_MM
+#define SIZE_MAX_MM 0
+#endif
+#if (SIZE_MIN_MM > 0 || SIZE_MAX_MM > 0) && !SORTING_REJECT_BIN
+#error "size limits send fruits to the reject bin, define SORTING_ANGLE_REJECT as its flap angle"
+#endif
+#ifndef SIZE_CALIBRATION_SCALE
+#define SIZE_CALIBRATION_SCALE 1.0f         // diameter per mm of blocked belt
+#endif
+#ifndef SIZE_CALIBRATION_OFFSET_MM
+#define SIZE_CALIBRATION_OFFSET_MM 0.0f     // beam width and sensor switching delay
+#endif
+
+// Gripper turn between two points and stepper pulse length, "motion|<degrees>|<pulse us>" overrides
+// them at run time from the next fruit at the measuring station on
+#ifndef PRESET_ANGLE_BETWEEN_TWO_MEASUREMENT
 #define PRESET_ANGLE_BETWEEN_TWO_MEASUREMENT 10
+#endif
+#define MEASURE_POINTS_LIMIT 36             // one full turn at the default angle between points
+
+// Adaptive point count: enabled per session by min/max points in confirm|, the PC sends a
+// 0..100 quality with each point acknowledgement and the fruit is done once it is good enough
+#ifndef ADAPTIVE_QUALITY_THRESHOLD
+#define ADAPTIVE_QUALITY_THRESHOLD 80
+#endif
+#define NO_QUALITY -1
+#ifndef STEPPER_PULSE_IN_uS
 #define STEPPER_PULSE_IN_uS 2000
+#endif
+#define STEPPER_PULSE_MIN_uS 50             // limits taken by "motion|"
+#define STEPPER_PULSE_MAX_uS 20000
 #define STEPPER_STEP_PER_REV 800
 
+// Pneumatic timing model, see myPneumaticValve
+#define VALVE_A 0
+#define VALVE_B 1
+#define VALVE_SAMPLE_WEIGHT 0.125f      // weight of a new latency sample in the running estimate
+#define VALVE_MIN_SAMPLES 4             // fixed dwells are used until a direction has this many samples
+#define VALVE_DEVIATION_FACTOR 3.0f     // dwells cover the mean plus this many deviations
+#define VALVE_DWELL_MARGIN_MS 20
+#define VALVE_MIN_DWELL_MS 10
+#define VALVE_POLL_MS 1                 // contact switch polling period while a valve moves
+
+// Hand-tuned dwells, used until the valves are calibrated
+#define PROBE_STARTUP_RETRACT_MS 2000
+#define PROBE_STARTUP_EXTEND_MS 200
+#define PROBE_LAST_RETRACT_MS 200
+#define PROBE_CLEAR_MS 100
+#define PROBE_FULL_STROKE_RATIO 10.0f  // full retract from anywhere against the contact to release stroke
+
 
 #define NO_PAYLOAD -1
 #define FRUIT_LIST_LENGTH 5
+static_assert(GATE_BUFFER_FRUITS >= 1 && GATE_BUFFER_FRUITS < FRUIT_LIST_LENGTH, "buffered fruits need free slots in the fruit list");
+
+#define CRITICAL_LANE_LENGTH 8       // messages the PC must answer, never dropped
+#define INFO_LANE_LENGTH 16          // informational state updates, may be dropped under load
+#define INFO_LANE_COLLAPSE 1         // 1: a full info lane drops an earlier update of the same fruit to make room for the newest
+#define SUMMARY_LANE_LENGTH 8        // per-fruit summaries waiting to be sent, see REPORT_SUMMARY
+
+#ifndef REPORT_SUMMARY
+#define REPORT_SUMMARY 0             // 1: start in summary mode, "report summary" / "report states" switch at run time
+#endif
+
+#define UART_LINE_BUFFER_LENGTH 64
+#define COMMAND_QUEUE_LENGTH 8
+
+#define LOG_LEVEL_NONE 0
+#define LOG_LEVEL_ERROR 1
+#define LOG_LEVEL_WARN 2
+#define LOG_LEVEL_INFO 3
+#define LOG_LEVEL_DEBUG 4
+
+#ifndef LOG_LEVEL
+#define LOG_LEVEL LOG_LEVEL_INFO      // records above this level are compiled out
+#endif
+
+#define FLIGHT_LOG_LENGTH 128         // records kept in RTC memory (16 bytes each)
+#define FLIGHT_LOG_MAGIC 0x464C4F47   // "FLOG"
 
 //============================================================== STATES ==============================================================//
 enum Fruit_state 
@@ -77,16 +396,201 @@ struct Fruit
     bool is_sorted;                    // Whether the fruit has been sorted 
     bool point_measure_done;          // Whether a measurement point has been completed
     int point_measured;
+    int point_quality;                 // Quality the PC sent with the last acknowledgement, NO_QUALITY if none
+    int diameter_mm;                   // Calibrated diameter, 0 until the fruit passed the input sensor
+    uint32_t state_us[SORTING_PASSED + 1]; // Low 32 bits of the controller clock when each state was first sent
+    uint8_t states_sent;               // Bit per Fruit_state already sent
+    uint8_t faults;                    // FRUIT_FAULT_* bits, reported in the summary
 };
 
+#define FRUIT_FAULT_SKIPPED 0x01       // measuring station let it go without a scan (resync skip)
+#define FRUIT_FAULT_BOUNCE 0x02        // input sensor flickered as it left
+#define FRUIT_FAULT_NO_TYPE 0x04       // reached the sorting sensor before the PC sent its type
+#define FRUIT_FAULT_RESUMED 0x08       // in flight across a stop and resume, its stage times include the stop
+
 //============================================================== FRUIT DATA STRUCT ==============================================================//
 struct Fruit_data 
 {
     long fruit_id;           // ID of the fruit
     Fruit_state fruit_state; // State of the fruit
     int payload;          // Data value associated with the fruit
+    uint32_t stamp_us;       // Low 32 bits of the controller clock when the state was sent, see clock_sync_time()
+};
+
+// In summary mode the informational states are folded into one record sent instead of SORTING_PASSED:
+// "<id>|SUMMARY|<type>|<diameter mm>|<points>|<faults>|<stage ms>...", the stages from INPUT_PASSED to
+// SORTING_PASSED in ms after INPUT_ENTERED, -1 for a stage the fruit skipped
+#define SUMMARY_STAGE_COUNT (SORTING_PASSED - INPUT_ENTERED)
+
+struct Fruit_summary
+{
+    long fruit_id;
+    uint32_t entered_us;                    // Low 32 bits of the controller clock at INPUT_ENTERED
+    int32_t stage_ms[SUMMARY_STAGE_COUNT];
+    int16_t diameter_mm;
+    uint8_t points;
+    uint8_t sorting_type;
+    uint8_t faults;                         // FRUIT_FAULT_*
+};
+
+//============================================================== COMMAND STRUCT ==============================================================//
+enum Command_type
+{
+    CMD_POINT_ACK,          // "<id>|MEASURE_PROCESSING|<point>" : PC finished scanning a point, owned by Measure_Task
+    CMD_SORT_DECISION       // "<id>|MEASURE_PASSED|<type>"      : PC decided the fruit type, owned by Sorting_Task
+};
+
+struct Command
+{
+    Command_type type;      // What the PC is asking for
+    long fruit_id;          // ID of the fruit the command refers to
+    int value;              // Point number or sorting type
+    int quality;            // Point quality 0..100 after the point number, NO_QUALITY when the PC sent none
+};
+
+//============================================================== MESSAGE LANES ==============================================================//
+enum Message_lane
+{
+    LANE_CRITICAL,          // needs a PC response (point scan request, type request)
+    LANE_INFO,              // informational state update
+    LANE_SUMMARY,           // one record per sorted fruit, summary mode only
+    LANE_COUNT
+};
+
+struct Lane_stats
+{
+    uint32_t sent;          // messages accepted into the lane
+    uint32_t dropped;       // messages lost because the lane was full
+    uint32_t collapsed;     // superseded updates of the same fruit discarded to make room (info lane only)
+    uint32_t blocked;       // sends that had to wait for room (critical lane only, the station held its phase in executive mode)
+    uint32_t high_water;    // most messages ever waiting in the lane
 };
 
+//=============================================================== SPSC QUEUE CLASS ==============================================================//
+// Lock-free single producer / single consumer ring, used to hand typed commands from
+// UartReceiveTask to the task that owns the fruit fields. One slot is kept empty.
+template <typename T, size_t LENGTH>
+class mySpscQueue
+{
+    private:
+        T items[LENGTH];
+        std::atomic<size_t> head{0};    // next slot to write, only moved by the producer
+        std::atomic<size_t> tail{0};    // next slot to read, only moved by the consumer
+
+    public:
+        bool push(const T& item)
+        {
+            size_t current_head = head.load(std::memory_order_relaxed);
+            size_t next_head = (current_head + 1) % LENGTH;
+
+            if (next_head == tail.load(std::memory_order_acquire)) return false;   // full
+
+            items[current_head] = item;
+            head.store(next_head, std::memory_order_release);
+            return true;
+        }
+
+        bool pop(T& item)
+        {
+            size_t current_tail = tail.load(std::memory_order_relaxed);
+
+            if (current_tail == head.load(std::memory_order_acquire)) return false;   // empty
+
+            item = items[current_tail];
+            tail.store((current_tail + 1) % LENGTH, std::memory_order_release);
+            return true;
+        }
+
+        // only safe while neither side is running
+        void reset()
+        {
+            head.store(0, std::memory_order_relaxed);
+            tail.store(0, std::memory_order_relaxed);
+        }
+};
+
+//============================================================== LOGGING ==============================================================//
+// Records are binary (event id + two arguments) and go to a ring buffer in RTC memory that
+// survives a soft reset. "dump log" prints the raw records, the PC decodes them with
+// High-level-control/tools/flight_log_decoder.py. Keep the ids in sync with that script.
+enum Log_event : uint16_t
+{
+    EV_BOOT = 0,                // a0: esp_reset_reason(), a1: boots since log was cleared
+    EV_SYSTEM_STARTED = 1,      // a0: preset measure times, a1: preset conveyor speed
+    EV_TASKS_STOPPED = 2,
+    EV_STATE_RESET = 3,
+    EV_STOP_COMMAND = 4,
+    EV_HOMING_START = 5,        // a0: homing direction
+    EV_HOMING_DONE = 6,         // a0: steps taken to reach the switch
+    EV_STEPPER_RUN_BY_ANGLE = 7,// a0: angle in milli-degrees, a1: is relative
+    EV_FRUIT_STATE = 8,         // a0: fruit id, a1: new fruit state
+    EV_SEND_QUEUE_FULL = 9,     // a0: fruit id, a1: fruit state of the dropped message
+    EV_COMMAND_DROPPED = 10,    // a0: fruit id, a1: command type
+    EV_LINE_OVERFLOW = 11,
+    EV_POINT_ACK = 12,          // a0: fruit id, a1: point
+    EV_SEND_BLOCKED = 13,       // a0: fruit id, a1: fruit state waiting for room in the critical lane
+    EV_INFO_COLLAPSED = 14,     // a0: fruit id, a1: fruit state of the discarded update
+    EV_CHECKPOINT_WRITTEN = 15, // a0: checkpoint sequence, a1: flash write time in us
+    EV_RESUMED = 16,            // a0: next fruit id at the input, a1: 1 if the gripper was re-homed
+    EV_CHECKPOINT_FAILED = 17,  // a0: bytes written
+    EV_VALVE_RESPONSE = 18,     // a0: valve (0 probe, 1 gripper) * 2 + direction, a1: command to switch change in ms
+    EV_HEAP_ALLOCATED = 19,     // a0: bytes taken from the heap since setup(), a1: free heap
+    EV_STACK_LOW = 20,          // a0: task (Memory report order), a1: least free stack in bytes
+    EV_CLOCK_SYNC = 21,         // a0: offset change of the fit in us, a1: round trip of the exchange in us
+    EV_FRUIT_MISSING = 22,      // a0: fruit id, a1: station it never reached (Belt_station)
+    EV_FRUIT_EXTRA = 23,        // a0: station with an unexpected edge, a1: distance to the fruit expected next in mm, 0 if none
+    EV_SIZE_REJECTED = 24,      // a0: fruit id, a1: diameter in mm
+    EV_RESYNC = 25,             // a0: fruit id, a1: station * 100 + action * 10 + cause, see Resync_action
+    EV_POINT_ANGLE_CUT = 26     // a0: "motion|" angle that does not fit the point layout, a1: angle used instead
+};
+
+struct Log_record
+{
+    uint32_t timestamp_us;  // micros() when the record was written
+    uint16_t event;         // Log_event
+    uint8_t level;          // LOG_LEVEL_*
+    uint8_t core;           // core the record was written from
+    int32_t arg0;
+    int32_t arg1;
+};
+
+struct Flight_log
+{
+    uint32_t magic;         // FLIGHT_LOG_MAGIC once the buffer holds valid records
+    uint32_t boot_count;    // boots since the buffer was last cleared
+    uint32_t next_sequence; // sequence number of the next record, index = sequence % length
+    Log_record records[FLIGHT_LOG_LENGTH];
+};
+
+void log_record(uint8_t level, Log_event event, int32_t arg0, int32_t arg1);
+
+// A level that is compiled out does not evaluate its arguments, sizeof still counts them as used
+#define LOG_DISCARD(arg0, arg1) ((void)sizeof(arg0), (void)sizeof(arg1))
+
+#if LOG_LEVEL >= LOG_LEVEL_ERROR
+#define LOG_ERROR(event, arg0, arg1) log_record(LOG_LEVEL_ERROR, event, (int32_t)(arg0), (int32_t)(arg1))
+#else
+#define LOG_ERROR(event, arg0, arg1) LOG_DISCARD(arg0, arg1)
+#endif
+
+#if LOG_LEVEL >= LOG_LEVEL_WARN
+#define LOG_WARN(event, arg0, arg1) log_record(LOG_LEVEL_WARN, event, (int32_t)(arg0), (int32_t)(arg1))
+#else
+#define LOG_WARN(event, arg0, arg1) LOG_DISCARD(arg0, arg1)
+#endif
+
+#if LOG_LEVEL >= LOG_LEVEL_INFO
+#define LOG_INFO(event, arg0, arg1) log_record(LOG_LEVEL_INFO, event, (int32_t)(arg0), (int32_t)(arg1))
+#else
+#define LOG_INFO(event, arg0, arg1) LOG_DISCARD(arg0, arg1)
+#endif
+
+#if LOG_LEVEL >= LOG_LEVEL_DEBUG
+#define LOG_DEBUG(event, arg0, arg1) log_record(LOG_LEVEL_DEBUG, event, (int32_t)(arg0), (int32_t)(arg1))
+#else
+#define LOG_DEBUG(event, arg0, arg1) LOG_DISCARD(arg0, arg1)
+#endif
+
 //=============================================================== MOTOR CLASS ==============================================================//
 class myMotor
 {
@@ -110,46 +614,111 @@ class myMotor
 };
 
 //=============================================================== PNEUMATIC VALVE CLASS ==============================================================//
-class myPneumaticValve
+// Response time of one valve direction, command to contact switch change
+struct Valve_timing
+{
+    float mean_ms;          // running average
+    float deviation_ms;     // running mean absolute deviation
+    uint32_t samples;
+    uint32_t last_ms;
+};
+
+// Response times and dwells, shared by every valve whatever its pins
+class Valve_response
 {
     public:
-        int position_A_pin = 0;
-        int position_B_pin = 0;
-    
+        Valve_timing timing[2] = {};    // VALVE_A, VALVE_B
+
+    protected:
+        unsigned long commanded_ms = 0; // when the current position was commanded
+
     public:
-        myPneumaticValve(int position_A_pin, int position_B_pin)
-        :position_A_pin(position_A_pin), position_B_pin(position_B_pin)
+        unsigned long since_command_ms()
+        {
+            return millis() - commanded_ms;
+        }
+
+        // The switch just changed after a command in this direction
+        void record_response(int direction)
         {
-            pinMode(position_A_pin, OUTPUT);
-            pinMode(position_B_pin, OUTPUT);
+            Valve_timing& t = timing[direction];
+            float sample = (float)since_command_ms();
+
+            if (t.samples == 0)
+            {
+                t.mean_ms = sample;
+                t.deviation_ms = sample / 4.0f;
+            }
+            else
+            {
+                float error = sample - t.mean_ms;
+                t.mean_ms += VALVE_SAMPLE_WEIGHT * error;
+                t.deviation_ms += VALVE_SAMPLE_WEIGHT * (fabsf(error) - t.deviation_ms);
+            }
+            t.samples++;
+            t.last_ms = (uint32_t)sample;
+        }
+
+        // Response time this direction stays under in practically every stroke
+        float response_bound_ms(int direction)
+        {
+            return timing[direction].mean_ms + VALVE_DEVIATION_FACTOR * timing[direction].deviation_ms;
+        }
+
+        // Wait that covers `strokes` times the response in this direction with margin, the
+        // hand-tuned fixed_ms until enough samples are in and never more than twice it
+        unsigned long dwell_ms(int direction, float strokes, unsigned long fixed_ms)
+        {
+            if (timing[direction].samples < VALVE_MIN_SAMPLES) return fixed_ms;
+
+            float dwell = strokes * response_bound_ms(direction) + VALVE_DWELL_MARGIN_MS;
+            return constrain((unsigned long)dwell, (unsigned long)VALVE_MIN_DWELL_MS, 2 * fixed_ms);
+        }
+};
+
+template<int POSITION_A_PIN, int POSITION_B_PIN>
+class myPneumaticValve : public Valve_response
+{
+    private:
+        using pin_A = Gpio_pin<POSITION_A_PIN>;
+        using pin_B = Gpio_pin<POSITION_B_PIN>;
+
+    public:
+        myPneumaticValve()
+        {
+            pinMode(POSITION_A_PIN, OUTPUT);
+            pinMode(POSITION_B_PIN, OUTPUT);
         }
 
         void position_A()
         {
-            digitalWrite(position_B_pin, LOW);
-            digitalWrite(position_A_pin, HIGH);
+            pin_B::write(LOW);
+            pin_A::write(HIGH);
+            commanded_ms = millis();
         }
 
         void mid_position()
         {
-            digitalWrite(position_B_pin, LOW);
-            digitalWrite(position_A_pin, LOW);
+            pin_B::write(LOW);
+            pin_A::write(LOW);
         }
 
         void position_B()
         {
-            digitalWrite(position_A_pin, LOW);
-            digitalWrite(position_B_pin, HIGH);
+            pin_A::write(LOW);
+            pin_B::write(HIGH);
+            commanded_ms = millis();
         }
 };
 //=============================================================== STEPPER CLASS ==============================================================//
+template<int PUL_PIN, int DIR_PIN, int ENABLE_PIN, int HOME_SWITCH_PIN>
 class myStepper
 {
     private:
-        int pul_pin;
-        int dir_pin;
-        int home_switch_pin;
-        int enable_pin;
+        using pul_pin = Gpio_pin<PUL_PIN>;
+        using dir_pin = Gpio_pin<DIR_PIN>;
+        using enable_pin = Gpio_pin<ENABLE_PIN>;
+        using home_switch_pin = Gpio_pin<HOME_SWITCH_PIN>;
 
         long current_position;    // current position in steps
         long target_position;     // target position in steps
@@ -160,33 +729,34 @@ class myStepper
         int pulse_delay_us;       // microsecond delay between steps
 
     public:
-        myStepper(int pul_pin, int dir_pin, int enable_pin, int home_switch_pin, float steps_per_rev = STEPPER_STEP_PER_REV, float mm_per_rev = 8.0f, int pulse_delay_us = STEPPER_PULSE_IN_uS)
-        : pul_pin(pul_pin), dir_pin(dir_pin), home_switch_pin(home_switch_pin), enable_pin(enable_pin),
-        steps_per_rev(steps_per_rev), mm_per_rev(mm_per_rev), pulse_delay_us(pulse_delay_us)
+        myStepper(float steps_per_rev = STEPPER_STEP_PER_REV, float mm_per_rev = 8.0f, int pulse_delay_us = STEPPER_PULSE_IN_uS)
+        : steps_per_rev(steps_per_rev), mm_per_rev(mm_per_rev), pulse_delay_us(pulse_delay_us)
         {
             current_position = 0;
             target_position = 0;
 
-            pinMode(pul_pin, OUTPUT);
-            pinMode(dir_pin, OUTPUT);
-            pinMode(enable_pin, OUTPUT);
-            pinMode(home_switch_pin, INPUT_PULLUP);
+            pinMode(PUL_PIN, OUTPUT);
+            pinMode(DIR_PIN, OUTPUT);
+            pinMode(ENABLE_PIN, OUTPUT);
+            pinMode(HOME_SWITCH_PIN, INPUT_PULLUP);
         }
 
         void home(bool homing_dir)
         {
-            digitalWrite(enable_pin, HIGH);
-            Serial.println("Homing...");
+            enable_pin::write(HIGH);
+            LOG_DEBUG(EV_HOMING_START, homing_dir, 0);
 
-            digitalWrite(dir_pin, homing_dir ? LOW : HIGH);
+            dir_pin::write(homing_dir ? LOW : HIGH);
 
-            while (digitalRead(home_switch_pin) == HIGH)
+            long steps_taken = 0;
+            while (home_switch_pin::read() == HIGH)
             {
                 pulse_once();
+                steps_taken++;
             }
 
             current_position = 0;
-            Serial.println("Homing complete");
+            LOG_DEBUG(EV_HOMING_DONE, steps_taken, 0);
         }
 
         void run_by_step(long step, bool is_relative = false)
@@ -213,7 +783,7 @@ class myStepper
 
         void run_by_angle(float angle_deg, bool is_relative = false)
         {
-            Serial.println("run by angle" + String(angle_deg));
+            LOG_DEBUG(EV_STEPPER_RUN_BY_ANGLE, angle_deg * 1000.0f, is_relative);
             long step = (angle_deg / 360.0f) * steps_per_rev;
 
             if (is_relative)
@@ -229,7 +799,76 @@ class myStepper
             return current_position;
         }
 
+        // Non-blocking moves for the station step functions: begin_*() sets the move up, step()
+        // gives at most one pulse edge per call and returns true once the target or the homing
+        // switch is reached
+        void begin_run_by_angle(float angle_deg, bool is_relative = false)
+        {
+            LOG_DEBUG(EV_STEPPER_RUN_BY_ANGLE, angle_deg * 1000.0f, is_relative);
+            long step = (angle_deg / 360.0f) * steps_per_rev;
+            target_position = is_relative ? current_position + step : step;
+
+            dir_pin::write((target_position > current_position) ? HIGH : LOW);
+            begin_motion(false);
+        }
+
+        void begin_home(bool homing_dir)
+        {
+            enable_pin::write(HIGH);
+            LOG_DEBUG(EV_HOMING_START, homing_dir, 0);
+
+            dir_pin::write(homing_dir ? LOW : HIGH);
+            begin_motion(true);
+        }
+
+        void set_pulse_delay(int delay_us)
+        {
+            pulse_delay_us = delay_us;
+        }
+
+        bool step()
+        {
+            uint32_t now = micros();
+            if (now - last_edge_us < (uint32_t)pulse_delay_us) return false;
+
+            if (pulse_high)
+            {
+                pul_pin::write(LOW);
+                pulse_high = false;
+                last_edge_us = now;
+                return false;
+            }
+
+            if (homing && home_switch_pin::read() == LOW)
+            {
+                current_position = 0;
+                LOG_DEBUG(EV_HOMING_DONE, homing_steps, 0);
+                return true;
+            }
+            if (!homing && current_position == target_position) return true;
+
+            pul_pin::write(HIGH);
+            pulse_high = true;
+            last_edge_us = now;
+            if (homing) homing_steps++;
+            else current_position += (target_position > current_position) ? 1 : -1;
+            return false;
+        }
+
     private:
+        bool homing = false;
+        bool pulse_high = false;
+        long homing_steps = 0;
+        uint32_t last_edge_us = 0;
+
+        void begin_motion(bool is_homing)
+        {
+            homing = is_homing;
+            homing_steps = 0;
+            pulse_high = false;
+            last_edge_us = micros() - pulse_delay_us;
+        }
+
         void move_to_target()
         {
             long step_difference = target_position - current_position;
@@ -238,7 +877,7 @@ class myStepper
                 return;
 
             bool direction = (step_difference > 0);
-            digitalWrite(dir_pin, direction ? HIGH : LOW);
+            dir_pin::write(direction ? HIGH : LOW);
 
             long steps_to_move = abs(step_difference);
 
@@ -251,9 +890,9 @@ class myStepper
 
         void pulse_once()
         {
-            digitalWrite(pul_pin, HIGH);
+            pul_pin::write(HIGH);
             delayMicroseconds(pulse_delay_us);
-            digitalWrite(pul_pin, LOW);
+            pul_pin::write(LOW);
             delayMicroseconds(pulse_delay_us);
         }
 };
@@ -295,8 +934,168 @@ class myServo
         }
 };
 
+//============================================================== STATIONS ==============================================================//
+// The input, measuring and sorting stations are non-blocking step functions. By default each
+// runs in its own task; with CYCLIC_EXECUTIVE one high-priority task steps all three in a
+// fixed order on every tick of a hardware timer.
+#ifndef CYCLIC_EXECUTIVE
+#define CYCLIC_EXECUTIVE 0
+#endif
+
+#define EXECUTIVE_RATE_HZ 2000
+#define EXECUTIVE_TASK_PRIORITY 5
+
+// The stepper gets at most one pulse edge per tick in executive mode, "motion|" refuses a shorter pulse
+#define STEPPER_PULSE_SHORTEST_uS (CYCLIC_EXECUTIVE ? 1000000 / EXECUTIVE_RATE_HZ : STEPPER_PULSE_MIN_uS)
+static_assert(STEPPER_PULSE_IN_uS >= STEPPER_PULSE_SHORTEST_uS, "STEPPER_PULSE_IN_uS is shorter than one executive tick");
+
+enum Station
+{
+    STATION_INPUT,
+    STATION_MEASURE,
+    STATION_SORTING,
+    STATION_COUNT
+};
+
+struct Executive_stats
+{
+    uint32_t ticks;
+    uint32_t overruns;                      // ticks that arrived while the previous one still ran
+    uint64_t total_us;
+    uint32_t wcet_us;                       // longest tick
+    uint32_t station_wcet_us[STATION_COUNT];
+};
+
+struct Point_stats
+{
+    uint32_t fruits;
+    uint32_t points;                        // points measured over all fruits
+    uint32_t early;                         // fruits done before preset_measure_times
+    uint32_t extended;                      // fruits that needed more than preset_measure_times
+};
+
+struct Size_stats
+{
+    uint32_t graded;                        // fruits sized at the input sensor
+    uint32_t undersize;
+    uint32_t oversize;
+    uint32_t skipped;                       // rejects the measuring station let through without a scan
+    uint32_t total_mm;
+};
+
+// Position of a fruit on the belt, by fruit id like the fruit list
+enum Belt_station
+{
+    BELT_INPUT,
+    BELT_MEASURE,
+    BELT_SORTING,
+    BELT_STATION_COUNT
+};
+
+struct Belt_track
+{
+    long fruit_id;                          // BELT_UNKNOWN_FRUIT for an inserted track
+    int64_t reference_um;                   // belt odometer when the fruit's front was at the input sensor
+    Belt_station next;                      // station the fruit reaches next, BELT_STATION_COUNT once past the last
+    bool active;
+    bool located;                           // false for fruits taken over from a checkpoint until their next edge
+};
+
+// Last edge at a station that the tracker put on a fruit with an id
+struct Belt_arrival
+{
+    long fruit_id;
+    int64_t odometer_um;
+    uint32_t sequence;                      // arrivals at the station since the start, 0 = none yet
+};
+
+enum Resync_action
+{
+    RESYNC_SKIP,                            // a station gave up on a fruit and moved on
+    RESYNC_REASSOCIATE,                     // a station took an edge for a later fruit than the one it waited for
+    RESYNC_INSERT,                          // an edge no fruit explains got an inserted track
+    RESYNC_IGNORE,                          // an edge left without effect
+    RESYNC_ACTION_COUNT
+};
+
+enum Resync_cause
+{
+    RESYNC_OVERDUE,                         // the fruit ran BELT_TRACK_WINDOW_MM past the station without an edge
+    RESYNC_OVERTAKEN,                       // a later fruit reached the station first
+    RESYNC_UNTRACKED,                       // no fruit expected within BELT_TRACK_WINDOW_MM of the edge
+    RESYNC_BOUNCE,                          // the sensor was clear for less than RESYNC_MIN_GAP_MM
+    RESYNC_ALREADY_PASSED                   // the station had finished with the fruit
+};
+
+struct Resync_correction
+{
+    uint32_t sequence;
+    long fruit_id;
+    int32_t odometer_mm;
+    uint8_t station;                        // Belt_station
+    uint8_t action;                         // Resync_action
+    uint8_t cause;                          // Resync_cause
+};
+
+struct Resync_log
+{
+    Resync_correction entries[RESYNC_LOG_LENGTH];
+    uint32_t written;
+    uint32_t sent;                          // entries "resync" has printed
+    uint32_t counts[RESYNC_ACTION_COUNT];
+};
+
+struct Belt_station_stats
+{
+    uint32_t matched;                       // edges that were the fruit expected there
+    uint32_t missing;                       // fruits that passed their window without an edge
+    uint32_t extra;                         // edges with no fruit expected there
+    uint32_t worst_error_um;                // largest distance between predicted and observed arrival
+};
+
+// One actuator move of the measuring station, advanced by motion_step() until it returns true
+enum Motion_type
+{
+    MOTION_GRIP,
+    MOTION_RELEASE,                         // open until both gripper switches are clear
+    MOTION_RELEASE_ALL,                     // open without waiting
+    MOTION_ROTATE,                          // relative gripper stepper move by angle_deg
+    MOTION_HOME,
+    MOTION_PROBE_EXTEND,
+    MOTION_PROBE_RETRACT,
+    MOTION_PROBE_RETRACT_LAST               // retract further so the fruit can leave
+};
+
+struct Motion
+{
+    Motion_type type;
+    float angle_deg = 0.0f;
+    bool started = false;
+    uint8_t phase = 0;
+    unsigned long deadline_ms = 0;
+};
+
+#define MOTION_PLAN_LENGTH 8
+
+enum Measure_phase
+{
+    PHASE_POSITION,                         // gripper moves and probe stroke for the current point
+    PHASE_WAIT_ACK,
+    PHASE_RETRACT,
+    PHASE_FINISH                            // release and park the gripper
+};
+
 //============================================================== VARIABLE DECORATION ==============================================================//
 extern int preset_measure_times;
+extern int adaptive_min_points;
+extern int adaptive_max_points;
+extern int adaptive_quality_threshold;
+extern Point_stats point_stats;
+extern int size_min_mm;
+extern int point_angle_deg;             // "motion|", see PRESET_ANGLE_BETWEEN_TWO_MEASUREMENT
+extern int stepper_pulse_us;
+extern int size_max_mm;
+extern Size_stats size_stats;
 extern long initial_fruit;
 extern int preset_conveyor_speed;
 
@@ -309,7 +1108,19 @@ extern Fruit* measure_fruit_pointer;
 extern long sorting_fruit_id;
 extern Fruit* sorting_fruit_pointer;
 
-extern QueueHandle_t messages_sending_queue;
+extern QueueHandle_t critical_sending_queue;
+extern QueueHandle_t info_sending_queue;
+extern QueueHandle_t summary_sending_queue;
+extern Lane_stats lane_stats[LANE_COUNT];
+extern bool report_summary;
+
+extern mySpscQueue<Command, COMMAND_QUEUE_LENGTH> measure_command_queue;
+extern mySpscQueue<Command, COMMAND_QUEUE_LENGTH> sorting_command_queue;
+
+extern Flight_log flight_log;
+
+extern int node_id;
+extern bool addressed_mode;
 
 extern Task_state input_task_state;
 extern Task_state measure_task_state;
@@ -319,44 +1130,359 @@ extern TaskHandle_t input_task_handle;
 extern TaskHandle_t measure_task_handle;
 extern TaskHandle_t sorting_task_handle;
 extern TaskHandle_t uart_receive_task_handle;
+extern TaskHandle_t executive_task_handle;
+extern Executive_stats executive_stats;
 
 extern Fruit fruit_list[FRUIT_LIST_LENGTH];
 
+// The stepper and valve pins are template arguments, see Gpio_pin
+using Gripper_stepper = myStepper<GRIPPER_STEPPER_PUL_PIN, GRIPPER_STEPPER_DIR_PIN, GRIPPER_STEPPER_ENABLE_PIN, GRIPPER_HOMING_SWITCH_PIN>;
+using Probe_valve = myPneumaticValve<PROBE_CYLINDER_EXTEND_VALVE_PIN, PROBE_CYLINDER_RETRACT_VALVE_PIN>;
+using Gripper_valve = myPneumaticValve<GRIPPER_CYLINDER_GRIP_VALVE_PIN, GRIPPER_CYLINDER_RELEASE_VALVE_PIN>;
+
 extern myMotor conveyor_motor;
-extern myStepper gripper_stepper;
+extern Gripper_stepper gripper_stepper;
 extern myServo gate_servo;
 extern myServo sorting_servo;
-extern myPneumaticValve probe_valve;
-extern myPneumaticValve gripper_valve;
+extern Probe_valve probe_valve;
+extern Gripper_valve gripper_valve;
+
+//============================================================== CLOCK SYNC ==============================================================//
+// NTP-style exchange over the command link so controller and PC timestamps can be put on one clock.
+// The controller is the client, every CLOCK_SYNC_INTERVAL_MS while the PC has it on:
+//   controller -> PC   "sync?|<seq>|<t1>"          t1: controller us when the request left
+//   PC -> controller   "sync|<seq>|<t2>|<t3>"      t2: PC us when the request arrived, t3: PC us when the reply left
+// and t4 is the controller us when the reply arrived. Each exchange gives the offset PC minus controller,
+// ((t2 - t1) + (t3 - t4)) / 2, and the round trip (t4 - t1) - (t3 - t2). Serial queueing only ever adds
+// to the round trip, so the line through the offsets of the fastest exchanges in the window is kept:
+// its slope is the drift between the two oscillators.
+// "sync on" starts it, "sync stamp" also appends the synchronized time to every state message
+// ("<id>|<state>|<payload>|<PC us>"), "sync off" stops both. "trace" sends the synchronized
+// receive time of the PC commands since the last "trace".
+#define CLOCK_SYNC_INTERVAL_MS 1000
+#define CLOCK_SYNC_FAST_INTERVAL_MS 100     // until the window is full
+#define CLOCK_SYNC_WINDOW 16
+#define CLOCK_SYNC_TIMEOUT_MS 500           // replies later than this are not used
+#define CLOCK_SYNC_MIN_SPAN_MS 5000         // fitted exchanges must span this long before a drift is fitted
+#define CLOCK_SYNC_ROUND_TRIP_SLACK_US 500  // exchanges this much slower than the fastest one still count
+#define COMMAND_TRACE_LENGTH 32
+
+struct Sync_sample
+{
+    int64_t local_us;           // controller time in the middle of the exchange
+    int64_t offset_us;          // PC minus controller
+    int32_t round_trip_us;
+};
+
+struct Command_receipt
+{
+    long fruit_id;
+    Command_type type;
+    int value;
+    uint32_t received_us;       // low 32 bits of the controller clock when the line was complete
+};
+
+struct Clock_sync
+{
+    bool enabled;
+    bool stamp;                 // append the synchronized time to state messages
+    uint32_t sequence;          // of the last request
+    int64_t request_us;         // t1 of the request waiting for its reply, 0 if none
+    int64_t last_request_us;
+
+    Sync_sample samples[CLOCK_SYNC_WINDOW];
+    int sample_count;
+    int next_sample;
+
+    // Fitted model: offset(t) = base_offset_us + drift * (t - base_local_us)
+    bool synced;
+    int64_t base_local_us;
+    int64_t base_offset_us;
+    double drift;               // seconds per second
+    int32_t best_round_trip_us;
+
+    uint32_t exchanges;         // replies received
+    uint32_t late;              // replies after CLOCK_SYNC_TIMEOUT_MS or for an old request
+
+    Command_receipt receipts[COMMAND_TRACE_LENGTH];
+    uint32_t receipts_written;
+    uint32_t receipts_sent;
+};
+
+//============================================================== CHECKPOINT ==============================================================//
+// Pipeline state kept in NVS so the line can resume after a reset without a new confirm|.
+// Only written from loop() at fruit boundaries, at most every CHECKPOINT_MIN_INTERVAL_MS and
+// only when something changed; NVS spreads the writes over its pages.
+#define CHECKPOINT_NAMESPACE "pipeline"
+#define CHECKPOINT_KEY "state"
+#define CHECKPOINT_MAGIC 0x43484B50     // "CHKP"
+#define CHECKPOINT_VERSION 5
+#define CHECKPOINT_MIN_INTERVAL_MS 2000
+
+#ifndef AUTO_RESUME_ON_FAULT
+#define AUTO_RESUME_ON_FAULT 1          // resume without the PC after a brownout, watchdog or panic reset
+#endif
+
+struct Checkpoint
+{
+    uint32_t magic;             // CHECKPOINT_MAGIC
+    uint16_t version;           // CHECKPOINT_VERSION
+    uint16_t length;            // sizeof(Checkpoint), rejects a blob written by a build with another layout
+    uint32_t sequence;          // checkpoints written since confirm|
+
+    long initial_fruit;
+    int preset_measure_times;
+    int preset_conveyor_speed;
+    int adaptive_min_points;
+    int adaptive_max_points;
+    int adaptive_quality_threshold;
+    int size_min_mm;
+    int size_max_mm;
+    int point_angle_deg;
+    int stepper_pulse_us;
+
+    long input_fruit_id;
+    long measure_fruit_id;
+    long sorting_fruit_id;
+    Fruit slots[FRUIT_LIST_LENGTH];
+
+    bool addressed_mode;
+    bool gripper_homed;         // gripper stepper was parked on its homing switch
+};
+
+//============================================================== MEMORY ==============================================================//
+// Task stacks, task control blocks and queue storage are static buffers. Everything the firmware
+// needs from the heap (UART driver, NVS handle, executive timer) is taken before setup() returns,
+// after that the free heap must not go down. memory_service() samples the free heap every
+// MEMORY_CHECK_INTERVAL_MS: it logs EV_HEAP_ALLOCATED once when it went down and "memory" reports
+// the amount, the line keeps running. A bench build with HEAP_SEAL_ENFORCE makes this a hard
+// failure, the controller aborts on the first sample that shows an allocation.
+// Stack sizes are in bytes (StackType_t is one byte on the ESP32). "memory" reports the least free
+// stack each task has had, keep at least STACK_MIN_FREE_BYTES when changing them.
+#ifndef INPUT_TASK_STACK_BYTES
+#define INPUT_TASK_STACK_BYTES 3072
+#endif
+#ifndef MEASURE_TASK_STACK_BYTES
+#define MEASURE_TASK_STACK_BYTES 4096
+#endif
+#ifndef SORTING_TASK_STACK_BYTES
+#define SORTING_TASK_STACK_BYTES 3072
+#endif
+#ifndef UART_TASK_STACK_BYTES
+#define UART_TASK_STACK_BYTES 4096
+#endif
+#ifndef EXECUTIVE_TASK_STACK_BYTES
+#define EXECUTIVE_TASK_STACK_BYTES 5120   // runs all three stations
+#endif
+
+#ifndef HEAP_SEAL_ENFORCE
+#define HEAP_SEAL_ENFORCE 0
+#endif
+
+#define STACK_MIN_FREE_BYTES 512
+#define MEMORY_CHECK_INTERVAL_MS 1000
+#define STATIC_RAM_BUDGET_BYTES 32768     // DRAM for the buffers counted below
+#define RTC_RAM_BUDGET_BYTES 4096         // RTC slow memory kept across soft resets
+
+template <size_t STACK_BYTES>
+struct Static_task
+{
+    StaticTask_t tcb;
+    StackType_t stack[STACK_BYTES / sizeof(StackType_t)];
+
+    TaskHandle_t create(TaskFunction_t function, const char* name, UBaseType_t priority, BaseType_t core)
+    {
+        return xTaskCreateStaticPinnedToCore(function, name, STACK_BYTES, NULL, priority, stack, &tcb, core);
+    }
+};
+
+template <size_t LENGTH, typename T>
+struct Static_queue
+{
+    StaticQueue_t control;
+    uint8_t storage[LENGTH * sizeof(T)];
+
+    QueueHandle_t create()
+    {
+        return xQueueCreateStatic(LENGTH, sizeof(T), storage, &control);
+    }
+};
+
+#if CYCLIC_EXECUTIVE
+constexpr size_t STATION_STACK_BYTES = sizeof(Static_task<EXECUTIVE_TASK_STACK_BYTES>);
+#else
+constexpr size_t STATION_STACK_BYTES = sizeof(Static_task<INPUT_TASK_STACK_BYTES>) + sizeof(Static_task<MEASURE_TASK_STACK_BYTES>) +
+                                       sizeof(Static_task<SORTING_TASK_STACK_BYTES>);
+#endif
+
+// RAM per subsystem, printed by "memory"
+enum Memory_region
+{
+    MEMORY_PIPELINE,                        // fruit slots and their belt tracks
+    MEMORY_COMMANDS,                        // PC commands to the measuring and sorting stations
+    MEMORY_SENDING,                         // critical and informational lanes
+    MEMORY_CHECKPOINT,                      // copy of the last checkpoint written
+    MEMORY_STATION_TASKS,                   // stacks and control blocks of the station task(s)
+    MEMORY_UART_TASK,
+    MEMORY_CLOCK_SYNC,                      // sync window and command receipts
+    MEMORY_RESYNC,                          // inserted belt tracks, station arrivals and the correction log
+    MEMORY_REGION_COUNT
+};
+
+constexpr size_t MEMORY_REGION_BYTES[MEMORY_REGION_COUNT] = {
+    (sizeof(Fruit) + sizeof(Belt_track)) * FRUIT_LIST_LENGTH,
+    2 * sizeof(mySpscQueue<Command, COMMAND_QUEUE_LENGTH>),
+    sizeof(Static_queue<CRITICAL_LANE_LENGTH, Fruit_data>) + sizeof(Static_queue<INFO_LANE_LENGTH, Fruit_data>) +
+        sizeof(Static_queue<SUMMARY_LANE_LENGTH, Fruit_summary>) + sizeof(Lane_stats) * LANE_COUNT,
+    sizeof(Checkpoint),
+    STATION_STACK_BYTES,
+    sizeof(Static_task<UART_TASK_STACK_BYTES>),
+    sizeof(Clock_sync),
+    sizeof(Belt_track) * BELT_INSERTED_TRACKS + sizeof(Belt_arrival) * BELT_STATION_COUNT + sizeof(Resync_log)
+};
+
+constexpr size_t memory_total(int region = 0)
+{
+    return region == MEMORY_REGION_COUNT ? 0 : MEMORY_REGION_BYTES[region] + memory_total(region + 1);
+}
+
+static_assert(memory_total() <= STATIC_RAM_BUDGET_BYTES, "static buffers exceed STATIC_RAM_BUDGET_BYTES");
+static_assert(sizeof(Flight_log) <= RTC_RAM_BUDGET_BYTES, "flight log does not fit RTC_RAM_BUDGET_BYTES");
+static_assert(INPUT_TASK_STACK_BYTES > STACK_MIN_FREE_BYTES && MEASURE_TASK_STACK_BYTES > STACK_MIN_FREE_BYTES &&
+              SORTING_TASK_STACK_BYTES > STACK_MIN_FREE_BYTES && UART_TASK_STACK_BYTES > STACK_MIN_FREE_BYTES &&
+              EXECUTIVE_TASK_STACK_BYTES > STACK_MIN_FREE_BYTES, "task stack smaller than STACK_MIN_FREE_BYTES");
+
+#if CYCLIC_EXECUTIVE
+extern Static_task<EXECUTIVE_TASK_STACK_BYTES> executive_task_storage;
+#else
+extern Static_task<INPUT_TASK_STACK_BYTES> input_task_storage;
+extern Static_task<MEASURE_TASK_STACK_BYTES> measure_task_storage;
+extern Static_task<SORTING_TASK_STACK_BYTES> sorting_task_storage;
+#endif
+extern Static_task<UART_TASK_STACK_BYTES> uart_task_storage;
+extern Static_queue<CRITICAL_LANE_LENGTH, Fruit_data> critical_lane_storage;
+extern Static_queue<INFO_LANE_LENGTH, Fruit_data> info_lane_storage;
+extern Static_queue<SUMMARY_LANE_LENGTH, Fruit_summary> summary_lane_storage;
 
 //============================================================== FUNCTION DECORATION ==============================================================//
 Fruit* search_fruit(long fruit_id);
 void reset_fruit(Fruit* f);
 void initialize_system();
 void send_fruit_message(Fruit *fruit, int payload);
+bool critical_lane_ready(long fruit_id, Fruit_state state);
+Message_lane message_lane(Fruit_state state, int payload);
+void print_fruit_message(const Fruit_data& msg);
+void print_fruit_summary(const Fruit_summary& summary);
+void report_command(const char* argument);
+void print_lane_stats();
+void print_valve_stats();
+void print_executive_stats();
+void print_point_stats();
+void print_size_stats();
+void size_command(char* fields);
+void size_grade(Fruit* f, int64_t blocked_um);
+bool size_rejected(const Fruit* f);
+int sorting_angle(unsigned int sorting_type);
+bool adaptive_points();
+int measure_points_layout();
+bool point_angle_fits(int angle_deg, int layout);
+void sending_lanes_init();
+int send_queued_messages(int budget);
+void answer_poll();
+void protocol_println(const char* format, ...) __attribute__((format(printf, 1, 2)));
+char* strip_address(char* line, bool* is_broadcast);
 void system_start();
+void serial_pending_set(const char* data, size_t length);
+size_t serial_pending_clear();
+size_t read_serial_line(char* buffer, size_t length);
+char* read_handshake_line(char* buffer, size_t length);
+void flight_log_init();
+void flight_log_dump();
+void handle_command_line(char* line, int64_t received_us);
+bool take_point_ack(Fruit* f, int point);
+void apply_sort_decisions();
 
 
-bool check_trigger(int sensor_pin);
 void conveyor_run();
 void conveyor_stop();
 void gripper_release(bool all_the_way);
 void gripper_grip();
 void gripper_position_fruit(int measure_position);
 void gripper_home();
+int plan_gripper_position(int current_point, Motion* plan);
+void motion_settings_latch();
+void motion_report();
+void motion_report_service();
+void motion_command(char* fields);
+bool motion_step(Motion& motion, bool blocking);
+void run_motion(Motion_type type, float angle_deg = 0.0f);
 void probe_attach();
-void probe_deattach(int measure_position);
 void sorting_bin_write(int angle);
 void gate_open();
 void gate_close();
+unsigned long belt_ms();
+int64_t belt_odometer_um();
+void belt_track_start(bool resumed);
+void belt_track_stop();
+void belt_track_entered(long fruit_id);
+void belt_track_at_station(long fruit_id, Belt_station station);
+void belt_track_service();
+long belt_eta_ms(long fruit_id, Belt_station station);
+void print_belt_track_stats();
+void print_belt_tracks();
+bool belt_track_arrival(Belt_station station, uint32_t* seen_sequence, Belt_arrival* arrival);
+bool belt_track_passed(long fruit_id, Belt_station station);
+long belt_track_next_fruit(Belt_station station);
+void resync_reset();
+void resync_report(Belt_station station, Resync_action action, long fruit_id, Resync_cause cause, int64_t odometer_um);
+long resync_arrival(Belt_station station, long expected_id, const Belt_arrival& arrival);
+void print_resync_log();
+void print_resync_stats();
+void gate_meter_reset();
+bool gate_release_due();
+void gate_meter_input_entered(long fruit_id);
+void gate_meter_input_passed(long fruit_id, unsigned long dia_ms);
+void gate_meter_measure_entered(long fruit_id);
+void gate_meter_station_free();
+void print_gate_stats();
 void process_sending_queue();
 void hardware_init();
 void system_stop();
+void checkpoint_request();
+void checkpoint_service();
+void checkpoint_flush();
+bool checkpoint_load(Checkpoint* checkpoint);
+bool system_resume(bool addressed);
+bool reset_was_fault(esp_reset_reason_t reason);
+void memory_seal();
+void memory_service();
+void print_memory_stats();
+int64_t clock_local_us();
+int64_t clock_widen(uint32_t stamp_us);
+int64_t clock_sync_time(int64_t local_us);
+bool clock_sync_stamping();
+void clock_sync_request();
+void clock_sync_service();
+void clock_sync_command(const char* argument);
+void clock_sync_reply(char* fields, int64_t received_us);
+void clock_sync_stop();
+void command_receipt(const Command& cmd, int64_t received_us);
+void print_command_trace();
+void print_clock_sync_stats();
 
 //============================================================== TASK DECORATION ==============================================================//
+void input_station_reset();
+void input_station_step();
+void measure_station_reset();
+bool measure_station_step();
+void sorting_station_reset();
+void sorting_station_step();
+void executive_start();
+void executive_stop();
 void Supervisor_Task(void* parameter);
 void Input_Task(void* parameter);
 void Measure_Task(void* parameter);
 void Sorting_Task(void* parameter);
 void UartReceiveTask(void* parameter);
+void Executive_Task(void* parameter);
 
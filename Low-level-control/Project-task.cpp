@@ -1,333 +1,595 @@
 #include "Project-lib.h"
 
-void Input_Task(void* parameter) 
+//============================================================== INPUT STATION ==============================================================//
+static unsigned long input_start_time = 0;
+static int64_t input_start_um = 0;
+static unsigned long input_end_time = 0;
+static int64_t input_end_um = 0;
+static bool input_measuring = false;
+static bool input_clearing = false;     // fruit left the sensor, waiting for RESYNC_MIN_GAP_MM of clear belt
+
+void input_station_reset()
+{
+    input_task_state = TRIGGER_WAIT;
+    input_measuring = false;
+    input_clearing = false;
+}
+
+void input_station_step()
 {
-    unsigned long start_time = 0;
-    unsigned long stop_time = 0;
-    bool measuring = false;
     bool trigger_state = false;
 
-    for (;;) 
+    if (GATE_METERING && gate_release_due()) gate_open();
+
+    switch (input_task_state) 
     {
-        switch (input_task_state) 
-        {
-            case TRIGGER_WAIT:
-                // Wait for the fruit to block the trigger sensor
-                if (check_trigger(INPUT_SENSOR_PIN) && 
-                    input_fruit_pointer != nullptr &&
-                    input_fruit_pointer->current_fruit_state == NOT_ENGAGED) 
-                {
-                    input_fruit_pointer->current_fruit_state = INPUT_ENTERED;
-                    send_fruit_message(input_fruit_pointer, NO_PAYLOAD);
-                    input_task_state = MEASURING_DIA;
-                }
-                break;
+        case TRIGGER_WAIT:
+            // The slot of the next fruit is free once the fruit that used it was sorted
+            if (input_fruit_pointer == nullptr) input_fruit_pointer = search_fruit(input_fruit_id);
+
+            // Wait for the fruit to block the trigger sensor
+            if (check_trigger(INPUT_SENSOR_PIN) && 
+                input_fruit_pointer != nullptr &&
+                input_fruit_pointer->current_fruit_state == NOT_ENGAGED) 
+            {
+                input_fruit_pointer->current_fruit_state = INPUT_ENTERED;
+                send_fruit_message(input_fruit_pointer, NO_PAYLOAD);
+                input_task_state = MEASURING_DIA;
+
+                // Metered gate lets one fruit through per opening
+                gate_meter_input_entered(input_fruit_id);
+                belt_track_entered(input_fruit_id);
+                if (GATE_METERING) gate_close();
+            }
+            break;
 
-            case MEASURING_DIA:
-                trigger_state = check_trigger(INPUT_SENSOR_PIN);
+        case MEASURING_DIA:
+            trigger_state = check_trigger(INPUT_SENSOR_PIN);
 
-                // Start timing when fruit enters
-                if (measuring == false && trigger_state == true) 
-                {
-                    measuring = true;
-                    start_time = millis();
-                }
+            // Start timing when fruit enters, in belt time so a stop under the sensor does not count
+            if (input_measuring == false && input_clearing == false && trigger_state == true) 
+            {
+                input_measuring = true;
+                input_start_time = belt_ms();
+                input_start_um = belt_odometer_um();
+            }
 
-                // Stop timing when fruit leaves
-                if (measuring == true && trigger_state == false) 
-                {
-                    stop_time = millis();
-                    measuring = false;
+            // Stop timing when fruit leaves, a sensor blocked again within RESYNC_MIN_GAP_MM is the same fruit
+            if (input_measuring == true && trigger_state == false) 
+            {
+                input_measuring = false;
+                input_clearing = true;
+                input_end_time = belt_ms();
+                input_end_um = belt_odometer_um();
+            }
+            else if (input_clearing == true && trigger_state == true)
+            {
+                input_clearing = false;
+                input_measuring = true;
+                input_fruit_pointer->faults |= FRUIT_FAULT_BOUNCE;
+                resync_report(BELT_INPUT, RESYNC_IGNORE, input_fruit_id, RESYNC_BOUNCE, belt_odometer_um());
+            }
 
-                    // set the diameter and fruit state then report throught UART
-                    input_fruit_pointer->dia_measure = stop_time - start_time;
-                    input_fruit_pointer->current_fruit_state = INPUT_PASSED;
-                    send_fruit_message(input_fruit_pointer, input_fruit_pointer->dia_measure);
+            if (input_clearing == true && belt_odometer_um() - input_end_um >= RESYNC_MIN_GAP_MM * 1000LL)
+            {
+                input_clearing = false;
 
-                    // Move to next fruit
-                    input_fruit_id++;
-                    input_fruit_pointer = search_fruit(input_fruit_id);
+                // set the diameter and fruit state then report throught UART
+                input_fruit_pointer->dia_measure = input_end_time - input_start_time;
+                size_grade(input_fruit_pointer, input_end_um - input_start_um);
+                input_fruit_pointer->current_fruit_state = INPUT_PASSED;
+                send_fruit_message(input_fruit_pointer, input_fruit_pointer->dia_measure);
+                gate_meter_input_passed(input_fruit_id, input_fruit_pointer->dia_measure);
 
-                    // Close the input gate (servo control)
-                    gate_close();
+                // Move to next fruit
+                input_fruit_id++;
+                input_fruit_pointer = search_fruit(input_fruit_id);
+                checkpoint_request();
 
-                    // update the task
-                    input_task_state = TRIGGER_WAIT;
-                }
-                break;
+                // Close the input gate (servo control)
+                if (!GATE_METERING) gate_close();
 
-            default:
-                // Stay idle if an undefined state occurs
-                vTaskDelay(10 / portTICK_PERIOD_MS);
-                break;
-        }
-        vTaskDelay(1 / portTICK_PERIOD_MS); // small delay to prevent CPU overload
+                // update the task
+                input_task_state = TRIGGER_WAIT;
+            }
+            break;
+
+        default:
+            // Undefined state, start over
+            input_task_state = TRIGGER_WAIT;
+            break;
     }
 }
 
-
-void Measure_Task(void* parameter)
+//============================================================== MEASURE STATION ==============================================================//
+static unsigned long measure_start_time = 0;
+static bool measure_measuring = false;
+static uint32_t measure_arrival_sequence = 0;
+static long measure_arrived = BELT_NO_FRUIT;    // arrival taken from the tracker and not acted on yet
+static int measure_point = 0;
+static bool measure_last_point = false;
+static Measure_phase measure_phase = PHASE_POSITION;
+static Motion measure_plan[MOTION_PLAN_LENGTH];
+static int measure_plan_length = 0;
+static int measure_plan_index = 0;
+
+// In task mode stepper moves run to the end in one step, the executive must never block
+static const bool measure_blocking_motion = !CYCLIC_EXECUTIVE;
+
+void measure_station_reset()
 {
-    // Initial state
     measure_task_state = TRIGGER_WAIT;
+    measure_measuring = false;
+    measure_arrival_sequence = 0;
+    measure_arrived = BELT_NO_FRUIT;
+    measure_plan_length = 0;
+    measure_plan_index = 0;
+}
 
-    unsigned long start_time = 0;
-    bool measuring = false;
+static void measure_plan_add(Motion_type type, float angle_deg = 0.0f)
+{
+    if (measure_plan_length < MOTION_PLAN_LENGTH) measure_plan[measure_plan_length++] = {type, angle_deg};
+}
+
+static bool measure_plan_run()
+{
+    // Runs the planned moves in order, true once the last one is complete
+    while (measure_plan_index < measure_plan_length)
+    {
+        if (motion_step(measure_plan[measure_plan_index], measure_blocking_motion) == false) return false;
+        measure_plan_index++;
+    }
+    return true;
+}
 
-    unsigned long elapsed = 0;
-    unsigned long half_time = 0;
+static void measure_begin_point()
+{
+    // actual measurement point start from 1
+    measure_fruit_pointer->point_measured = measure_point;
+
+    // Prepare to take measurement
+    measure_fruit_pointer->point_measure_done = false;
+    measure_fruit_pointer->point_quality = NO_QUALITY;
+
+    // prepare for the scan according to the current point to scan
+    measure_plan_length = plan_gripper_position(measure_point, measure_plan);
+    measure_plan_add(MOTION_PROBE_EXTEND);
+    measure_plan_index = 0;
+    measure_phase = PHASE_POSITION;
+}
 
-    for (;;)
+static void measure_pass_unscanned()
+{
+    // The fruit goes on to the sorting station without a stop or a scan, the PC gets no MEASURE_PASSED
+    measure_fruit_pointer->current_fruit_state = MEASURE_PASSED;
+    if (!GATE_METERING) gate_open();
+
+    measure_fruit_id++;
+    measure_fruit_pointer = search_fruit(measure_fruit_id);
+    checkpoint_request();
+}
+
+static bool measure_point_is_last(int point, int quality)
+{
+    // Fixed count, or adaptive: never past the maximum, done from the minimum once the PC reports
+    // enough quality. A PC that sends no quality gets the preset count within min..max.
+    if (!adaptive_points()) return point >= preset_measure_times;
+    if (point >= adaptive_max_points) return true;
+    if (point < adaptive_min_points) return false;
+    if (quality == NO_QUALITY) return point >= preset_measure_times;
+    return quality >= adaptive_quality_threshold;
+}
+
+bool measure_station_step()
+{
+    // Returns true while the station waits for the PC to acknowledge a point
+    switch (measure_task_state)
     {
-        switch (measure_task_state)
+        case TRIGGER_WAIT:
         {
-            case TRIGGER_WAIT:
-            {
-                if (check_trigger(MEASURE_SENSOR_PIN) && 
-                    measure_fruit_pointer != nullptr && 
-                    measure_fruit_pointer->current_fruit_state == INPUT_PASSED)
-                {
-                    // change fruit state and report through UART
-                    measure_fruit_pointer->current_fruit_state = MEASURE_ENTERED;
-                    send_fruit_message(measure_fruit_pointer, NO_PAYLOAD);
+            if (measure_fruit_pointer == nullptr) measure_fruit_pointer = search_fruit(measure_fruit_id);
+            if (measure_fruit_pointer == nullptr || measure_fruit_pointer->current_fruit_state != INPUT_PASSED) break;
 
-                    measure_task_state = CENTERING;
-                }
+            // The tracker tells which fruit a sensor edge belongs to
+            Belt_arrival arrival;
+            if (measure_arrived == BELT_NO_FRUIT && belt_track_arrival(BELT_MEASURE, &measure_arrival_sequence, &arrival))
+                measure_arrived = resync_arrival(BELT_MEASURE, measure_fruit_id, arrival);
 
+            // A fruit that went past the sensor unseen, or that a later fruit overtook, is not measured
+            bool overdue = measure_arrived == BELT_NO_FRUIT && belt_track_passed(measure_fruit_id, BELT_MEASURE);
+            if (overdue || measure_arrived > measure_fruit_id)
+            {
+                resync_report(BELT_MEASURE, RESYNC_SKIP, measure_fruit_id, overdue ? RESYNC_OVERDUE : RESYNC_OVERTAKEN, belt_odometer_um());
+                measure_fruit_pointer->sorting_type = SORTING_TYPE_REJECT;
+                measure_fruit_pointer->faults |= FRUIT_FAULT_SKIPPED;
+                measure_pass_unscanned();
                 break;
             }
 
-            case CENTERING:
+            if (measure_arrived == measure_fruit_id)
+            {
+                measure_arrived = BELT_NO_FRUIT;
+                motion_settings_latch();
+
+                // change fruit state and report through UART
+                measure_fruit_pointer->current_fruit_state = MEASURE_ENTERED;
+                send_fruit_message(measure_fruit_pointer, NO_PAYLOAD);
+                gate_meter_measure_entered(measure_fruit_id);
 
-                // Start measuring if not already
-                if (measuring == false)
+                // A size reject rides through: no stop, no scan and nothing for the PC to classify
+                if (size_rejected(measure_fruit_pointer))
                 {
-                    // set measureing flag and start timming
-                    measuring = true;
-                    start_time = millis();
+                    gate_meter_station_free();
+                    size_stats.skipped++;
+                    measure_pass_unscanned();
+                    break;
                 }
 
-                // calculate elapsed time
-                elapsed = millis() - start_time;
+                measure_task_state = CENTERING;
+            }
+            break;
+        }
 
-                // If elapsed time * 2 >= dia_measure, stop conveyor
-                if (elapsed * 2 >= measure_fruit_pointer->dia_measure)
-                {
-                    // stop conveyor
-                    conveyor_stop();
+        case CENTERING:
+            // Start measuring if not already
+            if (measure_measuring == false)
+            {
+                // set measureing flag and start timming
+                measure_measuring = true;
+                measure_start_time = belt_ms();
+            }
 
-                    // change fruit state and report through UART
-                    measure_fruit_pointer->current_fruit_state = MEASURE_PROCESSING;
-                    send_fruit_message(measure_fruit_pointer, NO_PAYLOAD);
+            // If elapsed time * 2 >= dia_measure, stop conveyor
+            if ((belt_ms() - measure_start_time) * 2 >= (unsigned long)measure_fruit_pointer->dia_measure)
+            {
+                // stop conveyor
+                conveyor_stop();
 
-                    // Reset measuring flag for next use
-                    measuring = false;
+                // change fruit state and report through UART
+                measure_fruit_pointer->current_fruit_state = MEASURE_PROCESSING;
+                send_fruit_message(measure_fruit_pointer, NO_PAYLOAD);
 
-                    // change state of task
-                    measure_task_state = MEASURING_SPECTRAL;
-                }
+                // Reset measuring flag for next use
+                measure_measuring = false;
 
-                break;
+                // change state of task
+                measure_task_state = MEASURING_SPECTRAL;
+                measure_point = 1;
+                measure_begin_point();
+            }
+            break;
 
-            case MEASURING_SPECTRAL:
+        case MEASURING_SPECTRAL:
+            switch (measure_phase)
+            {
+                case PHASE_POSITION:
+                    if (measure_plan_run() == false) break;
+                    if (critical_lane_ready(measure_fruit_id, MEASURE_PROCESSING) == false) break;
 
-                for (int current_point = 1; 
-                    current_point <= preset_measure_times; 
-                    current_point++)
-                {
-                    // actual measurement point start from 1
-                    measure_fruit_pointer->point_measured = current_point;
+                    //expect respone with the same message to confirm the measureing is done
+                    send_fruit_message(measure_fruit_pointer, measure_point);
+                    measure_phase = PHASE_WAIT_ACK;
+                    // fall through
 
-                    // Prepare to take measurement
-                    measure_fruit_pointer->point_measure_done = false;
+                case PHASE_WAIT_ACK:
+                    if (take_point_ack(measure_fruit_pointer, measure_point) == false) return true;
+                    measure_last_point = measure_point_is_last(measure_point, measure_fruit_pointer->point_quality);
 
-                    // prepare for the scan according to the current point to scan
-                    gripper_position_fruit(current_point);
-                    probe_attach();
+                    // deattach probe but not all the way out
+                    measure_plan_length = 0;
+                    measure_plan_index = 0;
+                    measure_plan_add(measure_last_point ? MOTION_PROBE_RETRACT_LAST : MOTION_PROBE_RETRACT);
+                    measure_phase = PHASE_RETRACT;
+                    // fall through
 
-                    //expect respone with the same message to confirm the measureing is done
-                    send_fruit_message(measure_fruit_pointer, current_point);
+                case PHASE_RETRACT:
+                    if (measure_plan_run() == false) break;
 
-                    //wait until UART task set the point_measure_done to true
-                    while (measure_fruit_pointer->point_measure_done == false)
+                    if (!measure_last_point)
                     {
-                        // prevent watchdog reset
-                        vTaskDelay(10 / portTICK_PERIOD_MS); 
+                        measure_point++;
+                        measure_begin_point();
+                        break;
                     }
 
-                    // deattach probe but not all the way out
-                    probe_deattach(current_point);
-                }
+                    // release the current and get ready for the next fruit
+                    measure_plan_length = 0;
+                    measure_plan_index = 0;
+                    measure_plan_add(MOTION_RELEASE_ALL);
+                    measure_plan_add(MOTION_HOME);
+                    measure_phase = PHASE_FINISH;
+                    break;
 
-                // release the current and get ready for the next fruit
-                gripper_release(true);
-                gripper_home();
-                conveyor_run();
-                gate_open();
+                case PHASE_FINISH:
+                    if (measure_plan_run() == false) break;
+                    if (critical_lane_ready(measure_fruit_id, MEASURE_PASSED) == false) break;
 
-                // Update fruit state to MEASURE_PASSED
-                measure_fruit_pointer->current_fruit_state = MEASURE_PASSED;
+                    conveyor_run();
+                    if (!GATE_METERING) gate_open();
+                    gate_meter_station_free();
 
-                // expect response with the type of the fruit
-                send_fruit_message(measure_fruit_pointer, NO_PAYLOAD);
+                    // Update fruit state to MEASURE_PASSED
+                    measure_fruit_pointer->current_fruit_state = MEASURE_PASSED;
 
-                // Move to next fruit
-                measure_fruit_id++;
-                measure_fruit_pointer = search_fruit(measure_fruit_id);
+                    // expect response with the type of the fruit, the payload is the number of points taken
+                    send_fruit_message(measure_fruit_pointer, measure_point);
 
-                // change back state to trigger wait
-                measure_task_state = TRIGGER_WAIT;
-
-                break;
+                    point_stats.fruits++;
+                    point_stats.points += measure_point;
+                    if (measure_point < preset_measure_times) point_stats.early++;
+                    if (measure_point > preset_measure_times) point_stats.extended++;
 
-            default:
+                    // Move to next fruit
+                    measure_fruit_id++;
+                    measure_fruit_pointer = search_fruit(measure_fruit_id);
+                    checkpoint_request();
 
-                // Undefined state
-                vTaskDelay(10 / portTICK_PERIOD_MS);
+                    // change back state to trigger wait
+                    measure_task_state = TRIGGER_WAIT;
+                    break;
+            }
+            break;
 
-                break;
-        }
-        // keep loop cooperative
-        vTaskDelay(5 / portTICK_PERIOD_MS); 
+        default:
+            // Undefined state, start over
+            measure_task_state = TRIGGER_WAIT;
+            break;
     }
+    return false;
 }
 
+//============================================================== SORTING STATION ==============================================================//
+static uint32_t sorting_arrival_sequence = 0;
+static long sorting_arrived = BELT_NO_FRUIT;    // arrival taken from the tracker and not acted on yet
+static int sorting_bin_angle = -1;
 
-void Sorting_Task(void* parameter)
+void sorting_station_reset()
 {
-    // Initial state
     sorting_task_state = TRIGGER_WAIT;
-    bool old_trigger_state = false;
-    bool current_trigger_state = false;
+    sorting_arrival_sequence = 0;
+    sorting_arrived = BELT_NO_FRUIT;
+    sorting_bin_angle = -1;
+}
 
-    for (;;)
+void sorting_station_step()
+{
+    switch (sorting_task_state)
     {
-        switch (sorting_task_state)
+        case TRIGGER_WAIT:
         {
-            case TRIGGER_WAIT:
-            {
-                if (sorting_fruit_pointer == nullptr )
-                {
-                    vTaskDelay(10 / portTICK_PERIOD_MS);
-                    break;
-                }
+            // Take any sort decision the UART task handed over
+            apply_sort_decisions();
 
-                // Check fruit sorting type
-                if (sorting_fruit_pointer->sorting_type == 0)
-                {
-                    // Not yet sorted — wait a little
-                    vTaskDelay(10 / portTICK_PERIOD_MS);
-                }
-                else
-                {
-                    // Sorting type 1 or 2 → rotate bin servo to correct position
-                    if (sorting_fruit_pointer->sorting_type == 1) sorting_bin_write(SORTING_ANGLE_TYPE_1);
-                    else if (sorting_fruit_pointer->sorting_type == 2) sorting_bin_write(SORTING_ANGLE_TYPE_2);
-                }
+            if (sorting_fruit_pointer == nullptr) sorting_fruit_pointer = search_fruit(sorting_fruit_id);
+            if (sorting_fruit_pointer == nullptr) break;
 
-                // Get the current trigger state
-                current_trigger_state = check_trigger(SORTING_SENSOR_PIN);
-
-                // Check if fruit is detected at sorting sensor
-                if (current_trigger_state != old_trigger_state &&
-                    current_trigger_state == true)
-                {
-                    if (sorting_fruit_pointer -> current_fruit_state == MEASURE_PASSED)
-                    {
-
-                    // Update fruit state and report throught UART
-                    sorting_fruit_pointer->current_fruit_state = SORTING_PASSED;
-                    send_fruit_message(sorting_fruit_pointer, sorting_fruit_pointer->sorting_type);
+            // Known sorting type → rotate bin servo to correct position, once per decision. A fruit the
+            // tracker inserted reaches the flap first and goes to the reject bin
+            int angle = sorting_angle(sorting_fruit_pointer->sorting_type);
+            if (belt_track_next_fruit(BELT_SORTING) == BELT_UNKNOWN_FRUIT) angle = SORTING_ANGLE_REJECT;
+            if (angle >= 0 && angle != sorting_bin_angle)
+            {
+                sorting_bin_write(angle);
+                sorting_bin_angle = angle;
+            }
 
-                    // Reset fruit data for reuse
-                    reset_fruit(sorting_fruit_pointer);
+            // The tracker tells which fruit a sensor edge belongs to
+            Belt_arrival arrival;
+            if (sorting_arrived == BELT_NO_FRUIT && belt_track_arrival(BELT_SORTING, &sorting_arrival_sequence, &arrival))
+                sorting_arrived = resync_arrival(BELT_SORTING, sorting_fruit_id, arrival);
 
-                    // Move to next fruit in process
-                    sorting_fruit_id++;
-                    sorting_fruit_pointer = search_fruit(sorting_fruit_id);
-                    
-                    // Update trigger state
-                    
+            // The measuring station lets go of every fruit it skips, an arrival waits for that
+            if (sorting_fruit_pointer->current_fruit_state != MEASURE_PASSED) break;
 
-                    }
-                    old_trigger_state = current_trigger_state;
-                }
+            // A fruit that went past the sensor unseen, or that a later fruit overtook, is dropped
+            bool overdue = sorting_arrived == BELT_NO_FRUIT && belt_track_passed(sorting_fruit_id, BELT_SORTING);
+            if (overdue || sorting_arrived > sorting_fruit_id)
+            {
+                resync_report(BELT_SORTING, RESYNC_SKIP, sorting_fruit_id, overdue ? RESYNC_OVERDUE : RESYNC_OVERTAKEN, belt_odometer_um());
+                reset_fruit(sorting_fruit_pointer);
+                sorting_fruit_id++;
+                sorting_fruit_pointer = search_fruit(sorting_fruit_id);
+                checkpoint_request();
                 break;
             }
 
-            default:
+            // Check if fruit is detected at sorting sensor
+            if (sorting_arrived == sorting_fruit_id)
             {
-                // Undefined or idle state
-                vTaskDelay(10 / portTICK_PERIOD_MS);
-                break;
+                sorting_arrived = BELT_NO_FRUIT;
+
+                // Update fruit state and report throught UART
+                if (sorting_angle(sorting_fruit_pointer->sorting_type) < 0) sorting_fruit_pointer->faults |= FRUIT_FAULT_NO_TYPE;
+                sorting_fruit_pointer->current_fruit_state = SORTING_PASSED;
+                send_fruit_message(sorting_fruit_pointer, sorting_fruit_pointer->sorting_type);
+
+                // Reset fruit data for reuse
+                reset_fruit(sorting_fruit_pointer);
+
+                // Move to next fruit in process
+                sorting_fruit_id++;
+                sorting_fruit_pointer = search_fruit(sorting_fruit_id);
+                checkpoint_request();
             }
+            break;
         }
 
-        // Cooperative delay
-        vTaskDelay(1 / portTICK_PERIOD_MS);
+        default:
+            // Undefined state, start over
+            sorting_task_state = TRIGGER_WAIT;
+            break;
+    }
+}
+
+//============================================================== TASKS ==============================================================//
+void Input_Task(void*) 
+{
+    input_station_reset();
+
+    for (;;) 
+    {
+        input_station_step();
+        vTaskDelay(1 / portTICK_PERIOD_MS); // small delay to prevent CPU overload
     }
 }
 
 
-void UartReceiveTask(void* parameter)
+void Measure_Task(void*)
 {
-    char buffer[64];
-    int index = 0;
+    measure_station_reset();
 
     for (;;)
     {
-        // Read all available serial data
-        while (Serial.available() > 0)
-        {
-            char c = Serial.read();
+        //sleep until UART task delivers the acknowledgement for this point
+        if (measure_station_step()) ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        else vTaskDelay(1 / portTICK_PERIOD_MS);
+    }
+}
 
-            if (c == '\n')
-            {
-                buffer[index] = '\0';
-                index = 0;
 
-                // Check for "stop" command first
-                if (strcasecmp(buffer, "stop") == 0)
-                {
-                    Serial.println("Stop command received, stopping system...");
-                    system_stop();
-                    continue;
-                }
+void Sorting_Task(void*)
+{
+    sorting_station_reset();
+
+    for (;;)
+    {
+        sorting_station_step();
 
-                // Parse message like "123|MEASURE_PROCESSING|5"
-                char* token = strtok(buffer, "|");
-                if (token == NULL) continue;
+        // Cooperative delay, cut short when a sort decision arrives
+        ulTaskNotifyTake(pdTRUE, 1 / portTICK_PERIOD_MS);
+    }
+}
 
-                long id = atol(token);
 
-                token = strtok(NULL, "|");
-                if (token == NULL) continue;
-                String state_str = String(token);
+//============================================================== CYCLIC EXECUTIVE ==============================================================//
+static hw_timer_t* executive_timer = NULL;
 
-                token = strtok(NULL, "|");
-                if (token == NULL) continue;
-                int value = atoi(token);
+#if CYCLIC_EXECUTIVE
+static void IRAM_ATTR executive_tick()
+{
+    BaseType_t woken = pdFALSE;
+    vTaskNotifyGiveFromISR(executive_task_handle, &woken);
+    portYIELD_FROM_ISR(woken);
+}
+#endif
 
-                // Search for the fruit
-                Fruit* f = search_fruit(id);
-                if (f == nullptr) continue;
+void executive_start()
+{
+#if CYCLIC_EXECUTIVE
+    memset(&executive_stats, 0, sizeof(executive_stats));
+    executive_task_handle = executive_task_storage.create(Executive_Task, "Executive_Task", EXECUTIVE_TASK_PRIORITY, 1);
 
-                // Update fields depending on message type
-                if (state_str.equalsIgnoreCase("MEASURE_PROCESSING"))
-                {
-                    f->point_measure_done = true;
-                }
-                else if (state_str.equalsIgnoreCase("MEASURE_PASSED"))
-                {
-                    f->sorting_type = value;
-                }
+    // 1 MHz timer counting to the tick period, allocated on the first start and only stopped after that
+    if (executive_timer == NULL)
+    {
+        executive_timer = timerBegin(1000000);
+        timerAttachInterrupt(executive_timer, &executive_tick);
+        timerAlarm(executive_timer, 1000000 / EXECUTIVE_RATE_HZ, true, 0);
+    }
+    else
+    {
+        timerWrite(executive_timer, 0);
+        timerStart(executive_timer);
+    }
+#endif
+}
+
+void executive_stop()
+{
+    if (executive_timer != NULL) timerStop(executive_timer);
+    if (executive_task_handle != NULL)
+    {
+        vTaskDelete(executive_task_handle);
+        executive_task_handle = NULL;
+    }
+}
+
+void Executive_Task(void*)
+{
+    input_station_reset();
+    measure_station_reset();
+    sorting_station_reset();
+
+    for (;;)
+    {
+        // More than one pending tick means the previous one overran its period
+        uint32_t pending = ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        if (pending > 1) executive_stats.overruns += pending - 1;
+
+        // Fixed order every tick: stations in the direction the fruit travels
+        uint32_t tick_start = micros();
+        uint32_t t0 = tick_start;
+
+        input_station_step();
+        uint32_t t1 = micros();
+        measure_station_step();
+        uint32_t t2 = micros();
+        sorting_station_step();
+        uint32_t t3 = micros();
+
+        uint32_t took[STATION_COUNT] = {t1 - t0, t2 - t1, t3 - t2};
+        for (int i = 0; i < STATION_COUNT; i++)
+            if (took[i] > executive_stats.station_wcet_us[i]) executive_stats.station_wcet_us[i] = took[i];
+
+        uint32_t tick_us = t3 - tick_start;
+        if (tick_us > executive_stats.wcet_us) executive_stats.wcet_us = tick_us;
+        executive_stats.total_us += tick_us;
+        executive_stats.ticks++;
+    }
+}
+
+
+void UartReceiveTask(void*)
+{
+    char buffer[UART_LINE_BUFFER_LENGTH];
+    size_t index = 0;
+    bool overflow = false;
+
+    // The UART driver's event task wakes us as soon as bytes arrive
+    TaskHandle_t self = xTaskGetCurrentTaskHandle();
+    Serial.onReceive([self]() { xTaskNotifyGive(self); });
+
+    for (;;)
+    {
+        // Read all available serial data straight into the line buffer
+        while (Serial.available() > 0)
+        {
+            size_t n = Serial.read((uint8_t*)buffer + index, sizeof(buffer) - 1 - index);
+            int64_t received_us = clock_local_us();
+            size_t end = index + n;
+            size_t line_start = 0;
+
+            for (size_t i = index; i < end; i++)
+            {
+                if (buffer[i] != '\n') continue;
+
+                // Terminate and parse the line where it lies
+                size_t line_end = i;
+                if (line_end > line_start && buffer[line_end - 1] == '\r') line_end--;
+                buffer[line_end] = '\0';
+
+                // A stop hands the rest of the chunk to the handshake, skip what it took
+                serial_pending_set(buffer + i + 1, end - (i + 1));
+                if (!overflow) handle_command_line(buffer + line_start, received_us);
+                i += (end - (i + 1)) - serial_pending_clear();
+                overflow = false;
+                line_start = i + 1;
             }
-            else if (index < sizeof(buffer) - 1)
+
+            // Keep the unfinished tail at the front of the buffer
+            index = end - line_start;
+            if (line_start > 0 && index > 0) memmove(buffer, buffer + line_start, index);
+
+            // Drop a line that does not fit instead of parsing half of it
+            if (index >= sizeof(buffer) - 1)
             {
-                buffer[index++] = c;
+                LOG_WARN(EV_LINE_OVERFLOW, 0, 0);
+                index = 0;
+                overflow = true;
             }
         }
 
-        vTaskDelay(10 / portTICK_PERIOD_MS);
+        // Fallback timeout in case a notification is missed
+        ulTaskNotifyTake(pdTRUE, 100 / portTICK_PERIOD_MS);
     }
 }
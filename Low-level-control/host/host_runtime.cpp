@@ -0,0 +1,662 @@
+#include "Arduino.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/queue.h"
+#include "esp_system.h"
+#include "esp_timer.h"
+#include "soc/gpio_struct.h"
+#include "Preferences.h"
+
+#include "host_runtime.h"
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <errno.h>
+#include <stdarg.h>
+#include <unistd.h>
+
+void setup();
+void loop();
+
+//============================================================== CLOCK ==============================================================//
+static std::chrono::steady_clock::time_point clock_origin = std::chrono::steady_clock::now();
+static std::atomic<double> clock_scale{1.0};
+
+void host_clock_start(double time_scale)
+{
+    clock_origin = std::chrono::steady_clock::now();
+    clock_scale = (time_scale > 0) ? time_scale : 1.0;
+}
+
+double host_time_scale()
+{
+    return clock_scale;
+}
+
+uint64_t host_now_us()
+{
+    auto real = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - clock_origin);
+    return (uint64_t)(real.count() * clock_scale.load());
+}
+
+uint64_t host_real_timeout_us(uint64_t sim_us)
+{
+    return (uint64_t)(sim_us / clock_scale.load());
+}
+
+void host_sleep_us(uint64_t sim_us)
+{
+    std::this_thread::sleep_for(std::chrono::microseconds(host_real_timeout_us(sim_us)));
+}
+
+unsigned long millis() { return (unsigned long)(host_now_us() / 1000); }
+unsigned long micros() { return (unsigned long)host_now_us(); }
+int64_t esp_timer_get_time() { return (int64_t)host_now_us(); }
+void delayMicroseconds(uint32_t us)
+{
+    // Busy wait like the board: a sleep this short overshoots by the scheduler latency, and the
+    // overshoot is multiplied by the time scale. Only the last real millisecond spins.
+    uint64_t until = host_now_us() + us;
+    uint64_t spin_us = (uint64_t)(1000 * clock_scale.load());
+    if (us > spin_us) host_sleep_us(us - spin_us);
+    while (host_now_us() < until) std::this_thread::yield();
+}
+
+long map(long x, long in_min, long in_max, long out_min, long out_max)
+{
+    return (x - in_min) * (out_max - out_min) / (in_max - in_min) + out_min;
+}
+
+esp_reset_reason_t esp_reset_reason(void) { return ESP_RST_POWERON; }
+void esp_restart(void) { exit(0); }
+int xPortGetCoreID() { return 1; }
+
+//============================================================== TASKS ==============================================================//
+struct Host_task_deleted {};
+
+struct Host_task
+{
+    std::string name;
+    std::mutex lock;
+    std::condition_variable wake;
+    uint32_t notify_count = 0;
+    uint32_t stack_depth = 0;
+    std::atomic<bool> deleted{false};
+};
+
+static thread_local Host_task* current_task = nullptr;
+
+static Host_task* this_task()
+{
+    if (current_task == nullptr) current_task = new Host_task();   // thread not created through xTaskCreate
+    return current_task;
+}
+
+static void check_deleted()
+{
+    if (current_task != nullptr && current_task->deleted) throw Host_task_deleted();
+}
+
+BaseType_t xTaskCreatePinnedToCore(TaskFunction_t function, const char* name, uint32_t stack_depth, void* parameter,
+                                   UBaseType_t, TaskHandle_t* created_task, BaseType_t)
+{
+    Host_task* task = new Host_task();
+    task->name = name;
+    task->stack_depth = stack_depth;
+    if (created_task != nullptr) *created_task = task;
+
+    std::thread([task, function, parameter]()
+    {
+        current_task = task;
+        try { function(parameter); }
+        catch (const Host_task_deleted&) {}
+    }).detach();
+
+    return pdPASS;
+}
+
+TaskHandle_t xTaskCreateStaticPinnedToCore(TaskFunction_t function, const char* name, uint32_t stack_depth, void* parameter,
+                                           UBaseType_t priority, StackType_t*, StaticTask_t*, BaseType_t core_id)
+{
+    TaskHandle_t task = nullptr;
+    xTaskCreatePinnedToCore(function, name, stack_depth, parameter, priority, &task, core_id);
+    return task;
+}
+
+UBaseType_t uxTaskGetStackHighWaterMark(TaskHandle_t task)
+{
+    // Thread stacks are not watched, report the whole stack as never used
+    if (task == nullptr) task = this_task();
+    return task->stack_depth;
+}
+
+void vTaskDelete(TaskHandle_t task)
+{
+    if (task == nullptr) task = this_task();
+    task->deleted = true;
+    task->wake.notify_all();
+    if (task == current_task) throw Host_task_deleted();
+}
+
+void vTaskDelay(TickType_t ticks)
+{
+    check_deleted();
+    host_sleep_us((uint64_t)ticks * portTICK_PERIOD_MS * 1000);
+    check_deleted();
+}
+
+void delay(uint32_t ms)
+{
+    vTaskDelay(ms / portTICK_PERIOD_MS);
+}
+
+eTaskState eTaskGetState(TaskHandle_t task)
+{
+    return (task == nullptr || task->deleted) ? eDeleted : eRunning;
+}
+
+TaskHandle_t xTaskGetCurrentTaskHandle()
+{
+    return this_task();
+}
+
+TickType_t xTaskGetTickCount()
+{
+    return (TickType_t)(host_now_us() / (portTICK_PERIOD_MS * 1000));
+}
+
+uint32_t ulTaskNotifyTake(BaseType_t clear_count_on_exit, TickType_t ticks_to_wait)
+{
+    Host_task* task = this_task();
+    std::unique_lock<std::mutex> guard(task->lock);
+
+    auto ready = [task]() { return task->notify_count > 0 || task->deleted; };
+    if (ticks_to_wait == portMAX_DELAY) task->wake.wait(guard, ready);
+    else task->wake.wait_for(guard, std::chrono::microseconds(host_real_timeout_us((uint64_t)ticks_to_wait * portTICK_PERIOD_MS * 1000)), ready);
+
+    if (task->deleted) throw Host_task_deleted();
+
+    uint32_t count = task->notify_count;
+    if (count > 0) task->notify_count = clear_count_on_exit ? 0 : count - 1;
+    return count;
+}
+
+BaseType_t xTaskNotifyGive(TaskHandle_t task)
+{
+    {
+        std::lock_guard<std::mutex> guard(task->lock);
+        task->notify_count++;
+    }
+    task->wake.notify_all();
+    return pdPASS;
+}
+
+void vTaskNotifyGiveFromISR(TaskHandle_t task, BaseType_t* higher_priority_task_woken)
+{
+    xTaskNotifyGive(task);
+    if (higher_priority_task_woken != nullptr) *higher_priority_task_woken = pdFALSE;
+}
+
+//============================================================== TIMERS ==============================================================//
+struct hw_timer_s
+{
+    uint32_t frequency = 1000000;
+    void (*isr)(void) = nullptr;
+    std::atomic<bool> running{true};
+    std::atomic<bool> ended{false};
+    std::atomic<bool> restart{false};
+};
+
+hw_timer_t* timerBegin(uint32_t frequency)
+{
+    hw_timer_t* timer = new hw_timer_t();
+    timer->frequency = frequency;
+    return timer;
+}
+
+void timerEnd(hw_timer_t* timer)
+{
+    // The alarm thread may still hold the timer, it is left to leak
+    timer->ended = true;
+}
+
+void timerStart(hw_timer_t* timer)
+{
+    timer->running = true;
+}
+
+void timerStop(hw_timer_t* timer)
+{
+    timer->running = false;
+}
+
+void timerWrite(hw_timer_t* timer, uint64_t)
+{
+    timer->restart = true;
+}
+
+void timerAttachInterrupt(hw_timer_t* timer, void (*userFunc)(void))
+{
+    timer->isr = userFunc;
+}
+
+void timerAlarm(hw_timer_t* timer, uint64_t alarm_value, bool autoreload, uint64_t)
+{
+    // Alarms fire on an absolute simulated schedule, a late thread catches up instead of drifting
+    uint64_t period_us = alarm_value * 1000000 / timer->frequency;
+    std::thread([timer, period_us, autoreload]()
+    {
+        uint64_t next_us = host_now_us() + period_us;
+        while (!timer->ended)
+        {
+            uint64_t now = host_now_us();
+            if (next_us > now) host_sleep_us(next_us - now);
+            if (timer->ended) return;
+            if (timer->restart.exchange(false) || !timer->running)
+            {
+                next_us = host_now_us() + period_us;
+                continue;
+            }
+            if (timer->isr != nullptr) timer->isr();
+            if (!autoreload) return;
+            next_us += period_us;
+        }
+    }).detach();
+}
+
+//============================================================== QUEUES ==============================================================//
+struct Host_queue
+{
+    std::mutex lock;
+    std::condition_variable not_empty;
+    std::condition_variable not_full;
+    std::vector<uint8_t> storage;
+    size_t item_size = 0;
+    size_t length = 0;
+    size_t head = 0;        // next item to receive
+    size_t count = 0;
+};
+
+QueueHandle_t xQueueCreate(UBaseType_t length, UBaseType_t item_size)
+{
+    Host_queue* queue = new Host_queue();
+    queue->storage.resize((size_t)length * item_size);
+    queue->item_size = item_size;
+    queue->length = length;
+    return queue;
+}
+
+QueueHandle_t xQueueCreateStatic(UBaseType_t length, UBaseType_t item_size, uint8_t*, StaticQueue_t*)
+{
+    return xQueueCreate(length, item_size);
+}
+
+void vQueueDelete(QueueHandle_t queue)
+{
+    delete queue;
+}
+
+BaseType_t xQueueReset(QueueHandle_t queue)
+{
+    std::lock_guard<std::mutex> guard(queue->lock);
+    queue->head = 0;
+    queue->count = 0;
+    queue->not_full.notify_all();
+    return pdTRUE;
+}
+
+template <typename Predicate>
+static bool wait_ticks(std::condition_variable& cv, std::unique_lock<std::mutex>& guard, TickType_t ticks, Predicate ready)
+{
+    if (ticks == portMAX_DELAY)
+    {
+        cv.wait(guard, ready);
+        return true;
+    }
+    return cv.wait_for(guard, std::chrono::microseconds(host_real_timeout_us((uint64_t)ticks * portTICK_PERIOD_MS * 1000)), ready);
+}
+
+BaseType_t xQueueSend(QueueHandle_t queue, const void* item, TickType_t ticks_to_wait)
+{
+    std::unique_lock<std::mutex> guard(queue->lock);
+    if (!wait_ticks(queue->not_full, guard, ticks_to_wait, [queue]() { return queue->count < queue->length; })) return pdFALSE;
+
+    size_t tail = (queue->head + queue->count) % queue->length;
+    memcpy(&queue->storage[tail * queue->item_size], item, queue->item_size);
+    queue->count++;
+    queue->not_empty.notify_one();
+    return pdTRUE;
+}
+
+BaseType_t xQueueReceive(QueueHandle_t queue, void* buffer, TickType_t ticks_to_wait)
+{
+    std::unique_lock<std::mutex> guard(queue->lock);
+    if (!wait_ticks(queue->not_empty, guard, ticks_to_wait, [queue]() { return queue->count > 0; })) return pdFALSE;
+
+    memcpy(buffer, &queue->storage[queue->head * queue->item_size], queue->item_size);
+    queue->head = (queue->head + 1) % queue->length;
+    queue->count--;
+    queue->not_full.notify_one();
+    return pdTRUE;
+}
+
+UBaseType_t uxQueueMessagesWaiting(QueueHandle_t queue)
+{
+    std::lock_guard<std::mutex> guard(queue->lock);
+    return queue->count;
+}
+
+UBaseType_t uxQueueSpacesAvailable(QueueHandle_t queue)
+{
+    std::lock_guard<std::mutex> guard(queue->lock);
+    return queue->length - queue->count;
+}
+
+//============================================================== GPIO ==============================================================//
+#define HOST_PIN_COUNT 40
+
+static std::mutex gpio_lock;
+static Host_machine* machine = nullptr;
+static uint8_t pin_modes[HOST_PIN_COUNT];
+static uint8_t output_levels[HOST_PIN_COUNT];
+static uint8_t pwm_resolution[HOST_PIN_COUNT];
+
+const Host_gpio_dev GPIO;
+
+void host_attach_machine(Host_machine* m)
+{
+    std::lock_guard<std::mutex> guard(gpio_lock);
+    machine = m;
+}
+
+static void write_pin(int pin, bool level)
+{
+    std::lock_guard<std::mutex> guard(gpio_lock);
+    if (output_levels[pin] == level) return;
+    output_levels[pin] = level;
+    if (machine != nullptr) machine->output_changed(pin, level, host_now_us());
+}
+
+static bool read_pin(int pin)
+{
+    std::lock_guard<std::mutex> guard(gpio_lock);
+    if (pin_modes[pin] == OUTPUT) return output_levels[pin];
+    if (machine != nullptr) return machine->read_input(pin, host_now_us());
+    return HIGH;
+}
+
+void pinMode(uint8_t pin, uint8_t mode)
+{
+    if (pin < HOST_PIN_COUNT) pin_modes[pin] = mode;
+}
+
+void digitalWrite(uint8_t pin, uint8_t val)
+{
+    if (pin < HOST_PIN_COUNT) write_pin(pin, val != LOW);
+}
+
+int digitalRead(uint8_t pin)
+{
+    return (pin < HOST_PIN_COUNT) ? read_pin(pin) : LOW;
+}
+
+void host_gpio_write_mask(int bank, uint32_t mask, bool level)
+{
+    for (int bit = 0; bit < 32; bit++)
+    {
+        int pin = bank * 32 + bit;
+        if ((mask & (1UL << bit)) && pin < HOST_PIN_COUNT) write_pin(pin, level);
+    }
+}
+
+uint32_t host_gpio_read_bank(int bank)
+{
+    // Only pins with a mode are evaluated, the rest read low
+    uint32_t value = 0;
+    for (int bit = 0; bit < 32; bit++)
+    {
+        int pin = bank * 32 + bit;
+        if (pin < HOST_PIN_COUNT && pin_modes[pin] != 0 && read_pin(pin)) value |= (1UL << bit);
+    }
+    return value;
+}
+
+bool ledcAttach(uint8_t pin, uint32_t, uint8_t resolution)
+{
+    if (pin >= HOST_PIN_COUNT) return false;
+    pwm_resolution[pin] = resolution;
+    return true;
+}
+
+bool ledcWrite(uint8_t pin, uint32_t duty)
+{
+    if (pin >= HOST_PIN_COUNT) return false;
+    std::lock_guard<std::mutex> guard(gpio_lock);
+    if (machine != nullptr) machine->pwm_changed(pin, duty, pwm_resolution[pin], host_now_us());
+    return true;
+}
+
+//============================================================== SERIAL ==============================================================//
+HardwareSerial Serial;
+
+static int serial_fd = -1;
+static std::mutex serial_rx_lock;
+static std::condition_variable serial_rx_ready;
+static std::deque<uint8_t> serial_rx;
+static OnReceiveCb serial_on_receive;
+static std::mutex serial_tx_lock;
+static unsigned long serial_timeout_ms = 1000;
+
+void host_serial_attach(int fd)
+{
+    serial_fd = fd;
+
+    // Receive thread plays the part of the UART driver's event task
+    std::thread([fd]()
+    {
+        uint8_t chunk[256];
+        for (;;)
+        {
+            ssize_t n = ::read(fd, chunk, sizeof(chunk));
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) return;
+
+            OnReceiveCb callback;
+            {
+                std::lock_guard<std::mutex> guard(serial_rx_lock);
+                serial_rx.insert(serial_rx.end(), chunk, chunk + n);
+                callback = serial_on_receive;
+            }
+            serial_rx_ready.notify_all();
+            if (callback) callback();
+        }
+    }).detach();
+}
+
+void HardwareSerial::begin(unsigned long) {}
+void HardwareSerial::end() {}
+void HardwareSerial::setTimeout(unsigned long timeout_ms) { serial_timeout_ms = timeout_ms; }
+bool HardwareSerial::setPins(int8_t, int8_t, int8_t, int8_t) { return true; }
+bool HardwareSerial::setMode(SerialMode) { return true; }   // the pty carries the bus, DE is not modelled
+
+void HardwareSerial::onReceive(OnReceiveCb function, bool)
+{
+    std::lock_guard<std::mutex> guard(serial_rx_lock);
+    serial_on_receive = function;
+}
+
+int HardwareSerial::available()
+{
+    std::lock_guard<std::mutex> guard(serial_rx_lock);
+    return (int)serial_rx.size();
+}
+
+int HardwareSerial::read()
+{
+    std::lock_guard<std::mutex> guard(serial_rx_lock);
+    if (serial_rx.empty()) return -1;
+    int c = serial_rx.front();
+    serial_rx.pop_front();
+    return c;
+}
+
+size_t HardwareSerial::read(uint8_t* buffer, size_t size)
+{
+    std::lock_guard<std::mutex> guard(serial_rx_lock);
+    size_t n = 0;
+    while (n < size && !serial_rx.empty())
+    {
+        buffer[n++] = serial_rx.front();
+        serial_rx.pop_front();
+    }
+    return n;
+}
+
+size_t HardwareSerial::readBytesUntil(char terminator, char* buffer, size_t length)
+{
+    size_t n = 0;
+    while (n < length)
+    {
+        std::unique_lock<std::mutex> guard(serial_rx_lock);
+        bool got = serial_rx_ready.wait_for(guard, std::chrono::microseconds(host_real_timeout_us((uint64_t)serial_timeout_ms * 1000)),
+                                            []() { return !serial_rx.empty(); });
+        if (!got) break;
+
+        char c = (char)serial_rx.front();
+        serial_rx.pop_front();
+        if (c == terminator) break;
+        buffer[n++] = c;
+    }
+    return n;
+}
+
+size_t HardwareSerial::write(const uint8_t* buffer, size_t size)
+{
+    if (serial_fd < 0) return 0;
+    std::lock_guard<std::mutex> guard(serial_tx_lock);
+
+    size_t done = 0;
+    while (done < size)
+    {
+        ssize_t n = ::write(serial_fd, buffer + done, size - done);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+        done += n;
+    }
+    return done;
+}
+
+size_t HardwareSerial::write(uint8_t c) { return write(&c, 1); }
+void HardwareSerial::flush() {}
+
+size_t HardwareSerial::print(const char* s) { return write((const uint8_t*)s, strlen(s)); }
+size_t HardwareSerial::print(char c) { return write((uint8_t)c); }
+size_t HardwareSerial::print(int n) { return printf("%d", n); }
+size_t HardwareSerial::print(unsigned int n) { return printf("%u", n); }
+size_t HardwareSerial::print(long n) { return printf("%ld", n); }
+size_t HardwareSerial::print(unsigned long n) { return printf("%lu", n); }
+size_t HardwareSerial::println() { return print("\r\n"); }
+size_t HardwareSerial::println(const char* s) { return printf("%s\r\n", s); }
+size_t HardwareSerial::println(int n) { return printf("%d\r\n", n); }
+size_t HardwareSerial::println(unsigned int n) { return printf("%u\r\n", n); }
+size_t HardwareSerial::println(long n) { return printf("%ld\r\n", n); }
+size_t HardwareSerial::println(unsigned long n) { return printf("%lu\r\n", n); }
+
+size_t HardwareSerial::printf(const char* format, ...)
+{
+    char buffer[256];
+    va_list args;
+    va_start(args, format);
+    int n = vsnprintf(buffer, sizeof(buffer), format, args);
+    va_end(args);
+    if (n < 0) return 0;
+    return write((const uint8_t*)buffer, (size_t)n < sizeof(buffer) ? (size_t)n : sizeof(buffer) - 1);
+}
+
+//============================================================== ESP ==============================================================//
+EspClass ESP;
+
+uint32_t EspClass::getHeapSize() { return 327680; }
+uint32_t EspClass::getFreeHeap() { return 262144; }
+uint32_t EspClass::getMinFreeHeap() { return 262144; }
+
+//============================================================== FIRMWARE ==============================================================//
+size_t getArduinoLoopTaskStackSize() { return 8192; }
+
+static void loop_task(void*)
+{
+    setup();
+    for (;;) loop();
+}
+
+void host_start_firmware()
+{
+    xTaskCreatePinnedToCore(loop_task, "loopTask", getArduinoLoopTaskStackSize(), NULL, 1, NULL, 1);
+}
+
+//============================================================== NVS ==============================================================//
+static std::mutex nvs_lock;
+static std::map<std::string, std::vector<uint8_t>> nvs;
+static uint32_t nvs_writes = 0;
+
+uint32_t host_nvs_writes()
+{
+    std::lock_guard<std::mutex> guard(nvs_lock);
+    return nvs_writes;
+}
+
+bool Preferences::begin(const char* name, bool)
+{
+    snprintf(name_space, sizeof(name_space), "%s", name);
+    return true;
+}
+
+void Preferences::end() {}
+
+size_t Preferences::putBytes(const char* key, const void* value, size_t len)
+{
+    std::lock_guard<std::mutex> guard(nvs_lock);
+    const uint8_t* bytes = (const uint8_t*)value;
+    nvs[std::string(name_space) + "/" + key].assign(bytes, bytes + len);
+    nvs_writes++;
+    return len;
+}
+
+size_t Preferences::getBytes(const char* key, void* buf, size_t maxLen)
+{
+    std::lock_guard<std::mutex> guard(nvs_lock);
+    auto it = nvs.find(std::string(name_space) + "/" + key);
+    if (it == nvs.end() || it->second.size() > maxLen) return 0;
+    memcpy(buf, it->second.data(), it->second.size());
+    return it->second.size();
+}
+
+size_t Preferences::getBytesLength(const char* key)
+{
+    std::lock_guard<std::mutex> guard(nvs_lock);
+    auto it = nvs.find(std::string(name_space) + "/" + key);
+    return (it == nvs.end()) ? 0 : it->second.size();
+}
+
+bool Preferences::remove(const char* key)
+{
+    std::lock_guard<std::mutex> guard(nvs_lock);
+    return nvs.erase(std::string(name_space) + "/" + key) > 0;
+}
+
+bool Preferences::clear()
+{
+    std::lock_guard<std::mutex> guard(nvs_lock);
+    std::string prefix = std::string(name_space) + "/";
+    for (auto it = nvs.begin(); it != nvs.end();)
+        it = (it->first.compare(0, prefix.size(), prefix) == 0) ? nvs.erase(it) : std::next(it);
+    return true;
+}
@@ -0,0 +1,32 @@
+#pragma once
+
+// Host build runtime: the pieces of the shim (shim/*.h) that tools need to drive the
+// firmware without the board. Firmware time runs time_scale times faster than wall time.
+
+#include <stdint.h>
+
+//============================================================== CLOCK ==============================================================//
+void host_clock_start(double time_scale);
+double host_time_scale();
+uint64_t host_now_us();                     // simulated time since host_clock_start()
+void host_sleep_us(uint64_t sim_us);        // sleep for a simulated duration
+uint64_t host_real_timeout_us(uint64_t sim_us);
+
+//============================================================== MACHINE ==============================================================//
+// What the firmware's pins are wired to. Reads of input pins and every output change are
+// forwarded here; without a machine, inputs read HIGH (nothing triggered).
+class Host_machine
+{
+    public:
+        virtual ~Host_machine() {}
+        virtual bool read_input(int pin, uint64_t now_us) = 0;
+        virtual void output_changed(int pin, bool level, uint64_t now_us) = 0;
+        virtual void pwm_changed(int pin, uint32_t duty, uint8_t resolution_bits, uint64_t now_us) = 0;
+};
+
+void host_attach_machine(Host_machine* machine);
+
+//============================================================== FIRMWARE ==============================================================//
+void host_serial_attach(int fd);            // Serial reads and writes this descriptor
+void host_start_firmware();                 // runs setup() then loop() forever in a task thread
+uint32_t host_nvs_writes();                 // Preferences::putBytes calls so far (flash wear)
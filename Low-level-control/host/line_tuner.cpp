@@ -0,0 +1,444 @@
+// Line parameter search: runs the host build of the firmware against the simulated line once for
+// every combination of conveyor speed, points per fruit, gripper turn between points and stepper
+// pulse, and prints the Pareto front of fruits/min against points per fruit and centering error.
+//
+//   line_tuner --speeds 30,50,70 --points 2,4,6 --angles 5,10 --pulses 500,1000,2000 [options]
+//
+// Every setting is a separate process with its own firmware instance, simulated machine and pty,
+// fed the same fruit stream (same seed). The tuner plays the PC like protocol_bench and keeps
+// --jobs settings running at once, all cores by default. See host/README.md.
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include <math.h>
+#include <poll.h>
+#include <pty.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <termios.h>
+#include <unistd.h>
+
+#include "host_runtime.h"
+#include "pc_link.h"
+#include "sim_machine.h"
+#include "../Project-lib.h"
+
+//============================================================== OPTIONS ==============================================================//
+struct Tuner_options
+{
+    std::vector<int> speeds = {30, 50, 70, 90};
+    std::vector<int> points = {2, 4, 6, 8};
+    std::vector<int> angles = {PRESET_ANGLE_BETWEEN_TWO_MEASUREMENT};
+    std::vector<int> pulses = {500, 1000, STEPPER_PULSE_IN_uS};
+    int fruits = 12;                // per setting
+    double rate = 60.0;             // fruits per minute offered to the feeder
+    bool poisson = true;            // exponential gaps between arrivals, even spacing otherwise
+    double size_mean_mm = 70.0;
+    double size_stddev_mm = 8.0;
+    double gap_mm = 20.0;           // gap the gate keeps between fruits
+    double stepper_min_step_us = 1200.0;
+    double ack_delay_ms = 150.0;
+    double type_delay_ms = 50.0;
+    double time_scale = 10.0;
+    double timeout_s = 600.0;       // simulated seconds per setting
+    int jobs = 0;                   // 0 = one per online CPU
+    unsigned int seed = 1;
+    const char* csv = nullptr;
+};
+
+static void usage()
+{
+    fprintf(stderr,
+        "usage: line_tuner [options]\n"
+        "  --speeds LIST         conveyor speeds %% to try (30,50,70,90)\n"
+        "  --points LIST         preset measure times to try (2,4,6,8)\n"
+        "  --angles LIST         gripper turns between two points in degrees (%d)\n"
+        "  --pulses LIST         stepper pulse lengths in us (500,1000,%d)\n"
+        "  --fruits N            fruits per setting (12)\n"
+        "  --rate R              fruits/min arriving at the feeder (60)\n"
+        "  --spacing KIND        poisson or even arrivals (poisson)\n"
+        "  --size MEAN,SD        fruit diameter distribution in mm (70,8)\n"
+        "  --gap MM              gap the gate keeps between fruits (20)\n"
+        "  --stepper-min-step US shortest step interval the loaded gripper follows (1200)\n"
+        "  --ack-delay MS        PC scan time per point (150)\n"
+        "  --type-delay MS       PC model time per fruit (50)\n"
+        "  --time-scale K        simulated time runs K times faster (10)\n"
+        "  --timeout S           give up a setting after S simulated seconds (600)\n"
+        "  --jobs J              settings run at once (one per CPU)\n"
+        "  --seed N              fruit stream seed, the same for every setting (1)\n"
+        "  --csv FILE            write every setting and its result\n",
+        PRESET_ANGLE_BETWEEN_TWO_MEASUREMENT, STEPPER_PULSE_IN_uS);
+    exit(2);
+}
+
+static std::vector<int> parse_list(const char* text)
+{
+    std::vector<int> list;
+    std::string s = text;
+    for (size_t pos = 0; pos < s.size();)
+    {
+        size_t comma = s.find(',', pos);
+        if (comma == std::string::npos) comma = s.size();
+        int v = atoi(s.substr(pos, comma - pos).c_str());
+        if (v <= 0) usage();
+        list.push_back(v);
+        pos = comma + 1;
+    }
+    if (list.empty()) usage();
+    return list;
+}
+
+static Tuner_options parse_options(int argc, char** argv)
+{
+    Tuner_options o;
+    for (int i = 1; i < argc; i++)
+    {
+        std::string a = argv[i];
+        auto next = [&]() -> const char* { if (i + 1 >= argc) usage(); return argv[++i]; };
+
+        if (a == "--speeds") o.speeds = parse_list(next());
+        else if (a == "--points") o.points = parse_list(next());
+        else if (a == "--angles") o.angles = parse_list(next());
+        else if (a == "--pulses") o.pulses = parse_list(next());
+        else if (a == "--fruits") o.fruits = atoi(next());
+        else if (a == "--rate") o.rate = atof(next());
+        else if (a == "--spacing")
+        {
+            std::string kind = next();
+            if (kind == "poisson") o.poisson = true;
+            else if (kind == "even") o.poisson = false;
+            else usage();
+        }
+        else if (a == "--size")
+        {
+            if (sscanf(next(), "%lf,%lf", &o.size_mean_mm, &o.size_stddev_mm) != 2) usage();
+        }
+        else if (a == "--gap") o.gap_mm = atof(next());
+        else if (a == "--stepper-min-step") o.stepper_min_step_us = atof(next());
+        else if (a == "--ack-delay") o.ack_delay_ms = atof(next());
+        else if (a == "--type-delay") o.type_delay_ms = atof(next());
+        else if (a == "--time-scale") o.time_scale = atof(next());
+        else if (a == "--timeout") o.timeout_s = atof(next());
+        else if (a == "--jobs") o.jobs = atoi(next());
+        else if (a == "--seed") o.seed = (unsigned int)atoi(next());
+        else if (a == "--csv") o.csv = next();
+        else usage();
+    }
+    if (o.fruits < 2) usage();
+    if (o.jobs <= 0) o.jobs = std::max(1L, sysconf(_SC_NPROCESSORS_ONLN));
+    return o;
+}
+
+//============================================================== ONE SETTING ==============================================================//
+struct Tuner_setting
+{
+    int speed;
+    int points;
+    int angle;
+    int pulse_us;
+};
+
+struct Tuner_result
+{
+    Tuner_setting setting;
+    bool finished;              // every fruit sorted before the timeout
+    int sorted;
+    double fruits_per_min;      // between the first and the last SORTING_PASSED
+    double points;              // mean MEASURE_PASSED payload
+    double centering_mean_mm;   // mean distance of the fruit centre from the probe at contact
+    double centering_max_mm;
+    long lost_steps;
+    int wrong_bin;
+
+    bool feasible() const { return finished && lost_steps == 0 && wrong_bin == 0; }
+};
+
+// Plays the PC on the master side of the pty: handshake, acks every point and sends a type for
+// every fruit after the configured delays
+class Line_driver
+{
+    public:
+        Line_driver(const Tuner_options& options, int fd)
+            : opt(options), link(fd, [this](const std::string& line, uint64_t now) { handle_line(line, now); }) {}
+
+        bool start(const Tuner_setting& s);
+        void run(Tuner_result* r);
+        std::vector<int> types;     // type sent per fruit, index id - 1
+
+    private:
+        struct Reply { uint64_t due_us; std::string text; };
+
+        void handle_line(const std::string& line, uint64_t now);
+
+        const Tuner_options& opt;
+        Pc_link link;
+        std::vector<Reply> replies;
+        int sorted = 0;
+        long points_total = 0;
+        int points_count = 0;
+        uint64_t first_sorted_us = 0;
+        uint64_t last_sorted_us = 0;
+};
+
+void Line_driver::handle_line(const std::string& line, uint64_t now)
+{
+    Fruit_line fruit;
+    if (!parse_fruit_line(line, &fruit)) return;
+
+    if (fruit_point_request(fruit))
+        replies.push_back({now + (uint64_t)(opt.ack_delay_ms * 1000), point_ack_line(fruit.id, fruit.payload)});
+    else if (fruit_type_request(fruit))
+    {
+        int type = 1 + (int)(fruit.id % 2);
+        if (fruit.id >= 1 && fruit.id <= (long)types.size()) types[fruit.id - 1] = type;
+        points_total += fruit.payload;
+        points_count++;
+        replies.push_back({now + (uint64_t)(opt.type_delay_ms * 1000), type_reply_line(fruit.id, type)});
+    }
+    else if (fruit_sorted(fruit))
+    {
+        sorted++;
+        if (first_sorted_us == 0) first_sorted_us = now;
+        last_sorted_us = now;
+    }
+}
+
+bool Line_driver::start(const Tuner_setting& s)
+{
+    // Handshake, then the motion settings for the gripper
+    types.assign(opt.fruits, 0);
+    Pc_session session;
+    session.points = s.points;
+    session.speed = s.speed;
+    if (!link.handshake(session)) return false;
+    link.send_line("motion|" + std::to_string(s.angle) + "|" + std::to_string(s.pulse_us));
+    return link.wait_for("motion|", 2.0);
+}
+
+void Line_driver::run(Tuner_result* r)
+{
+    uint64_t deadline = host_now_us() + (uint64_t)(opt.timeout_s * 1e6);
+    while (sorted < opt.fruits && host_now_us() < deadline)
+    {
+        uint64_t now = host_now_us();
+        for (size_t i = 0; i < replies.size();)
+        {
+            if (replies[i].due_us > now) { i++; continue; }
+            link.send_line(replies[i].text);
+            replies.erase(replies.begin() + i);
+        }
+        link.read_lines(5);
+    }
+
+    double span_min = (last_sorted_us - first_sorted_us) / 60e6;
+    r->finished = sorted >= opt.fruits;
+    r->sorted = sorted;
+    r->fruits_per_min = (sorted > 1 && span_min > 0) ? (sorted - 1) / span_min : 0.0;
+    r->points = points_count ? (double)points_total / points_count : 0.0;
+}
+
+// Child side: one firmware instance, writes its result to the pipe and exits
+static void run_setting(const Tuner_setting& s, const Tuner_options& opt, int result_fd)
+{
+    Tuner_result r = {};
+    r.setting = s;
+
+    int master = -1, slave = -1;
+    struct termios tio;
+    memset(&tio, 0, sizeof(tio));
+    cfmakeraw(&tio);
+    if (openpty(&master, &slave, nullptr, &tio, nullptr) != 0) _exit(1);
+
+    Sim_machine_config cfg;
+    cfg.fruits_per_min = opt.rate;
+    cfg.poisson_arrivals = opt.poisson;
+    cfg.fruit_count = opt.fruits;
+    cfg.diameter_mean_mm = opt.size_mean_mm;
+    cfg.diameter_stddev_mm = opt.size_stddev_mm;
+    cfg.release_gap_mm = opt.gap_mm;
+    cfg.stepper_min_step_us = opt.stepper_min_step_us;
+    cfg.seed = opt.seed;
+
+    Sim_machine* machine = new Sim_machine(cfg);
+    host_clock_start(opt.time_scale);
+    host_attach_machine(machine);
+    host_serial_attach(slave);
+    host_start_firmware();
+
+    Line_driver driver(opt, master);
+    if (driver.start(s)) driver.run(&r);
+
+    // Centering at probe contact and the bin every fruit reached, ids start at 1
+    std::vector<Sim_fruit> sim = machine->fruits();
+    int centered = 0;
+    for (size_t i = 0; i < sim.size(); i++)
+    {
+        if (sim[i].centering_recorded)
+        {
+            double e = fabs(sim[i].centering_error_mm);
+            r.centering_mean_mm += e;
+            r.centering_max_mm = std::max(r.centering_max_mm, e);
+            centered++;
+        }
+        int type = driver.types[i];
+        if (type == 0 || sim[i].sorting_angle < 0) continue;
+        if (sim[i].sorting_angle != (type == 1 ? SORTING_ANGLE_TYPE_1 : SORTING_ANGLE_TYPE_2)) r.wrong_bin++;
+    }
+    if (centered) r.centering_mean_mm /= centered;
+    r.lost_steps = machine->lost_steps();
+
+    ssize_t n = write(result_fd, &r, sizeof(r));
+    _exit(n == (ssize_t)sizeof(r) ? 0 : 1);
+}
+
+//============================================================== SEARCH ==============================================================//
+struct Worker
+{
+    pid_t pid;
+    int fd;
+    Tuner_setting setting;
+};
+
+static std::vector<Tuner_setting> build_grid(const Tuner_options& opt)
+{
+    std::vector<Tuner_setting> grid;
+    for (int speed : opt.speeds)
+        for (int points : opt.points)
+            for (int angle : opt.angles)
+                for (int pulse : opt.pulses)
+                {
+                    // Points in quarters must fit a quarter turn, the firmware refuses the rest
+                    if (points > MEASURE_POINTS_LIMIT) continue;
+                    if (!point_angle_fits(angle, points)) continue;
+                    grid.push_back({speed, points, angle, pulse});
+                }
+    return grid;
+}
+
+static std::vector<Tuner_result> run_grid(const std::vector<Tuner_setting>& grid, const Tuner_options& opt)
+{
+    std::vector<Tuner_result> results;
+    std::vector<Worker> running;
+    size_t next = 0;
+
+    while (next < grid.size() || !running.empty())
+    {
+        while (next < grid.size() && (int)running.size() < opt.jobs)
+        {
+            int pipe_fd[2];
+            if (pipe(pipe_fd) != 0) { perror("pipe"); exit(1); }
+            fflush(stdout);
+            fflush(stderr);
+
+            pid_t pid = fork();
+            if (pid < 0) { perror("fork"); exit(1); }
+            if (pid == 0)
+            {
+                close(pipe_fd[0]);
+                for (const Worker& w : running) close(w.fd);
+                run_setting(grid[next], opt, pipe_fd[1]);
+            }
+            close(pipe_fd[1]);
+            running.push_back({pid, pipe_fd[0], grid[next]});
+            next++;
+        }
+
+        std::vector<struct pollfd> fds;
+        for (const Worker& w : running) fds.push_back({w.fd, POLLIN, 0});
+        if (poll(fds.data(), fds.size(), -1) <= 0) continue;
+
+        for (size_t i = fds.size(); i-- > 0;)
+        {
+            if (fds[i].revents == 0) continue;
+            Worker w = running[i];
+
+            // A child that died without a result counts as a setting that never finished
+            Tuner_result r = {};
+            if (read(w.fd, &r, sizeof(r)) != (ssize_t)sizeof(r))
+            {
+                r = {};
+                r.setting = w.setting;
+            }
+            close(w.fd);
+            waitpid(w.pid, nullptr, 0);
+            running.erase(running.begin() + i);
+
+            results.push_back(r);
+            fprintf(stderr, "[%3zu/%zu] speed %3d %% points %2d angle %2d pulse %5d us: %6.2f fruits/min%s\n",
+                    results.size(), grid.size(), r.setting.speed, r.setting.points, r.setting.angle, r.setting.pulse_us,
+                    r.fruits_per_min, r.feasible() ? "" : " (infeasible)");
+        }
+    }
+    return results;
+}
+
+static bool dominates(const Tuner_result& a, const Tuner_result& b)
+{
+    // More fruits/min and points are better, less centering error is better. Centering errors are
+    // compared in 0.1 mm steps, below that the difference between settings is noise.
+    long center_a = lround(a.centering_mean_mm * 10), center_b = lround(b.centering_mean_mm * 10);
+    bool no_worse = a.fruits_per_min >= b.fruits_per_min && a.points >= b.points && center_a <= center_b;
+    bool better = a.fruits_per_min > b.fruits_per_min || a.points > b.points || center_a < center_b;
+    return no_worse && better;
+}
+
+static void print_result(const Tuner_result& r)
+{
+    printf("%6d %7d %6d %9d %11.2f %8.2f %10.1f %10.1f %7ld %6d\n", r.setting.speed, r.setting.points, r.setting.angle,
+           r.setting.pulse_us, r.fruits_per_min, r.points, r.centering_mean_mm, r.centering_max_mm, r.lost_steps, r.wrong_bin);
+}
+
+//============================================================== MAIN ==============================================================//
+int main(int argc, char** argv)
+{
+    Tuner_options opt = parse_options(argc, argv);
+    signal(SIGPIPE, SIG_IGN);
+
+    std::vector<Tuner_setting> grid = build_grid(opt);
+    printf("line tuner: %zu settings, %d fruits each at %.0f/min (%s), diameter %.0f +- %.0f mm, %d jobs, time scale %.1f\n",
+           grid.size(), opt.fruits, opt.rate, opt.poisson ? "poisson" : "even", opt.size_mean_mm, opt.size_stddev_mm,
+           opt.jobs, opt.time_scale);
+    fflush(stdout);
+
+    std::vector<Tuner_result> results = run_grid(grid, opt);
+
+    // Pareto front over the settings that sorted every fruit into its bin without losing steps
+    std::vector<Tuner_result> front;
+    int infeasible = 0;
+    for (const Tuner_result& r : results)
+    {
+        if (!r.feasible()) { infeasible++; continue; }
+        bool dominated = false;
+        for (const Tuner_result& other : results)
+            if (other.feasible() && dominates(other, r)) { dominated = true; break; }
+        if (!dominated) front.push_back(r);
+    }
+    std::sort(front.begin(), front.end(), [](const Tuner_result& a, const Tuner_result& b) {
+        return a.fruits_per_min > b.fruits_per_min;
+    });
+
+    printf("\nPareto front: fruits/min against points per fruit and centering error\n");
+    printf("%6s %7s %6s %9s %11s %8s %10s %10s %7s %6s\n",
+           "speed", "points", "angle", "pulse us", "fruits/min", "points", "center mm", "worst mm", "lost", "wrong");
+    for (const Tuner_result& r : front) print_result(r);
+    printf("\n%zu on the front, %zu dominated, %d infeasible (timed out, lost steps or wrong bin)\n",
+           front.size(), results.size() - front.size() - infeasible, infeasible);
+
+    if (opt.csv != nullptr)
+    {
+        FILE* f = fopen(opt.csv, "w");
+        if (f == nullptr) { perror(opt.csv); return 1; }
+        fprintf(f, "speed,points,angle,pulse_us,finished,sorted,fruits_per_min,points_mean,centering_mean_mm,centering_max_mm,lost_steps,wrong_bin\n");
+        for (const Tuner_result& r : results)
+            fprintf(f, "%d,%d,%d,%d,%d,%d,%.3f,%.2f,%.2f,%.2f,%ld,%d\n", r.setting.speed, r.setting.points, r.setting.angle,
+                    r.setting.pulse_us, r.finished, r.sorted, r.fruits_per_min, r.points, r.centering_mean_mm,
+                    r.centering_max_mm, r.lost_steps, r.wrong_bin);
+        fclose(f);
+    }
+    return front.empty() ? 1 : 0;
+}
@@ -0,0 +1,484 @@
+// Bus master for several controllers sharing one serial bus, used to measure how the
+// aggregate message throughput scales with the number of nodes.
+//
+//   multidrop_bench --nodes 1,2,4,8 [options]
+//
+// Every node is a separate process running the host build of the firmware with its own
+// simulated machine and pty. The bench plays the PC on an RS-485 bus: it addresses each
+// node with "@<node>:", hands out the bus with "@<node>:poll" in round robin until the node
+// answers "eot", acknowledges points and sends types like the PC app, and finally stops all
+// nodes with one broadcast. Bus occupancy is modelled at the configured baud rate, so the
+// reported utilisation and poll cycle are what the wire would allow. See host/README.md.
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include <errno.h>
+#include <poll.h>
+#include <pty.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <termios.h>
+#include <unistd.h>
+
+#include "host_runtime.h"
+#include "pc_link.h"
+#include "sim_machine.h"
+#include "../Project-lib.h"
+
+//============================================================== OPTIONS ==============================================================//
+struct Multidrop_options
+{
+    std::vector<int> node_counts = {1, 2, 4, 8};
+    int fruits = 10;                // per node
+    double rate = 30.0;             // fruits per minute offered to each feeder
+    int points = 4;
+    int speed = 50;
+    double ack_delay_ms = 150.0;
+    double type_delay_ms = 50.0;
+    double baud = 115200.0;
+    double poll_timeout_ms = 20.0;  // node silent this long after a poll loses the token
+    double time_scale = 20.0;
+    double timeout_s = 900.0;       // simulated seconds per round
+    unsigned int seed = 1;
+    bool verbose = false;
+};
+
+static void usage()
+{
+    fprintf(stderr,
+        "usage: multidrop_bench [options]\n"
+        "  --nodes LIST          comma separated node counts, one round each (1,2,4,8)\n"
+        "  --fruits N            fruits per node (10)\n"
+        "  --rate R              fruits/min arriving at each feeder (30)\n"
+        "  --points P            preset measure times (4)\n"
+        "  --speed S             conveyor speed %% (50)\n"
+        "  --ack-delay MS        point acknowledgement delay (150)\n"
+        "  --type-delay MS       MEASURE_PASSED type reply delay (50)\n"
+        "  --baud B              bus bit rate used for occupancy (115200)\n"
+        "  --poll-timeout MS     silence after a poll before the next node is polled (20)\n"
+        "  --time-scale K        simulated time runs K times faster (20)\n"
+        "  --timeout S           give up a round after S simulated seconds (900)\n"
+        "  --seed N              random seed (1)\n"
+        "  --verbose             echo every frame\n");
+    exit(2);
+}
+
+static Multidrop_options parse_options(int argc, char** argv)
+{
+    Multidrop_options o;
+    for (int i = 1; i < argc; i++)
+    {
+        std::string a = argv[i];
+        auto next = [&]() -> const char* { if (i + 1 >= argc) usage(); return argv[++i]; };
+
+        if (a == "--nodes")
+        {
+            o.node_counts.clear();
+            std::string list = next();
+            for (size_t pos = 0; pos < list.size();)
+            {
+                size_t comma = list.find(',', pos);
+                if (comma == std::string::npos) comma = list.size();
+                int n = atoi(list.substr(pos, comma - pos).c_str());
+                if (n < 1 || n > 31) usage();
+                o.node_counts.push_back(n);
+                pos = comma + 1;
+            }
+        }
+        else if (a == "--fruits") o.fruits = atoi(next());
+        else if (a == "--rate") o.rate = atof(next());
+        else if (a == "--points") o.points = atoi(next());
+        else if (a == "--speed") o.speed = atoi(next());
+        else if (a == "--ack-delay") o.ack_delay_ms = atof(next());
+        else if (a == "--type-delay") o.type_delay_ms = atof(next());
+        else if (a == "--baud") o.baud = atof(next());
+        else if (a == "--poll-timeout") o.poll_timeout_ms = atof(next());
+        else if (a == "--time-scale") o.time_scale = atof(next());
+        else if (a == "--timeout") o.timeout_s = atof(next());
+        else if (a == "--seed") o.seed = (unsigned int)atoi(next());
+        else if (a == "--verbose") o.verbose = true;
+        else usage();
+    }
+    if (o.node_counts.empty()) usage();
+    return o;
+}
+
+//============================================================== NODES ==============================================================//
+struct Scheduled_frame
+{
+    uint64_t due_us;
+    std::string payload;
+};
+
+struct Node
+{
+    int address;
+    pid_t pid = -1;
+    int fd = -1;
+    std::string rx;
+    std::vector<Scheduled_frame> replies;   // acks and types waiting for their due time
+    int sorted = 0;
+    long frames_in = 0;
+    bool awake_after_stop = false;
+};
+
+// Child side: one firmware instance on the slave end of its pty, never returns
+static void run_node(int address, int slave, const Multidrop_options& opt)
+{
+    Sim_machine_config cfg;
+    cfg.fruits_per_min = opt.rate;
+    cfg.fruit_count = opt.fruits;
+    cfg.seed = opt.seed + address;
+
+    node_id = address;
+    host_attach_machine(new Sim_machine(cfg));
+    host_serial_attach(slave);
+    host_start_firmware();
+    for (;;) pause();
+}
+
+static void start_nodes(std::vector<Node>& nodes, const Multidrop_options& opt)
+{
+    // All ptys exist before the first fork so every child can close the others
+    std::vector<int> slaves;
+    for (Node& node : nodes)
+    {
+        int master = -1, slave = -1;
+        struct termios tio;
+        memset(&tio, 0, sizeof(tio));
+        cfmakeraw(&tio);
+        if (openpty(&master, &slave, nullptr, &tio, nullptr) != 0) { perror("openpty"); exit(1); }
+        node.fd = master;
+        slaves.push_back(slave);
+    }
+
+    fflush(stdout);
+    for (size_t i = 0; i < nodes.size(); i++)
+    {
+        pid_t pid = fork();
+        if (pid < 0) { perror("fork"); exit(1); }
+        if (pid == 0)
+        {
+            for (size_t j = 0; j < nodes.size(); j++)
+            {
+                close(nodes[j].fd);
+                if (j != i) close(slaves[j]);
+            }
+            run_node(nodes[i].address, slaves[i], opt);
+        }
+        nodes[i].pid = pid;
+    }
+    for (int slave : slaves) close(slave);
+}
+
+static void stop_nodes(std::vector<Node>& nodes)
+{
+    for (Node& node : nodes)
+    {
+        kill(node.pid, SIGKILL);
+        waitpid(node.pid, nullptr, 0);
+        close(node.fd);
+    }
+}
+
+//============================================================== BUS ==============================================================//
+class Bus_master
+{
+    public:
+        Bus_master(const Multidrop_options& options, std::vector<Node>& nodes) : opt(options), nodes(nodes) {}
+
+        bool run();
+        void report();
+
+    private:
+        void send(Node* node, const std::string& payload);
+        void occupy(size_t bytes, uint64_t now);
+        bool read_frames(int timeout_ms, Node* token_holder);
+        void handle_frame(Node& node, const std::string& payload, bool polled);
+        bool wait_for(Node& node, const char* prefix, double timeout_s);
+        void flush_replies();
+        void poll_node(Node& node);
+        int total_sorted() const;
+
+        const Multidrop_options& opt;
+        std::vector<Node>& nodes;
+
+        uint64_t bus_free_us = 0;   // end of the frame currently on the wire
+        uint64_t busy_us = 0;
+        uint64_t start_us = 0;
+        uint64_t end_us = 0;
+        long frames_in = 0;
+        long frames_out = 0;
+        long fruit_frames = 0;
+        long polls = 0;
+        long poll_timeouts = 0;
+        long unsolicited = 0;       // frames from a node that did not hold the bus
+        long cycles = 0;
+        uint64_t cycle_us_total = 0;
+        uint64_t cycle_us_max = 0;
+
+        Node* last_seen = nullptr;  // node whose frame matched the last wait_for prefix
+        std::string last_payload;
+};
+
+void Bus_master::occupy(size_t bytes, uint64_t now)
+{
+    uint64_t frame_us = (uint64_t)(bytes * 10 * 1e6 / opt.baud);
+    uint64_t start = std::max(now, bus_free_us);
+    bus_free_us = start + frame_us;
+    busy_us += frame_us;
+}
+
+void Bus_master::send(Node* node, const std::string& payload)
+{
+    // Wait for the wire, then hold it for the length of the frame
+    uint64_t now = host_now_us();
+    if (bus_free_us > now) host_sleep_us(bus_free_us - now);
+
+    int address = (node != nullptr) ? node->address : BROADCAST_NODE_ID;
+    std::string frame = "@" + std::to_string(address) + ":" + payload + "\n";
+    occupy(frame.size() + 1, host_now_us());
+
+    // A broadcast reaches every node
+    for (Node& target : nodes)
+    {
+        if (node != nullptr && &target != node) continue;
+        size_t done = 0;
+        while (done < frame.size())
+        {
+            ssize_t n = ::write(target.fd, frame.data() + done, frame.size() - done);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) { perror("write"); exit(1); }
+            done += n;
+        }
+    }
+    frames_out++;
+    if (opt.verbose) printf("[%10.3f] PC  -> %s", host_now_us() / 1e6, frame.c_str());
+}
+
+bool Bus_master::read_frames(int timeout_ms, Node* token_holder)
+{
+    std::vector<struct pollfd> fds;
+    for (Node& node : nodes) fds.push_back({node.fd, POLLIN, 0});
+    if (poll(fds.data(), fds.size(), timeout_ms) <= 0) return false;
+
+    bool got_frame = false;
+    for (size_t i = 0; i < nodes.size(); i++)
+    {
+        if ((fds[i].revents & POLLIN) == 0) continue;
+
+        Node& node = nodes[i];
+        char chunk[512];
+        ssize_t n = ::read(node.fd, chunk, sizeof(chunk));
+        if (n <= 0) continue;
+        node.rx.append(chunk, n);
+
+        size_t pos;
+        while ((pos = node.rx.find('\n')) != std::string::npos)
+        {
+            std::string line = node.rx.substr(0, pos);
+            node.rx.erase(0, pos + 1);
+            while (!line.empty() && (line.back() == '\r' || line.back() == ' ')) line.pop_back();
+            if (line.empty()) continue;
+
+            uint64_t now = host_now_us();
+            occupy(line.size() + 2, now);
+            frames_in++;
+            node.frames_in++;
+            if (opt.verbose) printf("[%10.3f] ESP -> %s\n", now / 1e6, line.c_str());
+
+            // Every frame must carry the sender's own address
+            std::string prefix = "@" + std::to_string(node.address) + ":";
+            if (line.compare(0, prefix.size(), prefix) != 0)
+            {
+                fprintf(stderr, "node %d: frame without its address: %s\n", node.address, line.c_str());
+                continue;
+            }
+            handle_frame(node, line.substr(prefix.size()), &node == token_holder);
+            got_frame = true;
+        }
+    }
+    return got_frame;
+}
+
+void Bus_master::handle_frame(Node& node, const std::string& payload, bool polled)
+{
+    last_seen = &node;
+    last_payload = payload;
+
+    Fruit_line fruit;
+    if (!parse_fruit_line(payload, &fruit)) return;
+
+    fruit_frames++;
+    if (!polled) unsolicited++;
+
+    uint64_t now = host_now_us();
+
+    if (fruit_point_request(fruit))
+        node.replies.push_back({now + (uint64_t)(opt.ack_delay_ms * 1000), point_ack_line(fruit.id, fruit.payload)});
+    else if (fruit_type_request(fruit))
+        node.replies.push_back({now + (uint64_t)(opt.type_delay_ms * 1000), type_reply_line(fruit.id, 1 + (int)(fruit.id % 2))});
+    else if (fruit_sorted(fruit)) node.sorted++;
+}
+
+bool Bus_master::wait_for(Node& node, const char* prefix, double timeout_s)
+{
+    uint64_t deadline = host_now_us() + (uint64_t)(timeout_s * 1e6);
+    while (host_now_us() < deadline)
+    {
+        last_seen = nullptr;
+        if (!read_frames(10, &node)) continue;
+        if (last_seen == &node && last_payload.compare(0, strlen(prefix), prefix) == 0) return true;
+    }
+    return false;
+}
+
+void Bus_master::flush_replies()
+{
+    for (Node& node : nodes)
+    {
+        uint64_t now = host_now_us();
+        for (size_t i = 0; i < node.replies.size();)
+        {
+            if (node.replies[i].due_us > now) { i++; continue; }
+            std::string payload = node.replies[i].payload;
+            node.replies.erase(node.replies.begin() + i);
+            send(&node, payload);
+        }
+    }
+}
+
+void Bus_master::poll_node(Node& node)
+{
+    // The node owns the bus until it sends "eot" or stays silent for the poll timeout
+    send(&node, "poll");
+    polls++;
+
+    uint64_t silence_limit = (uint64_t)(opt.poll_timeout_ms * 1000);
+    uint64_t last_activity = host_now_us();
+    for (;;)
+    {
+        last_seen = nullptr;
+        int wait_ms = (int)std::max<uint64_t>(1, host_real_timeout_us(silence_limit) / 1000);
+        if (read_frames(wait_ms, &node))
+        {
+            last_activity = host_now_us();
+            if (last_seen == &node && last_payload == "eot") return;
+        }
+        else if (host_now_us() - last_activity >= silence_limit)
+        {
+            poll_timeouts++;
+            return;
+        }
+    }
+}
+
+int Bus_master::total_sorted() const
+{
+    int sorted = 0;
+    for (const Node& node : nodes) sorted += node.sorted;
+    return sorted;
+}
+
+bool Bus_master::run()
+{
+    // Handshake node by node, the addressed "wake?" switches each node to framed mode
+    for (Node& node : nodes)
+    {
+        send(&node, "wake?");
+        if (!wait_for(node, "awake", 10.0))
+        {
+            fprintf(stderr, "node %d: no 'awake'\n", node.address);
+            return false;
+        }
+
+        Pc_session session;
+        session.points = opt.points;
+        session.speed = opt.speed;
+        send(&node, confirm_line(session, node.address));
+        if (!wait_for(node, "System started", 30.0))
+        {
+            fprintf(stderr, "node %d: did not start\n", node.address);
+            return false;
+        }
+    }
+
+    // Only the traffic while fruits are running counts towards throughput
+    start_us = host_now_us();
+    frames_in = frames_out = fruit_frames = polls = poll_timeouts = unsolicited = 0;
+    busy_us = 0;
+
+    int target = opt.fruits * (int)nodes.size();
+    uint64_t deadline = start_us + (uint64_t)(opt.timeout_s * 1e6);
+    while (total_sorted() < target && host_now_us() < deadline)
+    {
+        uint64_t cycle_start = host_now_us();
+        for (Node& node : nodes)
+        {
+            flush_replies();
+            poll_node(node);
+        }
+        uint64_t cycle = host_now_us() - cycle_start;
+        cycles++;
+        cycle_us_total += cycle;
+        cycle_us_max = std::max(cycle_us_max, cycle);
+    }
+    end_us = host_now_us();
+
+    // One broadcast stops every node, each must then answer a fresh handshake
+    send(nullptr, "stop");
+    host_sleep_us(500000);
+    for (Node& node : nodes)
+    {
+        send(&node, "wake?");
+        node.awake_after_stop = wait_for(node, "awake", 5.0);
+    }
+    return total_sorted() >= target;
+}
+
+void Bus_master::report()
+{
+    double span_s = (end_us - start_us) / 1e6;
+    int stopped = 0;
+    for (const Node& node : nodes) if (node.awake_after_stop) stopped++;
+
+    printf("%5zu %9d %11.2f %11.2f %11.2f %9.1f %9.1f %8.1f %%%9ld %9ld %8d/%zu\n",
+           nodes.size(), total_sorted(), total_sorted() / (span_s / 60.0), fruit_frames / span_s,
+           (frames_in + frames_out) / span_s, cycles ? cycle_us_total / 1000.0 / cycles : 0.0, cycle_us_max / 1000.0,
+           span_s > 0 ? 100.0 * busy_us / (span_s * 1e6) : 0.0, poll_timeouts, unsolicited, stopped, nodes.size());
+}
+
+//============================================================== MAIN ==============================================================//
+int main(int argc, char** argv)
+{
+    Multidrop_options opt = parse_options(argc, argv);
+    signal(SIGPIPE, SIG_IGN);
+
+    printf("multidrop bench: %d fruits/node at %.0f/min, %d points, %.0f baud, time scale %.1f\n\n",
+           opt.fruits, opt.rate, opt.points, opt.baud, opt.time_scale);
+    printf("%5s %9s %11s %11s %11s %9s %9s %10s %9s %9s %10s\n",
+           "nodes", "sorted", "fruits/min", "fruit msg/s", "frames/s", "cycle ms", "cycle max", "bus busy", "poll t/o", "unsolic.", "stop+wake");
+
+    int rc = 0;
+    for (int count : opt.node_counts)
+    {
+        std::vector<Node> nodes(count);
+        for (int i = 0; i < count; i++) nodes[i].address = i + 1;
+
+        host_clock_start(opt.time_scale);
+        start_nodes(nodes, opt);
+
+        Bus_master master(opt, nodes);
+        if (!master.run()) rc = 1;
+        master.report();
+        fflush(stdout);
+
+        stop_nodes(nodes);
+    }
+    return rc;
+}
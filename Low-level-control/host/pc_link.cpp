@@ -0,0 +1,149 @@
+#include "pc_link.h"
+#include "host_runtime.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+//============================================================== MESSAGES ==============================================================//
+std::string confirm_line(const Pc_session& s, int node)
+{
+    std::string line = "confirm|";
+    if (node >= 0) line += std::to_string(node) + "|";
+    line += std::to_string(s.first_id) + "|" + std::to_string(s.points) + "|" + std::to_string(s.speed);
+    if (s.adaptive_max > 0)
+        line += "|" + std::to_string(s.adaptive_min) + "|" + std::to_string(s.adaptive_max) + "|" + std::to_string(s.adaptive_threshold);
+    return line;
+}
+
+bool parse_fruit_line(const std::string& line, Fruit_line* fruit)
+{
+    size_t a = line.find('|');
+    size_t b = (a == std::string::npos) ? a : line.find('|', a + 1);
+    char* end = nullptr;
+    long id = strtol(line.c_str(), &end, 10);
+    if (a == std::string::npos || b == std::string::npos || end != line.c_str() + a) return false;
+
+    size_t c = line.find('|', b + 1);
+    fruit->id = id;
+    fruit->state = line.substr(a + 1, b - a - 1);
+    fruit->payload = atoi(line.c_str() + b + 1);
+    fruit->payload_at = b + 1;
+    fruit->rest_at = (c == std::string::npos) ? c : c + 1;
+    return true;
+}
+
+bool fruit_point_request(const Fruit_line& fruit)
+{
+    return fruit.state == "MEASURE_PROCESSING" && fruit.payload > 0;
+}
+
+bool fruit_type_request(const Fruit_line& fruit)
+{
+    return fruit.state == "MEASURE_PASSED";
+}
+
+bool fruit_sorted(const Fruit_line& fruit)
+{
+    return fruit.state == "SORTING_PASSED" || fruit.state == "SUMMARY";
+}
+
+std::string point_ack_line(long id, int point, int quality)
+{
+    std::string line = std::to_string(id) + "|MEASURE_PROCESSING|" + std::to_string(point);
+    if (quality >= 0) line += "|" + std::to_string(quality);
+    return line;
+}
+
+std::string type_reply_line(long id, int type)
+{
+    return std::to_string(id) + "|MEASURE_PASSED|" + std::to_string(type);
+}
+
+//============================================================== LINK ==============================================================//
+void Pc_link::send_line(const std::string& line)
+{
+    std::string out = line + "\n";
+    size_t done = 0;
+    while (done < out.size())
+    {
+        ssize_t n = ::write(fd, out.data() + done, out.size() - done);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0)
+        {
+            // Firmware threads never return, so the process ends here
+            perror("write");
+            fflush(stdout);
+            _exit(1);
+        }
+        done += n;
+    }
+    lines_out++;
+    if (verbose) printf("[%10.3f] PC  -> %s\n", host_now_us() / 1e6, line.c_str());
+}
+
+bool Pc_link::read_lines(int timeout_ms)
+{
+    struct pollfd p = {fd, POLLIN, 0};
+    if (poll(&p, 1, timeout_ms) <= 0) return false;
+
+    char chunk[512];
+    ssize_t n = ::read(fd, chunk, sizeof(chunk));
+    if (n <= 0) return false;
+
+    uint64_t now = host_now_us();
+    rx.append(chunk, n);
+
+    size_t pos;
+    while ((pos = rx.find('\n')) != std::string::npos)
+    {
+        std::string line = rx.substr(0, pos);
+        rx.erase(0, pos + 1);
+        while (!line.empty() && (line.back() == '\r' || line.back() == ' ')) line.pop_back();
+        if (line.empty()) continue;
+
+        lines_in++;
+        if (verbose) printf("[%10.3f] ESP -> %s\n", now / 1e6, line.c_str());
+        if (waiting_for != nullptr && line.compare(0, strlen(waiting_for), waiting_for) == 0)
+        {
+            matched = line;
+            waiting_for = nullptr;
+        }
+        handler(line, now);
+    }
+    return true;
+}
+
+bool Pc_link::wait_for(const char* prefix, double timeout_s)
+{
+    // Lines that arrive meanwhile still go to the handler
+    uint64_t deadline = host_now_us() + (uint64_t)(timeout_s * 1e6);
+    waiting_for = prefix;
+    while (waiting_for != nullptr && host_now_us() < deadline) read_lines(10);
+
+    bool seen = (waiting_for == nullptr);
+    waiting_for = nullptr;
+    return seen;
+}
+
+bool Pc_link::handshake(const Pc_session& session)
+{
+    // Same order as CitrusSortingApp.py
+    send_line("wake?");
+    if (!wait_for("awake", 10.0))
+    {
+        failure = "no 'awake' from the controller";
+        return false;
+    }
+
+    send_line(confirm_line(session));
+    if (!wait_for("System started", 30.0))
+    {
+        failure = "controller did not start";
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,71 @@
+#pragma once
+
+// PC side of the serial protocol, shared by the host tools: the confirm| line, parsing of the
+// controller's fruit lines and the replies the PC app sends to them, and Pc_link, the line framing
+// and handshake over one serial port or pty. The bus master frames its own lines but builds and
+// parses the messages here.
+
+#include <stdint.h>
+
+#include <functional>
+#include <string>
+
+//============================================================== MESSAGES ==============================================================//
+struct Pc_session
+{
+    long first_id = 1;
+    int points = 4;                 // preset measure times
+    int speed = 50;                 // conveyor speed %
+    int adaptive_min = 0;           // adaptive point count, 0 = fixed
+    int adaptive_max = 0;
+    int adaptive_threshold = 80;
+};
+
+// "confirm|<first id>|<points>|<speed>[|<min>|<max>|<threshold>]", on a bus the node id comes first
+std::string confirm_line(const Pc_session& session, int node = -1);
+
+// "<fruit_id>|<state>|<payload>[|...]", the rest of the line starts at rest_at (SUMMARY fields, stamps)
+struct Fruit_line
+{
+    long id;
+    std::string state;
+    int payload;
+    size_t payload_at;
+    size_t rest_at;                 // npos when the payload is the last field
+};
+
+bool parse_fruit_line(const std::string& line, Fruit_line* fruit);
+bool fruit_point_request(const Fruit_line& fruit);      // MEASURE_PROCESSING with a point, answered by point_ack_line()
+bool fruit_type_request(const Fruit_line& fruit);       // MEASURE_PASSED, answered by type_reply_line()
+bool fruit_sorted(const Fruit_line& fruit);             // SORTING_PASSED, or SUMMARY in summary mode
+
+// Point acknowledgement, with the scan quality for adaptive point counts (quality < 0: none)
+std::string point_ack_line(long id, int point, int quality = -1);
+std::string type_reply_line(long id, int type);
+
+//============================================================== LINK ==============================================================//
+class Pc_link
+{
+    public:
+        // Every received line goes to the handler with the time it was read
+        using Line_handler = std::function<void(const std::string& line, uint64_t now)>;
+
+        Pc_link(int fd, Line_handler handler, bool verbose = false) : fd(fd), handler(handler), verbose(verbose) {}
+
+        void send_line(const std::string& line);
+        bool read_lines(int timeout_ms);
+        bool wait_for(const char* prefix, double timeout_s);    // a line starting with prefix arrives
+        bool handshake(const Pc_session& session);              // wake? and confirm|, failure tells which step
+
+        long lines_in = 0;
+        long lines_out = 0;
+        std::string matched;            // line that ended the last successful wait_for()
+        const char* failure = nullptr;
+
+    private:
+        int fd;
+        Line_handler handler;
+        bool verbose;
+        std::string rx;
+        const char* waiting_for = nullptr;
+};
@@ -0,0 +1,801 @@
+// PC side of the ESP32 serial protocol, used as a load generator and latency benchmark.
+//
+//   protocol_bench --sim [options]           run against the host build of the firmware over a pty
+//   protocol_bench --device /dev/ttyUSB0     run against a real controller
+//
+// It performs the wake?/confirm| handshake, answers every MEASURE_PROCESSING point and every
+// MEASURE_PASSED like the PC app does (with configurable delay, jitter, reordering and
+// duplicates), and reports latency percentiles and lost messages. See host/README.md.
+
+#include <algorithm>
+#include <cmath>
+#include <map>
+#include <mutex>
+#include <random>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <pty.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <unistd.h>
+
+#include "host_runtime.h"
+#include "pc_link.h"
+#include "sim_machine.h"
+#include "../Project-lib.h"
+
+//============================================================== OPTIONS ==============================================================//
+struct Bench_options
+{
+    const char* device = nullptr;
+    bool sim = false;
+    int fruits = 20;
+    double rate = 30.0;             // fruits per minute offered to the feeder (sim)
+    int points = 4;
+    int speed = 50;
+    long first_id = 1;
+    double ack_delay_ms = 150.0;    // PC scan time before a point is acknowledged
+    double ack_jitter_ms = 0.0;
+    double type_delay_ms = 50.0;    // PC model time before the type is sent
+    double reorder = 0.0;           // probability a reply is held back behind the next one
+    double reorder_hold_ms = 500.0;
+    double duplicate = 0.0;         // probability a reply is sent a second time
+    double time_scale = 10.0;       // sim only
+    double timeout_s = 900.0;       // simulated seconds
+    int restart_after = 0;          // send stop then resume once this many fruits are sorted
+    int adaptive_min = 0;           // adaptive point count sent in confirm|, 0 = fixed
+    int adaptive_max = 0;
+    int adaptive_threshold = 80;
+    double convergence = 1.2;       // median points for a fruit's quality to reach 63 %
+    int size_min = 0;               // size limits sent with size|, 0 = no limit
+    int size_max = 0;
+    bool summary = false;           // "report summary": one record per fruit instead of the informational states
+    bool clock_sync = false;        // answer the controller's clock sync and ask for stamped messages
+    double pc_clock_offset_s = 1000.0;  // PC clock at controller time 0, sim only
+    double pc_clock_drift_ppm = 40.0;   // PC oscillator against the controller's, sim only
+    std::vector<Sim_fault> faults;      // sim only
+    unsigned int seed = 1;
+    bool verbose = false;
+    const char* csv = nullptr;
+};
+
+static void usage()
+{
+    fprintf(stderr,
+        "usage: protocol_bench (--sim | --device PATH) [options]\n"
+        "  --fruits N            fruits to run through the line (20)\n"
+        "  --rate R              fruits/min arriving at the feeder, sim only (30)\n"
+        "  --points P            preset measure times sent in confirm| (4)\n"
+        "  --speed S             conveyor speed %% sent in confirm| (50)\n"
+        "  --first-id ID         initial fruit id (1)\n"
+        "  --ack-delay MS        point acknowledgement delay (150)\n"
+        "  --ack-jitter MS       uniform extra delay on every reply (0)\n"
+        "  --type-delay MS       MEASURE_PASSED type reply delay (50)\n"
+        "  --reorder P           probability a reply is held behind the next one (0)\n"
+        "  --reorder-hold MS     longest a held reply waits (500)\n"
+        "  --duplicate P         probability a reply is sent twice (0)\n"
+        "  --time-scale K        simulated time runs K times faster, sim only (10)\n"
+        "  --timeout S           give up after S simulated seconds (900)\n"
+        "  --restart-after N     stop the controller after N sorted fruits and bring it back with resume\n"
+        "  --adaptive MIN,MAX[,Q] adaptive point count, acks carry a quality that reaches Q (80) after a\n"
+        "                        random number of points per fruit\n"
+        "  --convergence K       median points for the quality to reach 63 %% (1.2), spread is log-normal\n"
+        "  --size MIN,MAX        size limits in mm sent with size| after the handshake, 0 for no limit\n"
+        "  --summary             ask for one SUMMARY record per fruit instead of the informational states\n"
+        "  --clock-sync          turn on the controller's clock sync with stamped messages (\"sync stamp\")\n"
+        "                        and report the link latencies on the synchronized clock\n"
+        "  --pc-clock OFFSET,PPM PC clock against the simulated controller clock, sim only (1000,40)\n"
+        "  --fault SPEC          inject a line fault, sim only, repeatable. K is the K-th fruit fed (from 1):\n"
+        "                        remove:K@MM takes it off the belt MM from the gate, miss:SENSOR:K hides it\n"
+        "                        from a sensor, bounce:SENSOR:K makes the sensor flicker as it leaves.\n"
+        "                        SENSOR is input, measure or sorting\n"
+        "  --seed N              random seed (1)\n"
+        "  --csv FILE            write a per-fruit timeline\n"
+        "  --verbose             echo every line\n");
+    exit(2);
+}
+
+static bool parse_fault(const char* spec, std::vector<Sim_fault>& faults)
+{
+    Sim_fault fault = {SIM_FAULT_REMOVE, 0, SIM_INPUT_SENSOR, 0.0};
+    char type[16] = {0}, sensor[16] = {0};
+    int fruit = 0;
+    if (sscanf(spec, "remove:%d@%lf", &fruit, &fault.x_mm) == 2) fault.type = SIM_FAULT_REMOVE;
+    else if (sscanf(spec, "%15[a-z]:%15[a-z]:%d", type, sensor, &fruit) == 3)
+    {
+        if (strcmp(type, "miss") == 0) fault.type = SIM_FAULT_MISS;
+        else if (strcmp(type, "bounce") == 0) fault.type = SIM_FAULT_BOUNCE;
+        else return false;
+
+        if (strcmp(sensor, "input") == 0) fault.sensor = SIM_INPUT_SENSOR;
+        else if (strcmp(sensor, "measure") == 0) fault.sensor = SIM_MEASURE_SENSOR;
+        else if (strcmp(sensor, "sorting") == 0) fault.sensor = SIM_SORTING_SENSOR;
+        else return false;
+    }
+    else return false;
+
+    if (fruit < 1) return false;
+    fault.fruit = fruit - 1;
+    faults.push_back(fault);
+    return true;
+}
+
+static Bench_options parse_options(int argc, char** argv)
+{
+    Bench_options o;
+    for (int i = 1; i < argc; i++)
+    {
+        std::string a = argv[i];
+        auto next = [&]() -> const char* { if (i + 1 >= argc) usage(); return argv[++i]; };
+
+        if (a == "--sim") o.sim = true;
+        else if (a == "--device") o.device = next();
+        else if (a == "--fruits") o.fruits = atoi(next());
+        else if (a == "--rate") o.rate = atof(next());
+        else if (a == "--points") o.points = atoi(next());
+        else if (a == "--speed") o.speed = atoi(next());
+        else if (a == "--first-id") o.first_id = atol(next());
+        else if (a == "--ack-delay") o.ack_delay_ms = atof(next());
+        else if (a == "--ack-jitter") o.ack_jitter_ms = atof(next());
+        else if (a == "--type-delay") o.type_delay_ms = atof(next());
+        else if (a == "--reorder") o.reorder = atof(next());
+        else if (a == "--reorder-hold") o.reorder_hold_ms = atof(next());
+        else if (a == "--duplicate") o.duplicate = atof(next());
+        else if (a == "--time-scale") o.time_scale = atof(next());
+        else if (a == "--timeout") o.timeout_s = atof(next());
+        else if (a == "--restart-after") o.restart_after = atoi(next());
+        else if (a == "--adaptive")
+        {
+            if (sscanf(next(), "%d,%d,%d", &o.adaptive_min, &o.adaptive_max, &o.adaptive_threshold) < 2) usage();
+        }
+        else if (a == "--convergence") o.convergence = atof(next());
+        else if (a == "--size")
+        {
+            if (sscanf(next(), "%d,%d", &o.size_min, &o.size_max) != 2) usage();
+        }
+        else if (a == "--summary") o.summary = true;
+        else if (a == "--clock-sync") o.clock_sync = true;
+        else if (a == "--pc-clock")
+        {
+            if (sscanf(next(), "%lf,%lf", &o.pc_clock_offset_s, &o.pc_clock_drift_ppm) != 2) usage();
+        }
+        else if (a == "--fault")
+        {
+            if (!parse_fault(next(), o.faults)) usage();
+        }
+        else if (a == "--seed") o.seed = (unsigned int)atoi(next());
+        else if (a == "--csv") o.csv = next();
+        else if (a == "--verbose") o.verbose = true;
+        else usage();
+    }
+    if (o.sim == (o.device != nullptr)) usage();
+    if (!o.sim) o.time_scale = 1.0;
+    // Against a real controller the PC clock is the real one
+    if (!o.sim) o.pc_clock_offset_s = o.pc_clock_drift_ppm = 0.0;
+    return o;
+}
+
+//============================================================== STATISTICS ==============================================================//
+struct Latency_series
+{
+    const char* name;
+    std::vector<double> ms;
+
+    void add(uint64_t from_us, uint64_t to_us) { if (to_us >= from_us) ms.push_back((to_us - from_us) / 1000.0); }
+
+    void print() const
+    {
+        if (ms.empty())
+        {
+            printf("  %-34s %6s\n", name, "-");
+            return;
+        }
+        std::vector<double> v = ms;
+        std::sort(v.begin(), v.end());
+        auto pct = [&](double p) { return v[std::min(v.size() - 1, (size_t)(p * (v.size() - 1) + 0.5))]; };
+        double sum = 0;
+        for (double x : v) sum += x;
+        printf("  %-34s %6zu %9.2f %9.2f %9.2f %9.2f %9.2f\n", name, v.size(), sum / v.size(), pct(0.5), pct(0.95), pct(0.99), v.back());
+    }
+};
+
+//============================================================== BENCH ==============================================================//
+enum Reply_kind { REPLY_POINT_ACK, REPLY_TYPE };
+
+struct Pending_reply
+{
+    uint64_t due_us;
+    uint64_t request_us;    // when the request this answers was received
+    std::string text;
+    Reply_kind kind;
+    long fruit_id;
+    bool held;              // waiting behind the next reply (reordering)
+    bool duplicate;         // injected second copy, not timed
+};
+
+struct Fruit_timeline
+{
+    // state (with point for MEASURE_PROCESSING) -> time; with --clock-sync also "sent:<state>" (controller
+    // stamp), "replied:<state>" (PC reply left) and "received:<state>" (controller got the reply)
+    std::map<std::string, uint64_t> first_seen;
+    int points_requested = 0;
+    int points_reported = 0;                        // MEASURE_PASSED payload
+    double convergence = 0.0;                       // points for the quality to reach 63 %, adaptive only
+    int type_sent = 0;
+    int sorted_type = 0;                            // SORTING_PASSED payload, SORTING_TYPE_REJECT for a size reject
+    int summary_faults = 0;                         // FRUIT_FAULT_* bits from SUMMARY
+    uint64_t last_request_us = 0;
+};
+
+class Bench
+{
+    public:
+        Bench(const Bench_options& options, int fd, Sim_machine* machine)
+        : opt(options), link(fd, [this](const std::string& line, uint64_t now) { handle_line(line, now); }, options.verbose),
+          machine(machine), rng(options.seed)
+        {
+            if (machine != nullptr)
+                machine->set_listener([this](Sim_event_type type, int arg, uint64_t t) { on_machine_event(type, arg, t); });
+
+            // A fruit taken off the belt, never seen by the input sensor or never seen by the sorting
+            // sensor has no SORTING_PASSED
+            expected_sorted = options.fruits;
+            for (const Sim_fault& fault : options.faults)
+                if (fault.type == SIM_FAULT_REMOVE || (fault.type == SIM_FAULT_MISS && fault.sensor != SIM_MEASURE_SENSOR))
+                    expected_sorted--;
+        }
+
+        int run();
+
+    private:
+        void handle_line(const std::string& line, uint64_t now);
+        void schedule(Reply_kind kind, long fruit_id, const std::string& text, double delay_ms);
+        void flush_replies(uint64_t now);
+        bool restart();
+        void on_machine_event(Sim_event_type type, int arg, uint64_t t);
+        void report();
+        void write_csv();
+
+        // PC clock for the sync exchange and back, bench time is the simulated time in --sim
+        int64_t pc_clock_us(uint64_t bench_us) const
+        {
+            return (int64_t)(opt.pc_clock_offset_s * 1e6) + (int64_t)(bench_us * (1.0 + opt.pc_clock_drift_ppm * 1e-6));
+        }
+        uint64_t bench_time_us(int64_t pc_us) const
+        {
+            return (uint64_t)((pc_us - (int64_t)(opt.pc_clock_offset_s * 1e6)) / (1.0 + opt.pc_clock_drift_ppm * 1e-6));
+        }
+        void answer_sync(const std::string& line, uint64_t now);
+        void take_receipt(const std::string& line);
+
+        const Bench_options& opt;
+        Pc_link link;
+        Sim_machine* machine;
+        std::mt19937 rng;
+
+        std::string rx;
+        std::vector<Pending_reply> pending;
+        std::map<long, Fruit_timeline> fruits;
+        std::vector<std::string> stats_lines;
+        int sorted = 0;
+        int expected_sorted = 0;
+        long fruit_bytes_in = 0;                    // "<id>|<state>|..." lines with their CR LF
+        uint64_t first_sorted_us = 0;
+        uint64_t last_sorted_us = 0;
+        uint64_t resume_us = 0;
+        std::string resume_line;
+        long sync_exchanges = 0;
+        std::string sync_line;
+        std::map<std::string, uint64_t> replies_sent;   // "<id>|<state>|<value>" -> first copy left the PC
+
+        // Sim only, filled by the machine listener on firmware threads
+        std::mutex event_lock;
+        std::vector<uint64_t> probe_contacts;       // contact times not yet matched to a request
+        std::vector<uint64_t> probe_retracts;       // retract commands not yet matched to an ack
+        std::vector<std::pair<uint64_t, uint64_t>> acks_sent;   // (request, ack sent) not yet matched to a retract
+
+        Latency_series request_delivery{"probe contact -> MEASURE_PROCESSING", {}};
+        Latency_series point_round_trip{"MEASURE_PROCESSING -> point done", {}};
+        Latency_series ack_delivery{"ack sent -> point done", {}};
+        Latency_series request_to_next{"MEASURE_PROCESSING -> next request", {}};
+        Latency_series type_reply{"MEASURE_PASSED -> type reply sent", {}};
+        Latency_series fruit_cycle{"INPUT_ENTERED -> SORTING_PASSED", {}};
+        Latency_series state_transport{"state queued -> PC receive (synced)", {}};
+        Latency_series reply_transport{"reply sent -> controller rx (synced)", {}};
+};
+
+void Bench::schedule(Reply_kind kind, long fruit_id, const std::string& text, double delay_ms)
+{
+    std::uniform_real_distribution<double> unit(0.0, 1.0);
+
+    double jitter = opt.ack_jitter_ms * unit(rng);
+    uint64_t due = host_now_us() + (uint64_t)((delay_ms + jitter) * 1000);
+
+    bool held = unit(rng) < opt.reorder;
+    uint64_t now = host_now_us();
+    pending.push_back({due, now, text, kind, fruit_id, held, false});
+
+    if (unit(rng) < opt.duplicate) pending.push_back({due + (uint64_t)(delay_ms * 1000), now, text, kind, fruit_id, false, true});
+}
+
+void Bench::flush_replies(uint64_t now)
+{
+    std::sort(pending.begin(), pending.end(), [](const Pending_reply& a, const Pending_reply& b) { return a.due_us < b.due_us; });
+
+    for (size_t i = 0; i < pending.size();)
+    {
+        Pending_reply& r = pending[i];
+        uint64_t due = r.held ? r.due_us + (uint64_t)(opt.reorder_hold_ms * 1000) : r.due_us;
+        if (due > now) { i++; continue; }
+
+        Pending_reply sent = r;
+        pending.erase(pending.begin() + i);
+        link.send_line(sent.text);
+
+        // Matched with the controller's receive time from "trace", the quality is not part of the key
+        if (!sent.duplicate && opt.clock_sync)
+        {
+            std::string key = sent.text.substr(0, sent.text.find('|', sent.text.find('|', sent.text.find('|') + 1) + 1));
+            if (replies_sent.count(key) == 0) replies_sent[key] = now;
+            std::string state = key.substr(key.find('|') + 1);
+            Fruit_timeline& f = fruits[sent.fruit_id];
+            if (f.first_seen.count("replied:" + state) == 0) f.first_seen["replied:" + state] = now;
+        }
+
+        // Injected duplicates are not timed
+        if (!sent.duplicate && sent.kind == REPLY_POINT_ACK)
+        {
+            std::lock_guard<std::mutex> guard(event_lock);
+            acks_sent.push_back({sent.request_us, now});
+        }
+        else if (!sent.duplicate) type_reply.add(sent.request_us, now);
+
+        // A reply that was held back goes out right behind the one that overtook it
+        for (size_t j = 0; j < pending.size(); j++)
+        {
+            if (pending[j].held)
+            {
+                pending[j].held = false;
+                pending[j].due_us = now;
+                break;
+            }
+        }
+        i = 0;
+    }
+}
+
+void Bench::on_machine_event(Sim_event_type type, int arg, uint64_t t)
+{
+    std::lock_guard<std::mutex> guard(event_lock);
+    // Probe strokes without a fruit at the station (start-up cycle) are not requests
+    if (type == SIM_PROBE_CONTACT && arg >= 0) probe_contacts.push_back(t);
+    else if (type == SIM_PROBE_RETRACT_COMMAND) probe_retracts.push_back(t);
+}
+
+void Bench::answer_sync(const std::string& line, uint64_t now)
+{
+    // "sync?|<seq>|<t1>" -> "sync|<seq>|<t2>|<t3>", t2 when the request was read, t3 just before the reply
+    size_t a = line.find('|');
+    size_t b = line.find('|', a + 1);
+    if (a == std::string::npos || b == std::string::npos) return;
+
+    std::string sequence = line.substr(a + 1, b - a - 1);
+    int64_t t2 = pc_clock_us(now);
+    int64_t t3 = pc_clock_us(host_now_us());
+    link.send_line("sync|" + sequence + "|" + std::to_string(t2) + "|" + std::to_string(t3));
+    sync_exchanges++;
+}
+
+void Bench::take_receipt(const std::string& line)
+{
+    // "RX|<id>|<state>|<value>|<PC us>"
+    size_t last = line.rfind('|');
+    std::string key = line.substr(3, last - 3);
+    uint64_t received = bench_time_us(strtoll(line.c_str() + last + 1, nullptr, 10));
+
+    auto sent = replies_sent.find(key);
+    if (sent != replies_sent.end()) reply_transport.add(sent->second, received);
+
+    long id = atol(key.c_str());
+    Fruit_timeline& f = fruits[id];
+    std::string state = key.substr(key.find('|') + 1);
+    if (f.first_seen.count("received:" + state) == 0) f.first_seen["received:" + state] = received;
+}
+
+void Bench::handle_line(const std::string& line, uint64_t now)
+{
+    if (line.compare(0, 6, "sync?|") == 0) { answer_sync(line, now); return; }
+    if (line.compare(0, 3, "RX|") == 0) { take_receipt(line); return; }
+
+    Fruit_line fruit;
+    if (!parse_fruit_line(line, &fruit))
+    {
+        if (line.compare(0, 6, "STATS|") == 0 || line.compare(0, 6, "VALVE|") == 0 || line.compare(0, 6, "DWELL|") == 0 ||
+            line.compare(0, 5, "EXEC|") == 0 || line.compare(0, 4, "MEM|") == 0 || line.compare(0, 6, "STACK|") == 0 ||
+            line.compare(0, 5, "HEAP|") == 0 || line.compare(0, 5, "GATE|") == 0 || line.compare(0, 7, "POINTS|") == 0 ||
+            line.compare(0, 5, "SYNC|") == 0 || line.compare(0, 5, "BELT|") == 0 ||
+            line.compare(0, 5, "SIZE|") == 0 || line.compare(0, 7, "RESYNC|") == 0 || line.compare(0, 11, "CORRECTION|") == 0)
+            stats_lines.push_back(line);
+        if (line.compare(0, 5, "SYNC|") == 0) sync_line = line;
+        return;
+    }
+
+    long id = fruit.id;
+    const std::string& state = fruit.state;
+    int payload = fruit.payload;
+    Fruit_timeline& f = fruits[id];
+    fruit_bytes_in += line.size() + 2;
+
+    std::string key = state;
+    if (state == "MEASURE_PROCESSING") key += "|" + std::to_string(payload);
+    if (f.first_seen.count(key) == 0) f.first_seen[key] = now;
+
+    // "<id>|<state>|<payload>|<PC us>" once the controller's clock is synchronized
+    if (state != "SUMMARY" && fruit.rest_at != std::string::npos)
+    {
+        uint64_t queued = bench_time_us(strtoll(line.c_str() + fruit.rest_at, nullptr, 10));
+        state_transport.add(queued, now);
+        if (f.first_seen.count("sent:" + key) == 0) f.first_seen["sent:" + key] = queued;
+    }
+
+    if (f.last_request_us != 0 && (state == "MEASURE_PROCESSING" || state == "MEASURE_PASSED"))
+    {
+        request_to_next.add(f.last_request_us, now);
+        f.last_request_us = 0;
+    }
+
+    if (fruit_point_request(fruit))
+    {
+        f.points_requested++;
+        f.last_request_us = now;
+
+        if (machine != nullptr)
+        {
+            std::lock_guard<std::mutex> guard(event_lock);
+            if (!probe_contacts.empty())
+            {
+                request_delivery.add(probe_contacts.front(), now);
+                probe_contacts.erase(probe_contacts.begin());
+            }
+        }
+
+        int quality = -1;
+        if (opt.adaptive_max > 0)
+        {
+            // Each further scan adds less: quality = 100 * (1 - exp(-points / convergence))
+            if (f.convergence == 0.0)
+                f.convergence = opt.convergence * std::exp(std::normal_distribution<double>(0.0, 0.5)(rng));
+            quality = (int)(100.0 * (1.0 - std::exp(-payload / f.convergence)));
+        }
+        schedule(REPLY_POINT_ACK, id, point_ack_line(id, payload, quality), opt.ack_delay_ms);
+    }
+    else if (fruit_type_request(fruit))
+    {
+        f.points_reported = payload;
+        int type = 1 + (int)(rng() % 2);
+        f.type_sent = type;
+        schedule(REPLY_TYPE, id, type_reply_line(id, type), opt.type_delay_ms);
+    }
+    else if (fruit_sorted(fruit))
+    {
+        f.sorted_type = payload;
+        sorted++;
+        if (first_sorted_us == 0) first_sorted_us = now;
+        last_sorted_us = now;
+        if (f.first_seen.count("INPUT_ENTERED")) fruit_cycle.add(f.first_seen["INPUT_ENTERED"], now);
+
+        // "<id>|SUMMARY|<type>|<diameter>|<points>|<faults>|<stage ms> x5[|<PC us>]", the cycle on the controller clock
+        long diameter = 0, faults = 0, stage_ms[5] = {0};
+        if (state == "SUMMARY" &&
+            sscanf(line.c_str() + fruit.payload_at, "%*d|%ld|%*d|%ld|%ld|%ld|%ld|%ld|%ld", &diameter, &faults, &stage_ms[0], &stage_ms[1],
+                   &stage_ms[2], &stage_ms[3], &stage_ms[4]) == 7)
+        {
+            f.summary_faults = (int)faults;
+            if (stage_ms[4] >= 0) fruit_cycle.add(now - stage_ms[4] * 1000, now);
+        }
+
+        // A fruit's replies are in the controller's receipt ring by now, well inside its length
+        if (opt.clock_sync) link.send_line("trace");
+    }
+}
+
+bool Bench::restart()
+{
+    // Same as an operator stop followed by a PC that only knows the controller came back
+    link.send_line("stop");
+    if (!link.wait_for("Stop command received", 5.0)) return false;
+
+    uint64_t sent = host_now_us();
+    link.send_line("resume");
+    if (!link.wait_for("resumed|", 10.0)) return false;
+
+    resume_us = host_now_us() - sent;
+    resume_line = link.matched;
+    if (opt.clock_sync) link.send_line("sync stamp");
+    return true;
+}
+
+int Bench::run()
+{
+    Pc_session session;
+    session.first_id = opt.first_id;
+    session.points = opt.points;
+    session.speed = opt.speed;
+    session.adaptive_min = opt.adaptive_min;
+    session.adaptive_max = opt.adaptive_max;
+    session.adaptive_threshold = opt.adaptive_threshold;
+    if (!link.handshake(session))
+    {
+        fprintf(stderr, "%s\n", link.failure);
+        return 1;
+    }
+    if (opt.size_min > 0 || opt.size_max > 0)
+    {
+        link.send_line("size|" + std::to_string(opt.size_min) + "|" + std::to_string(opt.size_max));
+        if (!link.wait_for("size|", 2.0))
+        {
+            fprintf(stderr, "controller did not take the size limits\n");
+            return 1;
+        }
+    }
+    if (opt.summary)
+    {
+        link.send_line("report summary");
+        if (!link.wait_for("report|", 2.0))
+        {
+            fprintf(stderr, "controller did not take the report mode\n");
+            return 1;
+        }
+    }
+    if (opt.clock_sync) link.send_line("sync stamp");
+
+    uint64_t start = host_now_us();
+    uint64_t deadline = start + (uint64_t)(opt.timeout_s * 1e6);
+
+    bool restarted = false;
+    while (sorted < expected_sorted && host_now_us() < deadline)
+    {
+        if (opt.restart_after > 0 && !restarted && sorted >= opt.restart_after)
+        {
+            restarted = true;
+            if (!restart())
+            {
+                fprintf(stderr, "controller did not resume\n");
+                return 1;
+            }
+        }
+
+        uint64_t now = host_now_us();
+        flush_replies(now);
+
+        // Sleep until the next reply is due or a line arrives
+        uint64_t next_due = deadline;
+        for (const Pending_reply& r : pending) next_due = std::min(next_due, r.held ? r.due_us + (uint64_t)(opt.reorder_hold_ms * 1000) : r.due_us);
+        uint64_t wait_us = (next_due > now) ? host_real_timeout_us(next_due - now) : 0;
+        link.read_lines((int)std::min<uint64_t>(wait_us / 1000 + 1, 20));
+
+        // Match probe retract commands to the acknowledgements that caused them
+        std::lock_guard<std::mutex> guard(event_lock);
+        while (!probe_retracts.empty() && !acks_sent.empty())
+        {
+            if (probe_retracts.front() < acks_sent.front().second) { probe_retracts.erase(probe_retracts.begin()); continue; }
+            point_round_trip.add(acks_sent.front().first, probe_retracts.front());
+            ack_delivery.add(acks_sent.front().second, probe_retracts.front());
+            acks_sent.erase(acks_sent.begin());
+            probe_retracts.erase(probe_retracts.begin());
+        }
+    }
+
+    // Ask the firmware for its lane counters
+    if (opt.clock_sync)
+    {
+        link.send_line("trace");
+        link.wait_for("RX_END|", 2.0);
+    }
+    link.send_line("stats");
+    link.wait_for("DWELL|", 2.0);
+    link.send_line("memory");
+    link.wait_for("HEAP|", 2.0);
+    link.send_line("resync");
+    link.wait_for("CORRECTION_END|", 2.0);
+
+    report();
+    if (opt.csv != nullptr) write_csv();
+    return (sorted >= expected_sorted) ? 0 : 1;
+}
+
+void Bench::report()
+{
+    // An adaptive fruit is expected to report the points it said it took in MEASURE_PASSED, a reject
+    // only enters and passes the input sensor, enters the measuring station and is sorted. In summary
+    // mode a fruit has its point requests, MEASURE_PASSED and SUMMARY, a reject only SUMMARY
+    int base_states = opt.summary ? 2 : 6;
+    int expected_states = base_states + opt.points;
+    long missing = 0;
+    int complete = 0;
+    int rejected = 0;
+    long points = 0;
+    int fault_counts[4] = {0};              // FRUIT_FAULT_* bits in the summaries
+    for (auto& entry : fruits)
+    {
+        const Fruit_timeline& f = entry.second;
+        if (f.first_seen.count("SORTING_PASSED") == 0 && f.first_seen.count("SUMMARY") == 0) continue;
+        for (int bit = 0; bit < 4; bit++)
+            if (f.summary_faults & (1 << bit)) fault_counts[bit]++;
+        if (f.sorted_type == SORTING_TYPE_REJECT)
+        {
+            // A fruit skipped by the resync never entered the measuring station
+            rejected++;
+            int expected = opt.summary ? 1 : 3 + (int)f.first_seen.count("MEASURE_ENTERED");
+            if ((int)f.first_seen.size() < expected) missing += expected - (int)f.first_seen.size();
+            continue;
+        }
+        complete++;
+        points += f.points_requested;
+        int expected = (opt.adaptive_max > 0) ? base_states + f.points_reported : expected_states;
+        int seen = (int)f.first_seen.size();
+        if (seen < expected) missing += expected - seen;
+    }
+
+    double span_min = (last_sorted_us - first_sorted_us) / 60e6;
+    double rate = (sorted > 1 && span_min > 0) ? (sorted - 1) / span_min : 0.0;
+
+    printf("\n=== protocol bench (%s, time scale %.1f) ===\n", opt.sim ? "host build" : opt.device, opt.time_scale);
+    if (!opt.faults.empty())
+        printf("fruits sorted        : %d / %d (%zu faults injected, %d sorted expected)\n", sorted, opt.fruits, opt.faults.size(), expected_sorted);
+    else printf("fruits sorted        : %d / %d\n", sorted, opt.fruits);
+    printf("throughput           : %.2f fruits/min\n", rate);
+    printf("lines ESP -> PC      : %ld\n", link.lines_in);
+    printf("lines PC -> ESP      : %ld\n", link.lines_out);
+    printf("fruit bytes ESP -> PC: %ld (%.1f per sorted fruit%s)\n", fruit_bytes_in, sorted > 0 ? (double)fruit_bytes_in / sorted : 0.0,
+           opt.summary ? ", summary mode" : "");
+    if (opt.adaptive_max > 0) printf("missing state msgs   : %ld (over %d completed fruits)\n", missing, complete);
+    else printf("missing state msgs   : %ld (over %d completed fruits, %d expected each)\n", missing, complete, expected_states);
+    printf("points per fruit     : %.2f\n", complete > 0 ? (double)points / complete : 0.0);
+    if (opt.size_min > 0 || opt.size_max > 0 || !opt.faults.empty())
+        printf("rejects              : %d (%.1f %% of sorted, not measured)\n", rejected, sorted > 0 ? 100.0 * rejected / sorted : 0.0);
+    if (opt.summary)
+        printf("summary faults       : skipped %d, bounce %d, no type %d, resumed %d\n", fault_counts[0], fault_counts[1],
+               fault_counts[2], fault_counts[3]);
+    for (const std::string& s : stats_lines) printf("firmware %s\n", s.c_str());
+    if (opt.restart_after > 0) printf("stop -> resumed      : %.1f ms (%s)\n", resume_us / 1000.0, resume_line.c_str());
+    if (machine != nullptr) printf("checkpoint writes    : %lu\n", (unsigned long)host_nvs_writes());
+
+    printf("\nlatency (ms)                           count      mean       p50       p95       p99       max\n");
+    if (machine != nullptr)
+    {
+        request_delivery.print();
+        point_round_trip.print();
+        ack_delivery.print();
+    }
+    request_to_next.print();
+    type_reply.print();
+    fruit_cycle.print();
+    if (opt.clock_sync)
+    {
+        state_transport.print();
+        reply_transport.print();
+    }
+
+    // The simulated controller clock is the bench clock, so the fitted offset can be checked
+    if (opt.clock_sync && !sync_line.empty())
+    {
+        long long local_us = 0, offset_us = 0;
+        long drift_ppb = 0;
+        const char* p = strstr(sync_line.c_str(), "local_us=");
+        if (p != nullptr) sscanf(p, "local_us=%lld|offset_us=%lld|drift_ppb=%ld", &local_us, &offset_us, &drift_ppb);
+        printf("\nclock sync exchanges : %ld\n", sync_exchanges);
+        if (machine != nullptr)
+        {
+            long long truth = pc_clock_us((uint64_t)local_us) - local_us;
+            printf("clock offset error   : %lld us (drift %ld ppb fitted, %.0f ppb set)\n", offset_us - truth, drift_ppb,
+                   opt.pc_clock_drift_ppm * 1000.0);
+        }
+    }
+
+    if (machine != nullptr)
+    {
+        int wrong_bin = 0, checked = 0, misgraded = 0;
+        std::vector<Sim_fruit> sim = machine->fruits();
+        long unseen = 0;
+        for (size_t i = 0; i < sim.size(); i++)
+        {
+            // A fruit the input sensor missed has no id and must go to the reject bin, the fruits after
+            // it take its id
+            if (sim[i].missed_by == SIM_INPUT_SENSOR)
+            {
+                unseen++;
+                if (sim[i].sorting_angle < 0) continue;
+                checked++;
+                if (sim[i].sorting_angle != SORTING_ANGLE_REJECT) wrong_bin++;
+                continue;
+            }
+
+            auto it = fruits.find(opt.first_id + (long)i - unseen);
+            if (it == fruits.end() || sim[i].sorting_angle < 0) continue;
+
+            // The firmware rounds to whole mm, a fruit within half a mm of a limit may go either way
+            bool reject = it->second.sorted_type == SORTING_TYPE_REJECT;
+            double d = sim[i].diameter_mm;
+            bool under = opt.size_min > 0 && d < opt.size_min - 0.5, over = opt.size_max > 0 && d > opt.size_max + 0.5;
+            bool inside = (opt.size_min == 0 || d >= opt.size_min + 0.5) && (opt.size_max == 0 || d <= opt.size_max - 0.5);
+            if (sim[i].missed_by != SIM_MEASURE_SENSOR && ((reject && inside) || (!reject && (under || over)))) misgraded++;
+
+            if (!reject && it->second.type_sent == 0) continue;
+            int expected_angle = reject ? SORTING_ANGLE_REJECT
+                               : (it->second.type_sent == 1) ? SORTING_ANGLE_TYPE_1 : SORTING_ANGLE_TYPE_2;
+            checked++;
+            if (sim[i].sorting_angle != expected_angle) wrong_bin++;
+        }
+        printf("\nfruits in wrong bin  : %d / %d\n", wrong_bin, checked);
+        if (opt.size_min > 0 || opt.size_max > 0) printf("graded against sim   : %d misgraded\n", misgraded);
+    }
+}
+
+void Bench::write_csv()
+{
+    FILE* f = fopen(opt.csv, "w");
+    if (f == nullptr) { perror(opt.csv); return; }
+
+    fprintf(f, "fruit_id,state,time_s\n");
+    for (auto& entry : fruits)
+        for (auto& seen : entry.second.first_seen)
+            fprintf(f, "%ld,%s,%.6f\n", entry.first, seen.first.c_str(), seen.second / 1e6);
+    fclose(f);
+}
+
+//============================================================== MAIN ==============================================================//
+static int open_device(const char* path)
+{
+    int fd = open(path, O_RDWR | O_NOCTTY);
+    if (fd < 0) { perror(path); exit(1); }
+
+    struct termios tio;
+    tcgetattr(fd, &tio);
+    cfmakeraw(&tio);
+    cfsetispeed(&tio, B115200);
+    cfsetospeed(&tio, B115200);
+    tcsetattr(fd, TCSANOW, &tio);
+    return fd;
+}
+
+int main(int argc, char** argv)
+{
+    Bench_options opt = parse_options(argc, argv);
+    host_clock_start(opt.time_scale);
+
+    int fd = -1;
+    Sim_machine* machine = nullptr;
+
+    if (opt.sim)
+    {
+        int master = -1, slave = -1;
+        struct termios tio;
+        memset(&tio, 0, sizeof(tio));
+        cfmakeraw(&tio);
+        if (openpty(&master, &slave, nullptr, &tio, nullptr) != 0) { perror("openpty"); return 1; }
+
+        Sim_machine_config cfg;
+        cfg.fruits_per_min = opt.rate;
+        cfg.fruit_count = opt.fruits;
+        cfg.seed = opt.seed;
+        cfg.faults = opt.faults;
+
+        machine = new Sim_machine(cfg);
+        host_attach_machine(machine);
+        host_serial_attach(slave);
+        host_start_firmware();
+        fd = master;
+    }
+    else fd = open_device(opt.device);
+
+    Bench bench(opt, fd, machine);
+    int rc = bench.run();
+
+    fflush(stdout);
+    _exit(rc);   // firmware threads never return
+}
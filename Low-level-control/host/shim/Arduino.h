@@ -0,0 +1,101 @@
+#pragma once
+
+// Host build of the Arduino-ESP32 API used by the firmware. Time is simulated (see
+// host_runtime.h), pins are routed to the simulated machine, Serial is a file descriptor.
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <math.h>
+#include <strings.h>
+#include <functional>
+
+#include "freertos/FreeRTOS.h"
+
+#define HIGH 1
+#define LOW 0
+
+#define INPUT 0x01
+#define OUTPUT 0x03
+#define INPUT_PULLUP 0x05
+
+#define constrain(amt, low, high) ((amt) < (low) ? (low) : ((amt) > (high) ? (high) : (amt)))
+
+long map(long x, long in_min, long in_max, long out_min, long out_max);
+
+unsigned long millis();
+unsigned long micros();
+void delay(uint32_t ms);
+void delayMicroseconds(uint32_t us);
+size_t getArduinoLoopTaskStackSize();
+
+void pinMode(uint8_t pin, uint8_t mode);
+void digitalWrite(uint8_t pin, uint8_t val);
+int digitalRead(uint8_t pin);
+
+bool ledcAttach(uint8_t pin, uint32_t freq, uint8_t resolution);
+bool ledcWrite(uint8_t pin, uint32_t duty);
+
+struct hw_timer_s;
+typedef struct hw_timer_s hw_timer_t;
+
+hw_timer_t* timerBegin(uint32_t frequency);
+void timerEnd(hw_timer_t* timer);
+void timerAttachInterrupt(hw_timer_t* timer, void (*userFunc)(void));
+void timerAlarm(hw_timer_t* timer, uint64_t alarm_value, bool autoreload, uint64_t reload_count);
+void timerStart(hw_timer_t* timer);
+void timerStop(hw_timer_t* timer);
+void timerWrite(hw_timer_t* timer, uint64_t value);
+
+// Heap figures are fixed on the host, the process heap says nothing about the controller's
+class EspClass
+{
+    public:
+        uint32_t getHeapSize();
+        uint32_t getFreeHeap();
+        uint32_t getMinFreeHeap();
+};
+
+extern EspClass ESP;
+
+typedef std::function<void(void)> OnReceiveCb;
+
+enum SerialMode { UART_MODE_UART = 0, UART_MODE_RS485_HALF_DUPLEX = 1 };
+
+class HardwareSerial
+{
+    public:
+        void begin(unsigned long baud);
+        void end();
+
+        int available();
+        int read();
+        size_t read(uint8_t* buffer, size_t size);
+        size_t readBytesUntil(char terminator, char* buffer, size_t length);
+        void setTimeout(unsigned long timeout_ms);
+        void onReceive(OnReceiveCb function, bool onlyOnTimeout = false);
+        bool setPins(int8_t rxPin, int8_t txPin, int8_t ctsPin = -1, int8_t rtsPin = -1);
+        bool setMode(SerialMode mode);
+
+        size_t write(uint8_t c);
+        size_t write(const uint8_t* buffer, size_t size);
+        void flush();
+
+        size_t print(const char* s);
+        size_t print(char c);
+        size_t print(int n);
+        size_t print(unsigned int n);
+        size_t print(long n);
+        size_t print(unsigned long n);
+        size_t println(const char* s);
+        size_t println(int n);
+        size_t println(unsigned int n);
+        size_t println(long n);
+        size_t println(unsigned long n);
+        size_t println();
+        size_t printf(const char* format, ...) __attribute__((format(printf, 2, 3)));
+};
+
+extern HardwareSerial Serial;
@@ -0,0 +1,2 @@
+#pragma once
+// Nothing from ESP32Servo is used directly, servos are driven through ledcWrite().
@@ -0,0 +1,22 @@
+#pragma once
+
+// NVS key/value store of the Arduino-ESP32 core. The host build keeps it in memory, so it
+// survives "stop" and a restart of the firmware inside one process.
+
+#include <stddef.h>
+
+class Preferences
+{
+    public:
+        bool begin(const char* name, bool readOnly = false);
+        void end();
+
+        size_t putBytes(const char* key, const void* value, size_t len);
+        size_t getBytes(const char* key, void* buf, size_t maxLen);
+        size_t getBytesLength(const char* key);
+        bool remove(const char* key);
+        bool clear();
+
+    private:
+        char name_space[16] = {0};
+};
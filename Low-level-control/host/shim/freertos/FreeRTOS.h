@@ -0,0 +1,38 @@
+#pragma once
+
+// Host build of the FreeRTOS subset used by the firmware, tasks run as std::threads.
+
+#include <stdint.h>
+#include <mutex>
+
+typedef int BaseType_t;
+typedef unsigned int UBaseType_t;
+typedef uint32_t TickType_t;
+typedef uint8_t StackType_t;
+
+#define pdTRUE 1
+#define pdFALSE 0
+#define pdPASS pdTRUE
+#define pdFAIL pdFALSE
+
+#define portMAX_DELAY ((TickType_t)0xffffffffUL)
+#define portTICK_PERIOD_MS 1
+#define pdMS_TO_TICKS(ms) ((TickType_t)(ms))
+
+#define IRAM_ATTR
+#define RTC_NOINIT_ATTR
+
+struct portMUX_TYPE
+{
+    std::recursive_mutex lock;
+};
+
+#define portMUX_INITIALIZER_UNLOCKED {}
+
+inline void portENTER_CRITICAL(portMUX_TYPE* mux) { mux->lock.lock(); }
+inline void portEXIT_CRITICAL(portMUX_TYPE* mux) { mux->lock.unlock(); }
+inline void portENTER_CRITICAL_ISR(portMUX_TYPE* mux) { mux->lock.lock(); }
+inline void portEXIT_CRITICAL_ISR(portMUX_TYPE* mux) { mux->lock.unlock(); }
+#define portYIELD_FROM_ISR(...) ((void)0)
+
+int xPortGetCoreID();
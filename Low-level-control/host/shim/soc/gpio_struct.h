@@ -0,0 +1,35 @@
+#pragma once
+#include <stdint.h>
+
+// Same member names as the ESP32 GPIO register block. Writes and reads go through the
+// simulated machine instead of memory.
+void host_gpio_write_mask(int bank, uint32_t mask, bool level);
+uint32_t host_gpio_read_bank(int bank);
+
+struct Host_gpio_set_register
+{
+    int bank;
+    bool level;
+    void operator=(uint32_t mask) const { host_gpio_write_mask(bank, mask, level); }
+};
+
+struct Host_gpio_in_register
+{
+    int bank;
+    operator uint32_t() const { return host_gpio_read_bank(bank); }
+};
+
+struct Host_gpio_set_register_1 { Host_gpio_set_register val; };
+struct Host_gpio_in_register_1 { Host_gpio_in_register val; };
+
+struct Host_gpio_dev
+{
+    Host_gpio_set_register out_w1ts{0, true};
+    Host_gpio_set_register out_w1tc{0, false};
+    Host_gpio_set_register_1 out1_w1ts{{1, true}};
+    Host_gpio_set_register_1 out1_w1tc{{1, false}};
+    Host_gpio_in_register in{0};
+    Host_gpio_in_register_1 in1{{1}};
+};
+
+extern const Host_gpio_dev GPIO;
@@ -0,0 +1,258 @@
+#include "sim_machine.h"
+
+#include "../Project-lib.h"
+
+#include <math.h>
+
+static int servo_angle(uint32_t duty, uint8_t resolution_bits)
+{
+    // Inverse of myServo::set_angle(): 1000-2000 us pulse in a 20 ms period
+    double max_duty = (double)((1UL << resolution_bits) - 1);
+    double pulse_us = duty * 20000.0 / max_duty;
+    return (int)lround((pulse_us - 1000.0) * 180.0 / 1000.0);
+}
+
+bool Sim_machine::Cylinder::contact(uint64_t now_us) const
+{
+    double elapsed_ms = (now_us - changed_us) / 1000.0;
+    return extended ? (elapsed_ms >= extend_ms) : (elapsed_ms < retract_ms);
+}
+
+Sim_machine::Sim_machine(const Sim_machine_config& config)
+: cfg(config)
+{
+    std::mt19937 rng(cfg.seed);
+    std::normal_distribution<double> diameter(cfg.diameter_mean_mm, cfg.diameter_stddev_mm);
+    std::exponential_distribution<double> gap(cfg.fruits_per_min / 60.0);
+
+    double t_s = 0.0;
+    for (int i = 0; i < cfg.fruit_count; i++)
+    {
+        Sim_fruit f;
+        f.diameter_mm = fmax(20.0, diameter(rng));
+        f.arrival_us = (uint64_t)(t_s * 1e6);
+        fruit_list.push_back(f);
+        t_s += cfg.poisson_arrivals ? gap(rng) : 60.0 / cfg.fruits_per_min;
+    }
+
+    for (const Sim_fault& fault : cfg.faults)
+    {
+        if (fault.fruit < 0 || fault.fruit >= (int)fruit_list.size()) continue;
+        Sim_fruit& f = fruit_list[fault.fruit];
+        if (fault.type == SIM_FAULT_REMOVE) f.remove_at_mm = fault.x_mm;
+        else if (fault.type == SIM_FAULT_MISS) f.missed_by = fault.sensor;
+        else f.bounces_at = fault.sensor;
+    }
+
+    gripper.extend_ms = cfg.grip_ms;
+    gripper.retract_ms = cfg.release_ms;
+    probe.extend_ms = cfg.probe_extend_ms;
+    probe.retract_ms = cfg.probe_retract_ms;
+    stepper_steps = cfg.stepper_start_steps;
+}
+
+void Sim_machine::set_listener(std::function<void(Sim_event_type, int, uint64_t)> l)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    listener = l;
+}
+
+void Sim_machine::emit(Sim_event_type type, int arg, uint64_t now_us)
+{
+    if (listener) listener(type, arg, now_us);
+}
+
+void Sim_machine::advance(uint64_t now_us)
+{
+    if (now_us <= last_us) return;
+    double dt_s = (now_us - last_us) / 1e6;
+    double dx = conveyor_percent / 100.0 * cfg.belt_mm_per_s_at_full * dt_s;
+    last_us = now_us;
+
+    for (size_t i = 0; i < fruit_list.size(); i++)
+    {
+        Sim_fruit& f = fruit_list[i];
+        if (!f.released || f.exited) continue;
+
+        double old_x = f.x_mm;
+        f.x_mm += dx;
+
+        // The flap position that counts is the one when the fruit reaches it
+        if (old_x < cfg.flap_mm && f.x_mm >= cfg.flap_mm) f.sorting_angle = sorting_angle;
+
+        // Taken off the belt, it never reaches a bin
+        if (f.remove_at_mm >= 0.0 && f.x_mm >= f.remove_at_mm)
+        {
+            f.removed = true;
+            f.exited = true;
+            f.exited_us = now_us;
+            emit(SIM_FRUIT_EXITED, (int)i, now_us);
+            continue;
+        }
+
+        if (f.x_mm - f.diameter_mm / 2 > cfg.belt_end_mm)
+        {
+            f.exited = true;
+            f.exited_us = now_us;
+            emit(SIM_FRUIT_EXITED, (int)i, now_us);
+        }
+    }
+
+    // Let the next waiting fruit through an open gate once the previous one has cleared it
+    bool gate_open = gate_angle < (GATE_OPEN_ANGLE + GATE_CLOSE_ANGLE) / 2;
+    if (!gate_open) return;
+
+    for (size_t i = 0; i < fruit_list.size(); i++)
+    {
+        Sim_fruit& f = fruit_list[i];
+        if (f.released) continue;
+        if (f.arrival_us > now_us) break;
+
+        if (i > 0)
+        {
+            const Sim_fruit& prev = fruit_list[i - 1];
+            if (!prev.exited && prev.x_mm - prev.diameter_mm / 2 < cfg.gate_mm + cfg.release_gap_mm + f.diameter_mm) break;
+        }
+
+        f.released = true;
+        f.released_us = now_us;
+        f.x_mm = cfg.gate_mm - f.diameter_mm / 2;
+        emit(SIM_FRUIT_RELEASED, (int)i, now_us);
+        break;
+    }
+}
+
+bool Sim_machine::occluded(Sim_sensor sensor, double sensor_mm)
+{
+    for (size_t i = 0; i < fruit_list.size(); i++)
+    {
+        const Sim_fruit& f = fruit_list[i];
+        if (!f.released || f.exited || f.missed_by == sensor) continue;
+
+        double offset = f.x_mm - sensor_mm;
+        if (fabs(offset) >= f.diameter_mm / 2) continue;
+
+        // A short clear reading while the back of the fruit passes
+        double back = f.diameter_mm / 2 - offset;
+        if (f.bounces_at == sensor && back > 5.0 && back <= 5.0 + SIM_BOUNCE_GAP_MM) continue;
+        return true;
+    }
+    return false;
+}
+
+int Sim_machine::fruit_at(double position_mm)
+{
+    for (size_t i = 0; i < fruit_list.size(); i++)
+    {
+        const Sim_fruit& f = fruit_list[i];
+        if (f.released && !f.exited && fabs(f.x_mm - position_mm) < f.diameter_mm / 2) return (int)i;
+    }
+    return -1;
+}
+
+bool Sim_machine::read_input(int pin, uint64_t now_us)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    advance(now_us);
+
+    // Sensors and switches pull the line low when triggered
+    if (pin == INPUT_SENSOR_PIN) return !occluded(SIM_INPUT_SENSOR, cfg.input_sensor_mm);
+    if (pin == MEASURE_SENSOR_PIN) return !occluded(SIM_MEASURE_SENSOR, cfg.measure_sensor_mm);
+    if (pin == SORTING_SENSOR_PIN) return !occluded(SIM_SORTING_SENSOR, cfg.sorting_sensor_mm);
+
+    if (pin == GRIPPER_DETECT_CONTACT_SWITCH_PIN_1 || pin == GRIPPER_DETECT_CONTACT_SWITCH_PIN_2) return !gripper.contact(now_us);
+    if (pin == PROBE_DETECT_CONTACT_SWITCH_PIN)
+    {
+        bool touching = probe.contact(now_us);
+        int index = fruit_at(cfg.measure_sensor_mm);
+
+        if (touching && index >= 0 && !fruit_list[index].centering_recorded)
+        {
+            fruit_list[index].centering_error_mm = fruit_list[index].x_mm - cfg.measure_sensor_mm;
+            fruit_list[index].centering_recorded = true;
+        }
+        return !touching;
+    }
+    if (pin == GRIPPER_HOMING_SWITCH_PIN) return !(stepper_steps <= 0);
+
+    return HIGH;
+}
+
+void Sim_machine::output_changed(int pin, bool level, uint64_t now_us)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    advance(now_us);
+
+    if (pin == GRIPPER_STEPPER_DIR_PIN) stepper_dir_positive = level;
+    else if (pin == GRIPPER_STEPPER_PUL_PIN && level)
+    {
+        // The firmware starts at full rate without a ramp: a pulse that comes sooner after the last
+        // step than the motor can follow does not move it
+        if (stepper_last_step_us != 0 && now_us - stepper_last_step_us < cfg.stepper_min_step_us) stepper_lost++;
+        else
+        {
+            stepper_steps += stepper_dir_positive ? 1 : -1;
+            stepper_last_step_us = now_us;
+        }
+    }
+
+    // Only the valve side being energised moves a cylinder, mid position holds it
+    else if (level && (pin == GRIPPER_CYLINDER_GRIP_VALVE_PIN || pin == GRIPPER_CYLINDER_RELEASE_VALVE_PIN))
+    {
+        bool extend = (pin == GRIPPER_CYLINDER_GRIP_VALVE_PIN);
+        if (gripper.extended != extend) gripper.changed_us = now_us;
+        gripper.extended = extend;
+    }
+    else if (level && (pin == PROBE_CYLINDER_EXTEND_VALVE_PIN || pin == PROBE_CYLINDER_RETRACT_VALVE_PIN))
+    {
+        bool extend = (pin == PROBE_CYLINDER_EXTEND_VALVE_PIN);
+        if (probe.extended != extend)
+        {
+            probe.changed_us = now_us;
+            if (extend)
+            {
+                // Report when the contact will close so tools can time the firmware's reaction
+                emit(SIM_PROBE_CONTACT, fruit_at(cfg.measure_sensor_mm), now_us + (uint64_t)(cfg.probe_extend_ms * 1000));
+            }
+            else emit(SIM_PROBE_RETRACT_COMMAND, fruit_at(cfg.measure_sensor_mm), now_us);
+        }
+        probe.extended = extend;
+    }
+}
+
+void Sim_machine::pwm_changed(int pin, uint32_t duty, uint8_t resolution_bits, uint64_t now_us)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    advance(now_us);
+
+    if (pin == CONVEYOR_MOTOR_PIN)
+    {
+        double percent = duty * 100.0 / ((1UL << resolution_bits) - 1);
+        if (percent == 0.0 && conveyor_percent > 0.0) emit(SIM_CONVEYOR_STOPPED, fruit_at(cfg.measure_sensor_mm), now_us);
+        conveyor_percent = percent;
+    }
+    else if (pin == GATE_SERVO_PIN) gate_angle = servo_angle(duty, resolution_bits);
+    else if (pin == SORTING_SERVO_PIN) sorting_angle = servo_angle(duty, resolution_bits);
+}
+
+std::vector<Sim_fruit> Sim_machine::fruits()
+{
+    std::lock_guard<std::mutex> guard(lock);
+    advance(host_now_us());
+    return fruit_list;
+}
+
+long Sim_machine::lost_steps()
+{
+    std::lock_guard<std::mutex> guard(lock);
+    return stepper_lost;
+}
+
+int Sim_machine::exited_count()
+{
+    std::lock_guard<std::mutex> guard(lock);
+    advance(host_now_us());
+    int n = 0;
+    for (const Sim_fruit& f : fruit_list) if (f.exited) n++;
+    return n;
+}
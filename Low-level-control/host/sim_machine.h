@@ -0,0 +1,143 @@
+#pragma once
+
+// Simulated sorting line for the host build: feeder and gate, belt with fruits, the three
+// photo sensors, gripper and probe cylinders with contact switches, gripper stepper with its
+// homing switch, and the sorting flap. Pin numbers come from the firmware's board description.
+
+#include "host_runtime.h"
+
+#include <functional>
+#include <mutex>
+#include <random>
+#include <vector>
+
+enum Sim_sensor
+{
+    SIM_INPUT_SENSOR,
+    SIM_MEASURE_SENSOR,
+    SIM_SORTING_SENSOR
+};
+
+enum Sim_fault_type
+{
+    SIM_FAULT_REMOVE,           // fruit taken off the belt at x_mm
+    SIM_FAULT_MISS,             // sensor does not see the fruit
+    SIM_FAULT_BOUNCE            // sensor reads clear for SIM_BOUNCE_GAP_MM while the fruit's back passes
+};
+
+#define SIM_BOUNCE_GAP_MM 3.0
+
+struct Sim_fault
+{
+    Sim_fault_type type;
+    int fruit;                  // sim fruit index
+    Sim_sensor sensor;          // MISS and BOUNCE
+    double x_mm;                // REMOVE
+};
+
+struct Sim_machine_config
+{
+    double belt_mm_per_s_at_full = 250.0;   // belt speed at 100 % conveyor duty
+
+    double gate_mm = 0.0;                   // positions along the belt
+    double input_sensor_mm = 150.0;
+    double measure_sensor_mm = 450.0;
+    double flap_mm = 750.0;                 // fruit is diverted here, the sorting sensor sits behind the flap
+    double sorting_sensor_mm = 800.0;
+    double belt_end_mm = 900.0;
+
+    double fruits_per_min = 30.0;           // rate fruits reach the feeder behind the gate
+    bool poisson_arrivals = true;
+    int fruit_count = 20;
+    double diameter_mean_mm = 70.0;
+    double diameter_stddev_mm = 8.0;
+    double release_gap_mm = 20.0;           // gap kept between fruits let through the gate
+
+    double grip_ms = 120.0;                 // command to contact switch change
+    double release_ms = 150.0;
+    double probe_extend_ms = 100.0;
+    double probe_retract_ms = 120.0;
+
+    long stepper_start_steps = 40;          // distance from the homing switch at power on
+    double stepper_min_step_us = 1200.0;    // pull-in rate of the loaded gripper, a faster pulse loses the step
+
+    std::vector<Sim_fault> faults;
+
+    unsigned int seed = 1;
+};
+
+enum Sim_event_type
+{
+    SIM_FRUIT_RELEASED,         // arg: sim fruit index
+    SIM_PROBE_CONTACT,          // probe touched the fruit, arg: sim fruit index at the station or -1
+    SIM_PROBE_RETRACT_COMMAND,  // firmware commanded the probe back
+    SIM_CONVEYOR_STOPPED,       // arg: sim fruit index at the station or -1
+    SIM_FRUIT_EXITED            // arg: sim fruit index
+};
+
+struct Sim_fruit
+{
+    double diameter_mm;
+    uint64_t arrival_us;        // reaches the feeder
+    bool released = false;
+    bool exited = false;
+    double x_mm = 0.0;          // centre position along the belt
+    uint64_t released_us = 0;
+    uint64_t exited_us = 0;
+    int sorting_angle = -1;     // flap angle when the fruit's centre reached the flap
+    double centering_error_mm = 0.0;
+    bool centering_recorded = false;
+    double remove_at_mm = -1.0;             // injected faults, see Sim_fault
+    int missed_by = -1;                     // Sim_sensor
+    int bounces_at = -1;                    // Sim_sensor
+    bool removed = false;
+};
+
+class Sim_machine : public Host_machine
+{
+    public:
+        explicit Sim_machine(const Sim_machine_config& config);
+
+        bool read_input(int pin, uint64_t now_us) override;
+        void output_changed(int pin, bool level, uint64_t now_us) override;
+        void pwm_changed(int pin, uint32_t duty, uint8_t resolution_bits, uint64_t now_us) override;
+
+        // Called from firmware threads with the machine lock held, must not touch GPIO
+        void set_listener(std::function<void(Sim_event_type, int, uint64_t)> listener);
+
+        std::vector<Sim_fruit> fruits();
+        int exited_count();
+        long lost_steps();
+
+    private:
+        struct Cylinder
+        {
+            bool extended = false;          // target end of the stroke
+            uint64_t changed_us = 0;
+            double extend_ms = 0;
+            double retract_ms = 0;
+            bool contact(uint64_t now_us) const;
+        };
+
+        void advance(uint64_t now_us);
+        bool occluded(Sim_sensor sensor, double sensor_mm);
+        int fruit_at(double position_mm);
+        void emit(Sim_event_type type, int arg, uint64_t now_us);
+
+        Sim_machine_config cfg;
+        std::mutex lock;
+        std::function<void(Sim_event_type, int, uint64_t)> listener;
+
+        std::vector<Sim_fruit> fruit_list;
+        uint64_t last_us = 0;
+        double conveyor_percent = 0.0;
+        int gate_angle = 180;
+        int sorting_angle = 90;
+
+        Cylinder gripper;
+        Cylinder probe;
+        bool stepper_dir_positive = false;
+        long stepper_steps = 0;
+        uint64_t stepper_last_step_us = 0;
+        long stepper_lost = 0;
+};